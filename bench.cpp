@@ -0,0 +1,366 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Microbenchmarks for the hot kernels of the conversion pipeline. Every input
+// is synthesized from a fixed seed, so results are comparable between runs
+// and between builds.
+
+#include <chrono>
+#include <functional>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iff2gif.h"
+
+static int Width = 640, Height = 512;
+static double MinSeconds = 0.25;
+static std::string Filter;
+
+// A small deterministic PRNG (xorshift32), so inputs don't depend on the C library.
+class Random
+{
+public:
+	Random(uint32_t seed) : State(seed ? seed : 1) {}
+	uint32_t operator()() noexcept
+	{
+		State ^= State << 13;
+		State ^= State >> 17;
+		State ^= State << 5;
+		return State;
+	}
+	uint32_t operator()(uint32_t limit) noexcept { return (*this)() % limit; }
+
+private:
+	uint32_t State;
+};
+
+// Runs func repeatedly for at least MinSeconds and reports the average time
+// per call, both per output pixel and as throughput of the input bytes.
+static void Bench(const char *name, size_t pixels, size_t bytes, const std::function<void()> &func)
+{
+	if (!Filter.empty() && strstr(name, Filter.c_str()) == nullptr)
+	{
+		return;
+	}
+	func();		// Warm up caches and the allocator.
+	auto start = std::chrono::steady_clock::now();
+	std::chrono::duration<double> elapsed;
+	uint64_t calls = 0;
+	do
+	{
+		func();
+		calls++;
+		elapsed = std::chrono::steady_clock::now() - start;
+	} while (elapsed.count() < MinSeconds);
+	double percall = elapsed.count() / calls;
+	printf("%-24s %10.3f ns/pixel %10.1f MB/s %8llu calls\n", name,
+		percall * 1e9 / pixels, bytes / percall / 1e6, (unsigned long long)calls);
+	fflush(stdout);
+}
+
+// Fills a chunky image with horizontal runs of random colors. This is closer
+// to real artwork than pure noise, while still giving LZW something to chew on.
+static void FillRuns(uint8_t *pixels, size_t count, int numcolors, Random &rand)
+{
+	for (size_t i = 0; i < count;)
+	{
+		size_t run = std::min<size_t>(1 + rand(16), count - i);
+		memset(pixels + i, rand(numcolors), run);
+		i += run;
+	}
+}
+
+static void BenchPlanar(Random &rand)
+{
+	static const int depths[] = { 1, 2, 3, 4, 5, 6, 7, 8, 16, 24, 32 };
+	std::vector<uint8_t> chunky(Width * Height);
+	std::vector<uint8_t> out(Width * Height * 4);
+	for (int depth : depths)
+	{
+		PlanarBitmap planar(Width, Height, depth);
+		if (depth <= 8)
+		{
+			FillRuns(&chunky[0], chunky.size(), 1 << depth, rand);
+			planar.FromChunky(&chunky[0], 0);
+		}
+		else for (int i = 0; i < planar.Pitch * Height * depth; ++i)
+		{
+			planar.PlaneData[i] = uint8_t(rand());
+		}
+		char name[32];
+		snprintf(name, countof(name), "ToChunky/%d", depth);
+		Bench(name, Width * Height, planar.Pitch * Height * depth, [&] { planar.ToChunky(&out[0], 0); });
+	}
+}
+
+static void BenchExpand(Random &rand)
+{
+	for (int bpp : { 1, 2, 4 })
+	{
+		ChunkyBitmap chunky(Width * 2, Height * 2, bpp);
+		for (int i = 0; i < chunky.Pitch * chunky.Height; ++i)
+		{
+			chunky.Pixels[i] = uint8_t(rand());
+		}
+		char name[32];
+		snprintf(name, countof(name), "Expand%d/2x2", bpp);
+		Bench(name, chunky.Width * chunky.Height, Width * Height * bpp, [&] { chunky.Expand(2, 2); });
+	}
+}
+
+static void BenchColor(Random &rand)
+{
+	std::vector<ColorRegister> pal(64);
+	for (auto &c : pal)
+	{
+		c = ColorRegister(rand(256), rand(256), rand(256));
+	}
+	ChunkyBitmap ham6(Width, Height), ham8(Width, Height);
+	FillRuns(ham6.Pixels, Width * Height, 64, rand);
+	FillRuns(ham8.Pixels, Width * Height, 256, rand);
+	Bench("HAM6toRGB", Width * Height, Width * Height, [&] { ham6.HAM6toRGB(pal); });
+	Bench("HAM8toRGB", Width * Height, Width * Height, [&] { ham8.HAM8toRGB(pal); });
+
+	ChunkyBitmap rgb = ham8.HAM8toRGB(pal);
+	for (int mode = 0; mode <= 8; ++mode)
+	{
+		char name[32];
+		snprintf(name, countof(name), "RGBtoPalette/%d", mode);
+		Bench(name, Width * Height, Width * Height * 4, [&] { rgb.RGBtoPalette(*DumbPalette(), mode); });
+	}
+
+	// An adaptive palette is made once for many frames, and its lookup table
+	// fills up on the first of them, so this is the cost for the rest.
+	ColorHistogram histogram;
+	Bench("ColorHistogram", Width * Height, Width * Height * 4, [&] { histogram.Clear(); histogram.Add(rgb); });
+	Bench("MakePalette", Width * Height, Width * Height * 4, [&] { histogram.MakePalette(255); });
+	ColorLookup lookup(histogram.MakePalette(255));
+	for (int mode : { 0, 1 })
+	{
+		char name[32];
+		snprintf(name, countof(name), "RGBtoPalette/adaptive/%d", mode);
+		Bench(name, Width * Height, Width * Height * 4, [&] { rgb.RGBtoPalette(lookup, mode); });
+	}
+}
+
+static void BenchEncode(Random &rand)
+{
+	// The current frame differs from the previous one in a centered rectangle
+	// covering a quarter of the image.
+	ChunkyBitmap prev(Width, Height), cur(Width, Height);
+	FillRuns(prev.Pixels, Width * Height, 32, rand);
+	memcpy(cur.Pixels, prev.Pixels, Width * Height);
+	for (int y = Height / 4; y < Height * 3 / 4; ++y)
+	{
+		FillRuns(cur.Pixels + y * Width + Width / 4, Width / 2, 31, rand);
+	}
+	ImageDescriptor full = { 0, 0, uint16_t(Width), uint16_t(Height), 0 };
+	Bench("MinimumArea", Width * Height, Width * Height * 2, [&] {
+		ImageDescriptor imd = full;
+		GIFWriter::MinimumArea(prev, cur, imd);
+	});
+	Bench("MinCodeSize", Width * Height, Width * Height, [&] {
+		MinCodeSize(cur, full, -1);
+	});
+	std::vector<uint8_t> lzw;
+	Bench("LZWCompress", Width * Height, Width * Height, [&] {
+		lzw.clear();
+		LZWCompress(lzw, full, prev, cur, 5, -1);
+	});
+	Bench("LZWCompress/trans", Width * Height, Width * Height * 2, [&] {
+		lzw.clear();
+		LZWCompress(lzw, full, prev, cur, 5, 31);
+	});
+	Bench("LZWCompress/either", Width * Height, Width * Height * 2, [&] {
+		lzw.clear();
+		LZWCompress(lzw, full, prev, cur, 5, 31, nullptr, true);
+	});
+	LossyLZW lossy(*DumbPalette(), 40);
+	Bench("LZWCompress/lossy", Width * Height, Width * Height, [&] {
+		lzw.clear();
+		LZWCompress(lzw, full, prev, cur, 5, -1, &lossy);
+	});
+}
+
+// Runs short animations through a whole GIFWriter at every effort level.
+// Each frame moves a box of new pixels across a background that stays put.
+// One color is never used, so there is always one for transparency.
+static void BenchWriter(Random &rand)
+{
+	const int numframes = 8, depth = 5;
+	std::vector<std::vector<uint8_t>> frames(numframes, std::vector<uint8_t>(Width * Height));
+	FillRuns(&frames[0][0], Width * Height, (1 << depth) - 1, rand);
+	for (int i = 1; i < numframes; ++i)
+	{
+		frames[i] = frames[0];
+		int left = Width * i / (numframes * 2), top = Height * i / (numframes * 2);
+		for (int y = top; y < top + Height / 2; ++y)
+		{
+			FillRuns(&frames[i][y * Width + left], Width / 2, (1 << depth) - 1, rand);
+		}
+	}
+	FrameInfo info;
+	info.Width = Width;
+	info.Height = Height;
+	info.NumPlanes = depth;
+	info.Palette = std::vector<ColorRegister>(DumbPalette()->begin(), DumbPalette()->begin() + (1 << depth));
+	info.Delay = 1;
+	for (int effort = 0; effort <= 4; ++effort)
+	{
+		char name[32];
+		snprintf(name, countof(name), "GIFWriter/O%d", effort);
+		GIFOptions options;
+		options.Effort = effort;
+		options.Quiet = true;
+		Bench(name, Width * Height * numframes, Width * Height * numframes, [&] {
+			MemorySink sink([](std::vector<uint8_t> &&) { return true; });
+			GIFWriter writer(sink, _T("bench.gif"), options);
+			for (auto &frame : frames)
+			{
+				ChunkyBitmap chunky(Width, Height);
+				memcpy(chunky.Pixels, frame.data(), frame.size());
+				writer.AddFrame(info, std::move(chunky));
+			}
+			writer.Finish();
+		});
+	}
+}
+
+static void BenchDecode(Random &rand)
+{
+	const int depth = 5;
+	std::vector<uint8_t> chunky(Width * Height);
+	FillRuns(&chunky[0], chunky.size(), 1 << depth, rand);
+	PlanarBitmap planar(Width, Height, depth);
+	planar.FromChunky(&chunky[0], 0);
+
+	BitmapHeader header = {};
+	header.w = Width;
+	header.h = Height;
+	header.nPlanes = depth;
+	for (int compress = 0; compress <= 1; ++compress)
+	{
+		std::vector<uint8_t> body;
+		PackBody(planar, Compression(compress), body);
+		header.compression = compress;
+		Bench(compress ? "UnpackBody/ByteRun1" : "UnpackBody/none", Width * Height, body.size(),
+			[&] { UnpackBody(&planar, header, (uint32_t)body.size(), &body[0]); });
+	}
+
+	static const struct
+	{
+		const char *name;
+		int op;
+		bool longdata;
+		void(*func)(PlanarBitmap *, AnimHeader *, uint32_t, const void *);
+	} deltas[] = {
+		{ "Delta5", 5, false, Delta5 },
+		{ "Delta7Short", 7, false, Delta7Short },
+		{ "Delta7Long", 7, true, Delta7Long },
+		{ "Delta8Short", 8, false, Delta8Short },
+		{ "Delta8Long", 8, true, Delta8Long },
+	};
+	// Each delta draws the whole image over a blank one, so only the
+	// background can be skipped.
+	PlanarBitmap blank(Width, Height, depth);
+	for (int p = 0; p < depth; ++p)
+	{
+		blank.FillBitplane(p, false);
+	}
+	for (auto &d : deltas)
+	{
+		std::vector<uint8_t> delta;
+		MakeDelta(blank, planar, d.op, d.longdata, delta);
+		AnimHeader head = {};
+		head.operation = d.op;
+		head.bits = d.longdata ? ANIM_LONG_DATA : 0;
+		Bench(d.name, Width * Height, delta.size(),
+			[&] { d.func(&planar, &head, (uint32_t)delta.size(), &delta[0]); });
+	}
+
+	std::vector<uint8_t> body;
+	PackBody(planar, cmpByteRun1, body);
+	std::vector<uint8_t> packed = PowerPack(&body[0], body.size());
+	Bench("PPUnpack", Width * Height, packed.size(), [&] {
+		unsigned unpackedsize;
+		UnpackPowerPacker(&packed[0], packed.size(), unpackedsize);
+	});
+}
+
+static int usage(_TCHAR *progname)
+{
+	_ftprintf(stderr, _T(
+"Usage: %s [options] [filter]\n"
+"  Runs every benchmark whose name contains [filter].\n"
+"  Options:\n"
+"    -w <width>       Width of the synthetic images. Default 640.\n"
+"    -h <height>      Height of the synthetic images. Default 512.\n"
+"    -t <seconds>     Minimum time to run each benchmark. Default 0.25.\n"
+),
+		progname);
+	return 1;
+}
+
+int _tmain(int argc, _TCHAR *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:h:t:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'w':
+			Width = _ttoi(optarg);
+			break;
+		case 'h':
+			Height = _ttoi(optarg);
+			break;
+		case 't':
+			MinSeconds = _tcstod(optarg, nullptr);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (Width < 16 || Height < 4)
+	{
+		_ftprintf(stderr, _T("Images must be at least 16x4\n"));
+		return 1;
+	}
+	if (optind < argc)
+	{
+		// Benchmark names are plain ASCII, so a narrowing copy is good enough.
+		for (const _TCHAR *c = argv[optind]; *c != 0; ++c)
+		{
+			Filter += char(*c);
+		}
+	}
+	// Keep widths a multiple of 16, like real bitplanes.
+	Width &= ~15;
+	printf("%dx%d pixels\n", Width, Height);
+
+	Random rand(0x1FF2C1F);
+	BenchPlanar(rand);
+	BenchExpand(rand);
+	BenchColor(rand);
+	BenchEncode(rand);
+	BenchWriter(rand);
+	BenchDecode(rand);
+	return 0;
+}
@@ -0,0 +1,298 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Size budgets: Instead of converting frames as they come in, GIFWriter keeps
+// them, and once it has all of them, converts them again and again, giving up
+// a little more quality each time, until the GIF is small enough.
+//
+// Quality is given up in this order: Lossy LZW, then dithering, then every
+// other frame, and then size. Each of those but the lossy level changes the
+// frames themselves, so for each one, the frames are scaled and reduced to
+// 256 colors once, and only LZW compression is done for every lossy level
+// tried with them. That is done for every frame, since lossy LZW can change
+// any of them, and the frames after one that changed are diffed against it.
+
+#include <algorithm>
+#include <limits.h>
+#include <stdio.h>
+#include "iff2gif.h"
+
+// The most lossy LZW a budget will use, and how close the search for the
+// least lossy level that fits gets to it.
+static const int MAX_LOSSY = 60;
+static const int LOSSY_STEP = 5;
+
+struct GIFWriter::BudgetStep
+{
+	int Dither;
+	int Decimate;		// Keep one of every this many frames
+	int Scale, Shrink;
+};
+
+void GIFWriter::Record(FrameInfo &info, ChunkyBitmap &&chunky)
+{
+	if (FrameCount == 0)
+	{
+		if (!Quiet) printf("%dx%dx%d\n", info.Width, info.Height, info.NumPlanes);
+		// The frames are converted again with the clips settled by now.
+		BudgetOptions.Clips = Clips;
+		BudgetOptions.Preview = 0;
+	}
+	FrameCount++;
+	Recording.push_back({ info, std::move(chunky) });
+	if (!Clips.empty() && FrameCount == Clips[0].second)
+	{
+		Clips.erase(begin(Clips));
+	}
+}
+
+// Makes the frames for one step: Every frame that is kept is scaled and
+// reduced to 256 colors, like AddChunky would do it, except that an adaptive
+// palette is made from all of them. The time between dropped frames goes to
+// the next one that is kept.
+void GIFWriter::Prepare(const BudgetStep &step, std::vector<HeldFrame> &frames) const
+{
+	GIFOptions options = BudgetOptions;
+	options.ScaleX *= step.Scale;
+	options.ScaleY *= step.Scale;
+	options.ShrinkX *= step.Shrink;
+	options.ShrinkY *= step.Shrink;
+	FramePrep prep(options);
+	// The frames at the end that repeat the start of the ANIM are never dropped,
+	// so that the writer can still recognize them.
+	size_t last = Recording.size() - std::min<size_t>(Recording.back().Info.Interleave, Recording.size());
+	int delay = 0;
+
+	frames.clear();
+	for (size_t i = 0; i < Recording.size(); ++i)
+	{
+		const HeldFrame &in = Recording[i];
+		delay += in.Info.Delay;
+		if (i < last && i % step.Decimate != 0)
+		{
+			continue;
+		}
+		HeldFrame out;
+		out.Info = in.Info;
+		out.Chunky = prep.Convert(out.Info, in.Chunky.Scaled(1, 1));
+		if (out.Chunky.IsEmpty())
+		{
+			frames.clear();
+			return;
+		}
+		// These are ready to be written as they are, once they have a palette.
+		out.Info.ModeID = 0;
+		out.Info.Delay = delay;
+		delay = 0;
+		frames.push_back(std::move(out));
+	}
+
+	std::unique_ptr<ColorLookup> lookup;
+	if (!BudgetOptions.FixedPalette)
+	{
+		ColorHistogram histogram;
+		for (const HeldFrame &frame : frames)
+		{
+			if (frame.Chunky.BytesPerPixel != 1)
+			{
+				histogram.Add(frame.Chunky);
+			}
+		}
+		lookup = std::make_unique<ColorLookup>(histogram.MakePalette(255));
+	}
+	for (HeldFrame &frame : frames)
+	{
+		if (frame.Chunky.BytesPerPixel != 1)
+		{
+			frame.Chunky = lookup != nullptr ? frame.Chunky.RGBtoPalette(*lookup, step.Dither) :
+				frame.Chunky.RGBtoPalette(*DumbPalette(), step.Dither);
+			frame.Info.Palette = lookup != nullptr ? lookup->Palette : *DumbPalette();
+			frame.Info.NumPlanes = 8;
+		}
+	}
+}
+
+// Converts prepared frames to a GIF with the given lossy level.
+bool GIFWriter::Encode(const std::vector<HeldFrame> &frames, bool decimated, int lossy, std::vector<uint8_t> &gif,
+	FrameLog *log) const
+{
+	GIFOptions options = BudgetOptions;
+	options.ScaleX = options.ScaleY = options.ShrinkX = options.ShrinkY = 1;
+	options.AspectScale = false;
+	options.Crop = CropRect();
+	options.AutoCrop = false;
+	options.Lossy = lossy;
+	options.Quiet = true;
+	if (decimated)
+	{
+		options.Clips.clear();
+	}
+	gif.clear();
+	MemorySink sink([&gif](std::vector<uint8_t> &&out)
+	{
+		gif = std::move(out);
+		return true;
+	});
+	GIFWriter writer(sink, BaseFilename, options);
+	writer.SetFrameLog(log);
+	for (const HeldFrame &frame : frames)
+	{
+		if (writer.IsDone())
+		{
+			break;
+		}
+		FrameInfo info = frame.Info;
+		writer.AddFrame(info, frame.Chunky.Scaled(1, 1));
+	}
+	return writer.Finish() && !gif.empty();
+}
+
+bool GIFWriter::FitBudget()
+{
+	if (Recording.empty())
+	{
+		return true;
+	}
+	bool truecolor = false;
+	for (const HeldFrame &frame : Recording)
+	{
+		truecolor |= frame.Chunky.BytesPerPixel != 1 || (frame.Info.ModeID & HAM) != 0;
+	}
+	// Frames can only be dropped if all of them are being converted.
+	bool candrop = BudgetOptions.Clips.size() == 1 && BudgetOptions.Clips[0].first == 1 &&
+		BudgetOptions.Clips[0].second == UINT_MAX && Recording.size() > 2;
+	int dither = BudgetOptions.DiffusionMode;
+	std::vector<BudgetStep> steps = { { dither, 1, 1, 1 } };
+	if (truecolor && dither != 0)
+	{
+		steps.push_back({ dither = 0, 1, 1, 1 });
+	}
+	int decimate = candrop ? 2 : 1;
+	if (candrop)
+	{
+		steps.push_back({ dither, decimate, 1, 1 });
+	}
+	for (auto scale : { std::make_pair(3, 4), std::make_pair(1, 2), std::make_pair(1, 3), std::make_pair(1, 4) })
+	{
+		steps.push_back({ dither, decimate, scale.first, scale.second });
+	}
+
+	std::vector<HeldFrame> frames;
+	std::vector<uint8_t> gif, best, smallest;
+	const BudgetStep *fit = nullptr;
+	int fitlossy = 0;
+	uint64_t limit = Budget;
+	for (const BudgetStep &step : steps)
+	{
+		Prepare(step, frames);
+		if (frames.empty())
+		{
+			break;
+		}
+		// Don't scale it down to nothing, but always try it at full size.
+		if (step.Scale < step.Shrink && (frames[0].Chunky.Width < 16 || frames[0].Chunky.Height < 16))
+		{
+			break;
+		}
+		bool decimated = step.Decimate > 1;
+		int lo = BudgetOptions.Lossy;
+		if (!Encode(frames, decimated, lo, gif, nullptr))
+		{
+			return false;
+		}
+		if (&step == &steps[0] && BudgetPerSecond)
+		{
+			// The frames that are dropped are made up for by the ones kept, so
+			// the length stays the same for every step.
+			uint32_t centisecs = 0;
+			CountGIFFrames(gif, &centisecs);
+			limit = (uint64_t)Budget * std::max(centisecs, 100u) / 100;
+		}
+		if (smallest.empty() || gif.size() < smallest.size())
+		{
+			smallest = gif;
+		}
+		if (gif.size() <= limit)
+		{
+			best = std::move(gif);
+			fit = &step;
+			fitlossy = lo;
+			break;
+		}
+		if (lo >= MAX_LOSSY)
+		{
+			continue;
+		}
+		// Is it small enough at the most lossy level? If so, look for the
+		// least lossy one that is.
+		int hi = MAX_LOSSY;
+		if (!Encode(frames, decimated, hi, best, nullptr))
+		{
+			return false;
+		}
+		if (best.size() < smallest.size())
+		{
+			smallest = best;
+		}
+		if (best.size() > limit)
+		{
+			best.clear();
+			continue;
+		}
+		while (hi - lo > LOSSY_STEP)
+		{
+			int mid = (lo + hi) / 2;
+			if (!Encode(frames, decimated, mid, gif, nullptr))
+			{
+				return false;
+			}
+			if (gif.size() <= limit)
+			{
+				hi = mid;
+				best = std::move(gif);
+			}
+			else
+			{
+				lo = mid;
+			}
+		}
+		fit = &step;
+		fitlossy = hi;
+		break;
+	}
+	if (fit == nullptr)
+	{
+		fprintf(stderr, "Could not fit the GIF in %llu bytes. The smallest it got was %zu bytes.\n",
+			(unsigned long long)limit, smallest.size());
+		return false;
+	}
+	if (!Quiet)
+	{
+		printf("%zu bytes, with dithering %d, lossy %d, scaled by %d/%d, keeping 1 of every %d frames\n",
+			best.size(), fit->Dither, fitlossy, fit->Scale, fit->Shrink, fit->Decimate);
+	}
+	if (Log != nullptr)
+	{
+		// Make it again, just for the log.
+		Prepare(*fit, frames);
+		Encode(frames, fit->Decimate > 1, fitlossy, gif, Log);
+	}
+	BudgetWritten = CountGIFFrames(best);
+	bool ok = Sink.Begin(BaseFilename) && Sink.Write(best.data(), best.size());
+	return Sink.End(ok);
+}
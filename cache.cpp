@@ -0,0 +1,187 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <string.h>
+#include "iff2gif.h"
+
+namespace fs = std::filesystem;
+
+// Change this whenever the same input and options produce a different GIF
+// than before, so that old entries stop being used.
+static const char CacheVersion[] = "iff2gif-9";
+
+static uint64_t FNV1a(const void *data, size_t len, uint64_t hash = 0xcbf29ce484222325ull)
+{
+	const uint8_t *p = (const uint8_t *)data;
+	for (size_t i = 0; i < len; ++i)
+	{
+		hash = (hash ^ p[i]) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+// Entries are spread across subdirectories named after the first two
+// characters of their key, to keep each directory a reasonable size.
+static fs::path EntryPath(const tstring &dir, const std::string &key)
+{
+	return fs::path(dir) / key.substr(0, 2) / (key + ".gif");
+}
+
+// The key is the hash of the input followed by the hash of the options.
+// Options that don't change the GIF (e.g. Quiet) are left out. A GIF that had
+// to give up anything to meet a deadline is never stored, but one that didn't
+// still isn't the same as without it, since a deadline also skips the things
+// that take too long to even try (see GIFWriter's constructor). Which deadline
+// it was doesn't matter, only that there was one.
+std::string GIFCache::Key(const void *data, size_t len, const GIFOptions &options) const
+{
+	auto clips = options.Clips;
+	SortClips(clips);
+	std::string desc = CacheVersion;
+	desc += " x" + std::to_string(options.ScaleX) + "/" + std::to_string(options.ShrinkX);
+	desc += " y" + std::to_string(options.ScaleY) + "/" + std::to_string(options.ShrinkY);
+	desc += " a" + std::to_string(options.AspectScale);
+	desc += " d" + std::to_string(options.DiffusionMode);
+	desc += " r" + std::to_string(options.ForcedRate);
+	desc += " p" + std::to_string(options.Preview);
+	if (options.FixedPalette)
+	{
+		desc += " Pfixed";
+	}
+	if (options.Lossy != 0)
+	{
+		desc += " l" + std::to_string(options.Lossy);
+	}
+	if (options.Effort != 1)
+	{
+		desc += " O" + std::to_string(options.Effort);
+	}
+	if (options.Budget != 0)
+	{
+		desc += " b" + std::to_string(options.Budget) + (options.BudgetPerSecond ? "/s" : "");
+	}
+	if (options.Deadline != 0)
+	{
+		desc += " T";
+	}
+	if (options.AutoCrop)
+	{
+		desc += " Cauto";
+	}
+	else if (options.Crop.Width != 0)
+	{
+		desc += " C" + std::to_string(options.Crop.Left) + "," + std::to_string(options.Crop.Top) + "," +
+			std::to_string(options.Crop.Width) + "," + std::to_string(options.Crop.Height);
+	}
+	for (auto &clip : clips)
+	{
+		desc += " c" + std::to_string(clip.first) + "-" + std::to_string(clip.second);
+	}
+
+	char key[34];
+	snprintf(key, sizeof(key), "%016llx-%016llx",
+		(unsigned long long)FNV1a(data, len),
+		(unsigned long long)FNV1a(desc.data(), desc.size()));
+	return key;
+}
+
+bool GIFCache::Fetch(const std::string &key, std::vector<uint8_t> &gif) const
+{
+	std::ifstream file(EntryPath(Dir, key), std::ios_base::in | std::ios_base::binary);
+	if (!file.is_open())
+	{
+		return false;
+	}
+	file.seekg(0, file.end);
+	gif.resize((size_t)file.tellg());
+	file.seekg(0, file.beg);
+	// Entries are never written in place, so anything that doesn't look like
+	// a complete GIF was put there by someone else.
+	return file.read((char *)gif.data(), gif.size()) &&
+		gif.size() > 13 && memcmp(&gif[0], "GIF89a", 6) == 0 && gif.back() == 0x3B;
+}
+
+void GIFCache::Store(const std::string &key, const std::vector<uint8_t> &gif) const
+{
+	fs::path entry = EntryPath(Dir, key);
+	std::error_code err;
+	fs::create_directories(entry.parent_path(), err);
+
+	// Write it under a name no one else will use, then rename it into place,
+	// so that nobody ever sees a partial entry. If more than one process
+	// stores the same entry at once, they're all the same, so it doesn't
+	// matter which one wins.
+	std::random_device random;
+	fs::path temp = entry;
+	temp += "." + std::to_string(random()) + std::to_string(random()) + ".tmp";
+	std::ofstream file(temp, std::ios_base::out | std::ios_base::binary | std::ios_base::trunc);
+	bool wrote = file.is_open() && file.write((const char *)gif.data(), gif.size());
+	file.close();
+	if (wrote && !file.fail())
+	{
+		fs::rename(temp, entry, err);
+	}
+	else
+	{
+		err = std::make_error_code(std::errc::io_error);
+	}
+	if (err)
+	{
+		fprintf(stderr, "Could not add %s to the cache: %s\n", key.c_str(), err.message().c_str());
+		fs::remove(temp, err);
+	}
+}
+
+bool GIFCache::Convert(const void *data, size_t len, const GIFOptions &options, const _TCHAR *name,
+	std::vector<uint8_t> &gif, uint32_t &frames, std::string *degraded) const
+{
+	std::string key = Key(data, len, options);
+	if (Fetch(key, gif))
+	{
+		frames = CountGIFFrames(gif);
+		return true;
+	}
+	GIFOptions single = options;
+	single.Solo = false;
+	gif.clear();
+	MemorySink sink([&gif](std::vector<uint8_t> &&out)
+	{
+		gif = std::move(out);
+		return true;
+	});
+	GIFWriter writer(sink, _T("memory.gif"), single);
+	bool loaded = LoadMemory(data, len, writer, name);
+	if (!writer.Finish() || !loaded || gif.empty())
+	{
+		return false;
+	}
+	frames = writer.GetFramesWritten();
+	if (degraded != nullptr)
+	{
+		*degraded = writer.DescribeDegraded();
+	}
+	if (writer.GetDegraded() == 0)
+	{
+		Store(key, gif);
+	}
+	return true;
+}
@@ -17,18 +17,27 @@
 */
 
 #include <assert.h>
+#include <limits.h>
+#include <string.h>
 #include <array>
 #include <algorithm>
 #include "iff2gif.h"
 
-ChunkyBitmap::ChunkyBitmap(const PlanarBitmap &planar, int scalex, int scaley)
+ChunkyBitmap::ChunkyBitmap(const PlanarBitmap &planar, int scalex, int scaley, const CropRect *crop)
 {
 	assert(scalex != 0);
 	assert(scaley != 0);
-	Alloc(planar.Width * scalex,
-		  planar.Height * scaley,
+	CropRect all;
+	if (crop == nullptr)
+	{
+		all.Width = planar.Width;
+		all.Height = planar.Height;
+		crop = &all;
+	}
+	Alloc(crop->Width * scalex,
+		  crop->Height * scaley,
 		  planar.NumPlanes <= 8 ? 1 : planar.NumPlanes <= 16 ? 2 : 4);
-	planar.ToChunky(Pixels, Width - planar.Width);
+	planar.ToChunky(Pixels, Width - crop->Width, crop->Left, crop->Top, crop->Width, crop->Height);
 	if (scalex != 1 || scaley != 1)
 	{
 		Expand(scalex, scaley);
@@ -126,6 +135,19 @@ void ChunkyBitmap::SetSolidColor(int color) noexcept
 	}
 }
 
+void ChunkyBitmap::Remap(const uint8_t remap[256]) noexcept
+{
+	assert(BytesPerPixel == 1);
+	uint8_t *pix = Pixels;
+	for (int y = 0; y < Height; ++y, pix += Pitch)
+	{
+		for (int x = 0; x < Width; ++x)
+		{
+			pix[x] = remap[pix[x]];
+		}
+	}
+}
+
 // Expansion is done in-place, with the original image located
 // in the upper-left corner of the "destination" image.
 void ChunkyBitmap::Expand(int scalex, int scaley) noexcept
@@ -148,6 +170,101 @@ void ChunkyBitmap::Expand(int scalex, int scaley) noexcept
 	}
 }
 
+ChunkyBitmap ChunkyBitmap::Scaled(int scalex, int scaley) const
+{
+	ChunkyBitmap out(Width * scalex, Height * scaley, BytesPerPixel);
+	for (int y = 0; y < Height; ++y)
+	{
+		memcpy(out.Pixels + y * out.Pitch, Pixels + y * Pitch, Width * BytesPerPixel);
+	}
+	out.Expand(scalex, scaley);
+	return out;
+}
+
+ChunkyBitmap ChunkyBitmap::Cropped(const CropRect &rect) const
+{
+	assert(rect.Left >= 0 && rect.Top >= 0 && rect.Left + rect.Width <= Width && rect.Top + rect.Height <= Height);
+	ChunkyBitmap out(rect.Width, rect.Height, BytesPerPixel);
+	for (int y = 0; y < rect.Height; ++y)
+	{
+		memcpy(out.Pixels + y * out.Pitch, Pixels + (rect.Top + y) * Pitch + rect.Left * BytesPerPixel, out.Pitch);
+	}
+	return out;
+}
+
+ChunkyBitmap ChunkyBitmap::Shrunk(int divx, int divy) const
+{
+	assert(divx >= 1 && divy >= 1);
+	assert(BytesPerPixel == 1 || BytesPerPixel == 4);
+	// Partial blocks at the right and bottom edges still make a pixel.
+	ChunkyBitmap out((Width + divx - 1) / divx, (Height + divy - 1) / divy, BytesPerPixel);
+	if (BytesPerPixel == 1)
+	{
+		Shrink1(out, divx, divy);
+	}
+	else
+	{
+		Shrink4(out, divx, divy);
+	}
+	return out;
+}
+
+// Palette indices can't be averaged, so take the pixel in the middle of each block.
+void ChunkyBitmap::Shrink1(ChunkyBitmap &out, int divx, int divy) const noexcept
+{
+	for (int y = 0; y < out.Height; ++y)
+	{
+		int sy = std::min(y * divy + divy / 2, Height - 1);
+		const uint8_t *src = Pixels + sy * Pitch;
+		uint8_t *dest = out.Pixels + y * out.Pitch;
+		for (int x = 0; x < out.Width; ++x)
+		{
+			dest[x] = src[std::min(x * divx + divx / 2, Width - 1)];
+		}
+	}
+}
+
+// RGB pixels are the average of each block. The rows of a block are summed
+// first, one channel at a time, which is a simple enough loop for the
+// compiler to vectorize, and then each block's columns are summed.
+void ChunkyBitmap::Shrink4(ChunkyBitmap &out, int divx, int divy) const noexcept
+{
+	std::vector<uint32_t> sums(Width * 4);
+	for (int y = 0; y < out.Height; ++y)
+	{
+		int rows = std::min(divy, Height - y * divy);
+		const uint8_t *src = Pixels + y * divy * Pitch;
+		std::fill(sums.begin(), sums.end(), 0);
+		for (int yy = 0; yy < rows; ++yy, src += Pitch)
+		{
+			uint32_t *sum = sums.data();
+			for (int i = 0; i < Width * 4; ++i)
+			{
+				sum[i] += src[i];
+			}
+		}
+		uint8_t *dest = out.Pixels + y * out.Pitch;
+		for (int x = 0; x < out.Width; ++x, dest += 4)
+		{
+			int cols = std::min(divx, Width - x * divx);
+			uint32_t count = cols * rows;
+			const uint32_t *sum = &sums[x * divx * 4];
+			uint32_t block[4] = { count / 2, count / 2, count / 2, count / 2 };
+			for (int xx = 0; xx < cols; ++xx, sum += 4)
+			{
+				block[0] += sum[0];
+				block[1] += sum[1];
+				block[2] += sum[2];
+				block[3] += sum[3];
+			}
+			dest[0] = uint8_t(block[0] / count);
+			dest[1] = uint8_t(block[1] / count);
+			dest[2] = uint8_t(block[2] / count);
+			dest[3] = uint8_t(block[3] / count);
+		}
+	}
+}
+
 void ChunkyBitmap::Expand1(int scalex, int scaley, int srcwidth, int srcheight, const uint8_t *src, uint8_t *dest) noexcept
 {
 	for (int sy = srcheight; sy > 0; --sy, src -= Width)
@@ -312,6 +429,23 @@ static int NearestColor(const ColorRegister *pal, int r, int g, int b, int first
 	return bestcolor;
 }
 
+ColorLookup::ColorLookup(std::vector<ColorRegister> &&pal)
+	: Palette(std::move(pal)), Cache(1 << 18, 0xFFFF)
+{
+}
+
+// The answer for each cell is the nearest color to the middle of it. That is
+// the nearest to nearly all of the cell, and never far off for the rest.
+int ColorLookup::Nearest(int r, int g, int b)
+{
+	uint16_t &entry = Cache[(r >> 2) << 12 | (g >> 2) << 6 | (b >> 2)];
+	if (entry == 0xFFFF)
+	{
+		entry = (uint16_t)NearestColor(&Palette[0], (r & ~3) | 2, (g & ~3) | 2, (b & ~3) | 2, 0, (int)Palette.size());
+	}
+	return entry;
+}
+
 static const ChunkyBitmap::Diffuser
 FloydSteinberg[] = {
 	{ 28672, { {1, 0} } },								// 7/16
@@ -376,21 +510,31 @@ static const ChunkyBitmap::Diffuser *const ErrorDiffusionKernels[] = {
 };
 
 ChunkyBitmap ChunkyBitmap::RGBtoPalette(const std::vector<ColorRegister> &pal, int dithermode) const
+{
+	return RGB2P(pal, nullptr, dithermode);
+}
+
+ChunkyBitmap ChunkyBitmap::RGBtoPalette(ColorLookup &lookup, int dithermode) const
+{
+	return RGB2P(lookup.Palette, &lookup, dithermode);
+}
+
+ChunkyBitmap ChunkyBitmap::RGB2P(const std::vector<ColorRegister> &pal, ColorLookup *lookup, int dithermode) const
 {
 	ChunkyBitmap out(Width, Height);
 
-	if (dithermode <= 0 || dithermode > countof(ErrorDiffusionKernels))
+	if (dithermode <= 0 || (size_t)dithermode > countof(ErrorDiffusionKernels))
 	{
-		RGB2P_BasicQuantize(out, pal);
+		RGB2P_BasicQuantize(out, pal, lookup);
 	}
 	else
 	{
-		RGB2P_ErrorDiffusion(out, pal, ErrorDiffusionKernels[dithermode - 1]);
+		RGB2P_ErrorDiffusion(out, pal, ErrorDiffusionKernels[dithermode - 1], lookup);
 	}
 	return out;
 }
 
-void ChunkyBitmap::RGB2P_BasicQuantize(ChunkyBitmap &out, const std::vector<ColorRegister> &pal) const
+void ChunkyBitmap::RGB2P_BasicQuantize(ChunkyBitmap &out, const std::vector<ColorRegister> &pal, ColorLookup *lookup) const
 {
 	assert(out.Width == Width && out.Height == Height && out.BytesPerPixel == 1);
 	assert(BytesPerPixel == 4);
@@ -399,12 +543,14 @@ void ChunkyBitmap::RGB2P_BasicQuantize(ChunkyBitmap &out, const std::vector<Colo
 
 	for (int i = Width * Height; i > 0; --i)
 	{
-		*dest++ = NearestColor(&pal[0], src[0], src[1], src[2], 0, (int)pal.size());
+		*dest++ = lookup != nullptr ? lookup->Nearest(src[0], src[1], src[2]) :
+			NearestColor(&pal[0], src[0], src[1], src[2], 0, (int)pal.size());
 		src += 4;
 	}
 }
 
-void ChunkyBitmap::RGB2P_ErrorDiffusion(ChunkyBitmap &out, const std::vector<ColorRegister> &pal, const Diffuser *kernel) const
+void ChunkyBitmap::RGB2P_ErrorDiffusion(ChunkyBitmap &out, const std::vector<ColorRegister> &pal, const Diffuser *kernel,
+	ColorLookup *lookup) const
 {
 	assert(out.Width == Width && out.Height == Height && out.BytesPerPixel == 1);
 	assert(BytesPerPixel == 4);
@@ -438,7 +584,7 @@ void ChunkyBitmap::RGB2P_ErrorDiffusion(ChunkyBitmap &out, const std::vector<Col
 			int r = std::clamp(src[0] + error[0][x][0] / 65536, 0, 255);
 			int g = std::clamp(src[1] + error[0][x][1] / 65536, 0, 255);
 			int b = std::clamp(src[2] + error[0][x][2] / 65536, 0, 255);
-			int c = NearestColor(&pal[0], r, g, b, 0, (int)pal.size());
+			int c = lookup != nullptr ? lookup->Nearest(r, g, b) : NearestColor(&pal[0], r, g, b, 0, (int)pal.size());
 			dest[x] = c;
 
 			// Diffuse the difference between what we wanted and what we got.
@@ -452,7 +598,7 @@ void ChunkyBitmap::RGB2P_ErrorDiffusion(ChunkyBitmap &out, const std::vector<Col
 				int gw = g * kernel[i].weight;
 				int bw = b * kernel[i].weight;
 				// ...apply that weight to one or more pixels.
-				for (int j = 0; j < countof(kernel[i].to) && kernel[i].to[j].x | kernel[i].to[j].y; ++j)
+				for (size_t j = 0; j < countof(kernel[i].to) && kernel[i].to[j].x | kernel[i].to[j].y; ++j)
 				{
 					int xx = x + kernel[i].to[j].x;
 					if (xx >= 0 && xx < Width)
@@ -0,0 +1,42 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Entry points for using iff2gif as a library. Everything they need lives
+// on the stack, so any number of conversions can run at once.
+
+#include "iff2gif.h"
+
+bool ConvertToGIF(const void *data, size_t len, const GIFOptions &options, const MemorySink::Callback &callback)
+{
+	MemorySink sink(callback);
+	GIFWriter writer(sink, _T("memory.gif"), options);
+	bool loaded = LoadMemory(data, len, writer);
+	return writer.Finish() && loaded;
+}
+
+bool ConvertToGIF(const void *data, size_t len, const GIFOptions &options, std::vector<uint8_t> &out)
+{
+	GIFOptions single = options;
+	single.Solo = false;
+	out.clear();
+	return ConvertToGIF(data, len, single, [&out](std::vector<uint8_t> &&gif)
+	{
+		out = std::move(gif);
+		return true;
+	});
+}
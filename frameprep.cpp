@@ -0,0 +1,217 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <assert.h>
+#include <numeric>
+#include <string.h>
+#include "iff2gif.h"
+
+void FrameConsumer::AddFrame(PlanarBitmap *bitmap)
+{
+	AddFrame(*bitmap, ChunkyBitmap(*bitmap));
+}
+
+void DecodeHAM(FrameInfo &info, ChunkyBitmap &chunky)
+{
+	if ((info.ModeID & HAM) && chunky.BytesPerPixel == 1)
+	{
+		if (info.NumPlanes <= 6)
+		{
+			if (info.Palette.size() < 16)
+				info.Palette = info.Palette.Resized(16);
+			chunky = chunky.HAM6toRGB(info.Palette);
+		}
+		else if (info.NumPlanes <= 8)
+		{
+			if (info.Palette.size() < 64)
+				info.Palette = info.Palette.Resized(64);
+			chunky = chunky.HAM8toRGB(info.Palette);
+		}
+	}
+}
+
+void AspectCorrection(int modeid, int &scalex, int &scaley)
+{
+	switch (modeid & (LACE | HIRES | SUPERHIRES))
+	{
+	case LACE:				scalex *= 2; break;
+	case HIRES:				scaley *= 2; break;
+	case SUPERHIRES:		scaley *= 4; break;
+	case SUPERHIRES | LACE:	scaley *= 2; break;
+	}
+}
+
+void ReduceScale(int &scale, int &shrink)
+{
+	int div = std::gcd(scale, shrink);
+	scale /= div;
+	shrink /= div;
+}
+
+// Finds the smallest rectangle that holds every pixel that isn't the same
+// color as the top left one. If there aren't any, it's the whole bitmap.
+static CropRect FindBorders(const ChunkyBitmap &chunky)
+{
+	const int bpp = chunky.BytesPerPixel;
+	const uint8_t *border = chunky.Pixels;
+	auto solid = [&](int x, int y, int w, int h)
+	{
+		for (int yy = y; yy < y + h; ++yy)
+		{
+			const uint8_t *p = chunky.Pixels + yy * chunky.Pitch + x * bpp;
+			for (int xx = 0; xx < w; ++xx, p += bpp)
+			{
+				if (memcmp(p, border, bpp) != 0)
+					return false;
+			}
+		}
+		return true;
+	};
+	CropRect rect;
+	int top = 0, bot = chunky.Height, left = 0, right = chunky.Width;
+	while (top < bot && solid(0, top, chunky.Width, 1))
+		++top;
+	if (top == bot)
+	{
+		rect.Width = chunky.Width;
+		rect.Height = chunky.Height;
+		return rect;
+	}
+	while (solid(0, bot - 1, chunky.Width, 1))
+		--bot;
+	while (solid(left, top, 1, bot - top))
+		++left;
+	while (solid(right - 1, top, 1, bot - top))
+		--right;
+	rect.Left = left;
+	rect.Top = top;
+	rect.Width = right - left;
+	rect.Height = bot - top;
+	return rect;
+}
+
+FramePrep::FramePrep(const GIFOptions &options)
+	: ScaleX(options.ScaleX), ScaleY(options.ScaleY), ShrinkX(options.ShrinkX), ShrinkY(options.ShrinkY),
+	  AutoAspectScale(options.AspectScale), AutoCrop(options.AutoCrop), Crop(options.Crop)
+{
+	assert(ScaleX >= 1);
+	assert(ScaleY >= 1);
+	assert(ShrinkX >= 1);
+	assert(ShrinkY >= 1);
+}
+
+// Settles the scale and crop from the first frame. unscaled is only needed
+// to find the borders for AutoCrop.
+bool FramePrep::Start(FrameInfo &info, const ChunkyBitmap &unscaled)
+{
+	Started = true;
+	if (AutoAspectScale)
+	{
+		AspectCorrection(info.ModeID, ScaleX, ScaleY);
+	}
+	ReduceScale(ScaleX, ShrinkX);
+	ReduceScale(ScaleY, ShrinkY);
+
+	if (AutoCrop)
+	{
+		if ((info.ModeID & HAM) && unscaled.BytesPerPixel == 1)
+		{
+			// The borders have to be found in the colors, not in the HAM codes.
+			FrameInfo haminfo = info;
+			ChunkyBitmap decoded = unscaled.Scaled(1, 1);
+			DecodeHAM(haminfo, decoded);
+			Crop = FindBorders(decoded);
+		}
+		else
+		{
+			Crop = FindBorders(unscaled);
+		}
+	}
+	else if (Crop.Width != 0)
+	{
+		int right = std::min(Crop.Left + Crop.Width, info.Width);
+		int bot = std::min(Crop.Top + Crop.Height, info.Height);
+		if (Crop.Left >= right || Crop.Top >= bot)
+		{
+			fprintf(stderr, "The crop rectangle is outside the %dx%d image\n", info.Width, info.Height);
+			Failed = true;
+			return false;
+		}
+		Crop.Width = right - Crop.Left;
+		Crop.Height = bot - Crop.Top;
+	}
+	if (Crop.Width == info.Width && Crop.Height == info.Height)
+	{
+		Crop.Width = 0;		// Nothing to crop
+	}
+	return true;
+}
+
+ChunkyBitmap FramePrep::Convert(PlanarBitmap &bitmap)
+{
+	if (Failed || (!Started && !Start(bitmap, AutoCrop ? ChunkyBitmap(bitmap) : ChunkyBitmap())))
+	{
+		return ChunkyBitmap();
+	}
+	// HAM pixels depend on the ones to their left, so HAM is cropped after
+	// it is decoded. Anything else is cropped before it is even chunky.
+	bool ham = (bitmap.ModeID & HAM) && bitmap.NumPlanes <= 8;
+	// Scaling while converting to chunky is faster than scaling afterward.
+	return Finish(bitmap, ChunkyBitmap(bitmap, ScaleX, ScaleY, Crop.Width != 0 && !ham ? &Crop : nullptr), ham);
+}
+
+ChunkyBitmap FramePrep::Convert(FrameInfo &info, ChunkyBitmap &&chunky)
+{
+	if (Failed || (!Started && !Start(info, chunky)))
+	{
+		return ChunkyBitmap();
+	}
+	bool ham = (info.ModeID & HAM) && chunky.BytesPerPixel == 1;
+	if (Crop.Width != 0 && !ham)
+	{
+		chunky = chunky.Cropped(Crop);
+	}
+	if (ScaleX != 1 || ScaleY != 1)
+	{
+		chunky = chunky.Scaled(ScaleX, ScaleY);
+	}
+	return Finish(info, std::move(chunky), ham);
+}
+
+ChunkyBitmap FramePrep::Finish(FrameInfo &info, ChunkyBitmap &&chunky, bool ham)
+{
+	// HAM is decoded after scaling, because HAM pixels are relative to the
+	// ones before them, and that includes the end of the previous row. It
+	// has to be decoded before shrinking, though, for the same reason.
+	DecodeHAM(info, chunky);
+	if (ham && Crop.Width != 0)
+	{
+		CropRect scaled;
+		scaled.Left = Crop.Left * ScaleX;
+		scaled.Top = Crop.Top * ScaleY;
+		scaled.Width = Crop.Width * ScaleX;
+		scaled.Height = Crop.Height * ScaleY;
+		chunky = chunky.Cropped(scaled);
+	}
+	if (ShrinkX != 1 || ShrinkY != 1)
+	{
+		chunky = chunky.Shrunk(ShrinkX, ShrinkY);
+	}
+	return std::move(chunky);
+}
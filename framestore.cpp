@@ -0,0 +1,279 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A frame store holds the frames of an ILBM or ANIM after they have been
+// decoded to chunky pixels, so that trying different encoder settings on
+// them doesn't need to repeat the decoding. Frames are stored unscaled, and
+// HAM frames are stored as HAM, since they can't be scaled after decoding
+// without changing them.
+// Everything is little endian, and every part starts on an 8 byte boundary,
+// so the file can also be mapped into memory and used in place.
+//
+// Header (24 bytes):
+//   char   Magic[4]			"IGFS"
+//   uint32 Version				1
+//   uint32 NumFrames
+//   uint32 Reserved
+//   uint64 IndexOffset			0 if the store was never finished
+//
+// Each frame (48 bytes, followed by its palette and pixels):
+//   uint32 Width, Height
+//   uint8  BytesPerPixel		1 for palette indices, 4 for RGB + an unused byte
+//   uint8  NumPlanes
+//   uint8  Interleave
+//   uint8  Reserved
+//   int32  TransparentColor, Delay, Rate, NumFrames, ModeID, DeltaOp
+//   uint32 DeltaSize
+//   uint32 PaletteSize			Number of RGB triplets
+//   uint32 Reserved
+//   Palette, padded to a multiple of 8 bytes
+//   Pixels (Width * Height * BytesPerPixel), padded to a multiple of 8 bytes
+//
+// Index:
+//   uint64 Offset of each frame
+
+#include <string.h>
+#include "iff2gif.h"
+
+enum
+{
+	STORE_VERSION = 1,
+	HEADER_SIZE = 24,
+	FRAME_HEADER_SIZE = 48
+};
+
+static void Put32(uint8_t *p, uint32_t val)
+{
+	p[0] = uint8_t(val);
+	p[1] = uint8_t(val >> 8);
+	p[2] = uint8_t(val >> 16);
+	p[3] = uint8_t(val >> 24);
+}
+
+static void Put64(uint8_t *p, uint64_t val)
+{
+	Put32(p, uint32_t(val));
+	Put32(p + 4, uint32_t(val >> 32));
+}
+
+static uint32_t Get32(const uint8_t *p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static uint64_t Get64(const uint8_t *p)
+{
+	return Get32(p) | ((uint64_t)Get32(p + 4) << 32);
+}
+
+static size_t Padding(size_t len)
+{
+	return (8 - len % 8) % 8;
+}
+
+FrameStoreWriter::~FrameStoreWriter()
+{
+	if (File != nullptr)
+	{
+		fclose(File);
+	}
+}
+
+bool FrameStoreWriter::Open(const tstring &filename)
+{
+	Filename = filename;
+	File = _tfopen(Filename.c_str(), _T("wb"));
+	if (File == nullptr)
+	{
+		_ftprintf(stderr, _T("Could not open %s: %s\n"), Filename.c_str(), _tcserror(errno));
+		return false;
+	}
+	// Close fills this in once the index has been written.
+	uint8_t header[HEADER_SIZE] = {};
+	return Write(header, sizeof(header));
+}
+
+bool FrameStoreWriter::Write(const void *data, size_t len)
+{
+	if (Failed)
+	{
+		return false;
+	}
+	if (len != 0 && fwrite(data, 1, len, File) != len)
+	{
+		_ftprintf(stderr, _T("Could not write to %s: %s\n"), Filename.c_str(), _tcserror(errno));
+		Failed = true;
+		return false;
+	}
+	Pos += len;
+	return true;
+}
+
+void FrameStoreWriter::AddFrame(FrameInfo &info, ChunkyBitmap &&chunky)
+{
+	static const uint8_t zeros[8] = {};
+	uint8_t head[FRAME_HEADER_SIZE] = {};
+
+	if (File == nullptr)
+	{
+		return;
+	}
+	Put32(head + 0, chunky.Width);
+	Put32(head + 4, chunky.Height);
+	head[8] = chunky.BytesPerPixel;
+	head[9] = info.NumPlanes;
+	head[10] = info.Interleave;
+	Put32(head + 12, info.TransparentColor);
+	Put32(head + 16, info.Delay);
+	Put32(head + 20, info.Rate);
+	Put32(head + 24, info.NumFrames);
+	Put32(head + 28, info.ModeID);
+	Put32(head + 32, info.DeltaOp);
+	Put32(head + 36, info.DeltaSize);
+	Put32(head + 40, (uint32_t)info.Palette.size());
+
+	size_t palsize = info.Palette.size() * 3;
+	size_t pixsize = (size_t)chunky.Pitch * chunky.Height;
+	Index.push_back(Pos);
+	Write(head, sizeof(head)) &&
+		Write(info.Palette.data(), palsize) && Write(zeros, Padding(palsize)) &&
+		Write(chunky.Pixels, pixsize) && Write(zeros, Padding(pixsize));
+}
+
+bool FrameStoreWriter::Close()
+{
+	if (File == nullptr)
+	{
+		return false;
+	}
+	uint8_t header[HEADER_SIZE] = { 'I', 'G', 'F', 'S' };
+	Put32(header + 4, STORE_VERSION);
+	Put32(header + 8, (uint32_t)Index.size());
+	Put64(header + 16, Pos);
+	for (uint64_t offset : Index)
+	{
+		uint8_t entry[8];
+		Put64(entry, offset);
+		Write(entry, sizeof(entry));
+	}
+	if (!Failed && fseek(File, 0, SEEK_SET) != 0)
+	{
+		_ftprintf(stderr, _T("Could not write to %s: %s\n"), Filename.c_str(), _tcserror(errno));
+		Failed = true;
+	}
+	Write(header, sizeof(header));
+	if (fclose(File) != 0 && !Failed)
+	{
+		_ftprintf(stderr, _T("Could not write to %s: %s\n"), Filename.c_str(), _tcserror(errno));
+		Failed = true;
+	}
+	File = nullptr;
+	return !Failed;
+}
+
+bool LoadFrameStore(const _TCHAR *filename, std::istream &file, FrameConsumer &writer)
+{
+	uint8_t header[HEADER_SIZE];
+
+	file.seekg(0, file.end);
+	uint64_t filesize = (uint64_t)file.tellg();
+	file.seekg(0, file.beg);
+	if (!file.read((char *)header, sizeof(header)) || memcmp(header, "IGFS", 4) != 0)
+	{
+		_ftprintf(stderr, _T("%s is not a frame store\n"), filename);
+		return false;
+	}
+	if (Get32(header + 4) != STORE_VERSION)
+	{
+		_ftprintf(stderr, _T("%s is frame store version %u, which is not supported\n"), filename, Get32(header + 4));
+		return false;
+	}
+	uint32_t numframes = Get32(header + 8);
+	uint64_t indexpos = Get64(header + 16);
+	if (indexpos < HEADER_SIZE || indexpos > filesize || (filesize - indexpos) / 8 < numframes)
+	{
+		_ftprintf(stderr, _T("%s is incomplete\n"), filename);
+		return false;
+	}
+	std::vector<uint8_t> index((size_t)numframes * 8);
+	file.seekg(indexpos, file.beg);
+	file.read((char *)index.data(), index.size());
+
+	if (writer.WantsBusiestFrame() && numframes != 0)
+	{
+		// The delta sizes of the original ANIM are kept with each frame.
+		std::vector<uint32_t> sizes(numframes);
+		uint8_t head[FRAME_HEADER_SIZE] = {};
+		for (uint32_t i = 0; i < numframes && file; ++i)
+		{
+			file.seekg(Get64(&index[i * 8]), file.beg);
+			file.read((char *)head, sizeof(head));
+			sizes[i] = Get32(head + 36);
+		}
+		// head is the last frame, which has the interleave.
+		writer.SelectFrame(BusiestFrame(sizes, head[10]));
+	}
+	for (uint32_t i = 0; i < numframes && file && !writer.IsDone(); ++i)
+	{
+		uint8_t head[FRAME_HEADER_SIZE];
+		file.seekg(Get64(&index[i * 8]), file.beg);
+		if (!file.read((char *)head, sizeof(head)))
+		{
+			break;
+		}
+		uint32_t width = Get32(head + 0);
+		uint32_t height = Get32(head + 4);
+		uint8_t bpp = head[8];
+		uint32_t palsize = Get32(head + 40);
+		if ((bpp != 1 && bpp != 4) || width == 0 || height == 0 ||
+			width > 65535 || height > 65535 || palsize > 256)
+		{
+			file.setstate(std::ios_base::failbit);
+			break;
+		}
+		FrameInfo info;
+		info.Width = width;
+		info.Height = height;
+		info.NumPlanes = head[9];
+		info.Interleave = head[10];
+		info.TransparentColor = (int32_t)Get32(head + 12);
+		info.Delay = (int32_t)Get32(head + 16);
+		info.Rate = (int32_t)Get32(head + 20);
+		info.NumFrames = (int32_t)Get32(head + 24);
+		info.ModeID = (int32_t)Get32(head + 28);
+		info.DeltaOp = (int32_t)Get32(head + 32);
+		info.DeltaSize = Get32(head + 36);
+		std::vector<ColorRegister> palette(palsize);
+		file.read((char *)palette.data(), palsize * 3);
+		info.Palette = std::move(palette);
+		file.seekg(Padding(palsize * 3), file.cur);
+
+		ChunkyBitmap chunky(width, height, bpp);
+		if (!file.read((char *)chunky.Pixels, (size_t)chunky.Pitch * chunky.Height))
+		{
+			break;
+		}
+		writer.AddFrame(info, std::move(chunky));
+	}
+	if (!file)
+	{
+		_ftprintf(stderr, _T("%s is corrupt\n"), filename);
+		return false;
+	}
+	return true;
+}
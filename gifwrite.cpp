@@ -17,21 +17,40 @@
 */
 
 #include <algorithm>
+#include <chrono>
+#include <future>
+#include <thread>
 #include <unordered_map>
 #include <assert.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#endif
 
 #include "iff2gif.h"
 
 // GIF restricts codes to 12 bits max
 #define CODE_LIMIT (1 << 12)
 
+// How many frames of a HAM or 24-bit ANIM its palette is made from.
+#define PALETTE_SAMPLES 8
+
+// A frame gets a new palette when it fits the current one this many times
+// worse than the frames it was made from, plus REFIT_SLACK, because every
+// new palette means redrawing the whole frame.
+#define REFIT_RATIO 4
+#define REFIT_SLACK 64
+
 class CodeStream
 {
 public:
-	CodeStream(uint8_t mincodesize, std::vector<uint8_t> &codes);
+	CodeStream(uint8_t mincodesize, std::vector<uint8_t> &codes, const LossyLZW *lossy = nullptr);
 	~CodeStream();
-	void AddByte(uint8_t code);
+	void AddByte(uint8_t code, int alt = -1);
 	void WriteCode(uint16_t p);
 	void Dump();
 
@@ -70,60 +89,208 @@ private:
 	typedef std::unordered_map<uint32_t, uint16_t> DictType;
 	DictType Dict;
 
+	// For lossy compression, every code also keeps a list of the codes that
+	// extend it and the value each one appends, so that the ones with a
+	// color close to the next pixel can be found without trying every color.
+	const LossyLZW *Lossy;
+	std::vector<std::vector<std::pair<uint8_t, uint16_t>>> Extensions;
+
+	int CloseMatch(uint8_t p) const;
 	void ResetDict();
 	void DumpAccum(bool full);
 };
 
-void LZWCompress(std::vector<uint8_t> &vec, const ImageDescriptor &imd, const ChunkyBitmap &cbprev,
-	const ChunkyBitmap &chunky, uint8_t mincodesize, int trans);
+// Sorts clip ranges by start frame and merges any that overlap or abut.
+void SortClips(std::vector<std::pair<unsigned, unsigned>> &clips)
+{
+	// Sort by start frame.
+	std::sort(begin(clips), end(clips));
+
+	// Now check for overlapping or abutting ranges and combine them.
+	for (size_t i = 1; i < size(clips); ++i)
+	{
+		if (clips[i - 1].second >= clips[i].first - 1)
+		{
+			clips[i - 1].second = std::max(clips[i - 1].second, clips[i].second);
+			clips.erase(begin(clips) + i);
+			// Backup since we deleted an element and need to recheck entry i.
+			--i;
+		}
+	}
+}
+
+// Solo mode frames don't depend on each other once the first one has set up
+// the screen and the global palette, so they can be encoded by any number of
+// threads at once. Only the encoding is done by the workers. The GIFs are
+// written by the thread that is adding frames, so the sink doesn't need to
+// worry about threads, and they are still written in order.
+struct GIFWriter::SoloPool
+{
+	struct Waiting
+	{
+		tstring Filename;
+		std::future<SoloGIF> GIF;
+	};
+
+	WorkQueue<std::packaged_task<SoloGIF()>> Jobs;
+	std::vector<std::thread> Workers;
+	std::deque<Waiting> Encoding;		// Oldest first
+	size_t MaxEncoding;
+
+	SoloPool(int threads) : Jobs(threads * 2), MaxEncoding(threads * 4)
+	{
+		for (int i = 0; i < threads; ++i)
+		{
+			Workers.emplace_back([this]
+			{
+				std::packaged_task<SoloGIF()> job;
+				while (Jobs.Pop(job))
+				{
+					job();
+				}
+			});
+		}
+	}
+
+	~SoloPool()
+	{
+		Jobs.Stop();
+		for (auto &worker : Workers)
+		{
+			worker.join();
+		}
+	}
+};
 
-GIFWriter::GIFWriter(tstring filename, bool solo, int forcedrate, int scalex, int scaley,
-	bool aspectscale, std::vector<std::pair<unsigned, unsigned>> &clips, int diffusion)
-	: BaseFilename(filename), SoloMode(solo), ScaleX(scalex), ScaleY(scaley),
-	  AutoAspectScale(aspectscale), ForcedFrameRate(forcedrate > 0),
-	  DiffusionMode(diffusion), Clips(clips)
+GIFWriter::GIFWriter(GIFSink &sink, tstring filename, const GIFOptions &options)
+	: Sink(sink), BaseFilename(filename), Prep(options), ForcedFrameRate(options.ForcedRate > 0),
+	  DiffusionMode(options.DiffusionMode), Lossy(options.Lossy), Effort(options.Effort), Quiet(options.Quiet),
+	  Clips(options.Clips), SoloMode(options.Solo), Threads(options.Threads)
 {
-	assert(ScaleX >= 1);
-	assert(ScaleY >= 1);
-	if (forcedrate > 0)
+	if (options.ForcedRate > 0)
 	{
-		FrameRate = forcedrate;
+		FrameRate = options.ForcedRate;
 	}
 	memset(&LSD, 0, sizeof(LSD));
-	if (solo)
+	if (SoloMode)
 	{
 		CheckForIndexSpot();
 	}
+	SortClips(Clips);
+	if (options.Preview != 0)
+	{
+		Preview = options.Preview;
+		// Until the loader picks a frame, the first one is as good as any.
+		PickFrame = options.Preview < 0;
+		Clips = { { PickFrame ? 1u : (unsigned)options.Preview, PickFrame ? 1u : (unsigned)options.Preview } };
+	}
 	if (Clips.size() == 0)
 	{
 		Clips.push_back({ 1, UINT_MAX });
 	}
+	// Holding frames back to make a palette from would spoil a preview or a
+	// deadline, and frames that are clipped out aren't worth making it from.
+	FixedPalette = options.FixedPalette;
+	if (!SoloMode && options.Preview == 0 && options.Deadline == 0 && Clips[0].first == 1)
+	{
+		SampleFrames = PALETTE_SAMPLES;
+	}
+	// Solo mode writes every frame on its own, so there's no one GIF to fit.
+	if (options.Budget > 0 && !SoloMode)
+	{
+		Budget = options.Budget;
+		BudgetPerSecond = options.BudgetPerSecond;
+		BudgetOptions = options;
+		BudgetOptions.Budget = 0;
+		BudgetOptions.Deadline = 0;
+	}
+	// A deadline is met by converting frames faster as they come in, so it
+	// doesn't work with solo mode's threads or with a budget's many tries.
+	if (options.Deadline > 0 && !SoloMode && Budget == 0)
+	{
+		Deadline = options.Deadline;
+		StartTime = std::chrono::steady_clock::now();
+	}
+	// Going over every frame again at the end takes time a deadline doesn't
+	// have, and a budget's writers do it for themselves.
+	if (Effort >= 4 && !SoloMode && Budget == 0 && Deadline == 0 && options.Preview == 0)
+	{
+		Optimizing = true;
+		WriteQueue.KeepAll();
+	}
 }
 
 GIFWriter::~GIFWriter()
 {
-	if (WriteQueue.Total() == 1)
+	Finish();
+}
+
+bool GIFWriter::Finish()
+{
+	if (!Finished)
 	{
-		// The header is not normally written until we reach the second frame of the
-		// input. For a single frame image, we need to write it now.
-		WriteHeader(false);
+		Finished = true;
+		if (Budget > 0 && !Failed)
+		{
+			Failed = !FitBudget();
+		}
+		if (!PaletteSamples.empty() && !Failed)
+		{
+			ReleaseSamples();
+		}
+		if (Pool != nullptr)
+		{
+			WriteSolo(0);
+			Pool.reset();
+		}
+		if (!SoloMode && WriteQueue.Total() == 1)
+		{
+			// The header is not normally written until we reach the second frame of the
+			// input. For a single frame image, we need to write it now. (Solo mode
+			// always writes it right away.)
+			WriteHeader(false);
+		}
+		if (Optimizing && !Failed)
+		{
+			OptimizeFrames();
+		}
+		ReleaseLog();
+		FinishFile();
+		if (Preview != 0 && !Failed && GetFramesWritten() == 0)
+		{
+			// The frame asked for is past the end.
+			if (Preview > 0)
+			{
+				fprintf(stderr, "There is no frame %d to preview.\n", Preview);
+			}
+			else
+			{
+				fprintf(stderr, "There is no frame to preview.\n");
+			}
+			Failed = true;
+		}
+		if (Degraded != 0 && !Quiet)
+		{
+			ReportDeadline();
+		}
 	}
-	FinishFile();
+	return !Failed;
 }
 
 bool GIFWriter::FinishFile()
 {
-	// Pretend success if no file is open.
+	// Pretend success if no GIF is open.
 	bool succ = true;
-	if (File != nullptr)
+	if (SinkOpen)
 	{
 		// The 0x3B is a trailer byte to terminate the GIF.
-		succ = WriteQueue.Flush() && fputc(0x3B, File) != EOF;
+		succ = WriteQueue.Flush() && Sink.Write("\x3B", 1);
 		if (succ)
 		{
-			fclose(File);
-			WriteQueue.SetFile(nullptr);
-			File = nullptr;
+			WriteQueue.SetSink(nullptr);
+			SinkOpen = false;
+			succ = Sink.End(true);
+			Failed |= !succ;
 		}
 		else
 		{
@@ -133,12 +300,13 @@ bool GIFWriter::FinishFile()
 	return succ;
 }
 
+// The sink reports the details of what went wrong.
 void GIFWriter::BadWrite()
 {
-	_ftprintf(stderr, _T("Could not write to %s: %s\n"), Filename.c_str(), _tcserror(errno));
-	fclose(File);
-	File = nullptr;
-	WriteQueue.SetFile(nullptr);
+	Sink.End(false);
+	SinkOpen = false;
+	Failed = true;
+	WriteQueue.SetSink(nullptr);
 }
 
 // When created in solo mode, check the output filename to see if it includes
@@ -194,13 +362,13 @@ static int numdigits(int num)
 	return ndig;
 }
 
-static std::vector<ColorRegister> *DumbPalette()
+const SharedPalette *DumbPalette()
 {
-	// The so-called "web-safe" palette with some extra shades of gray
-	static std::vector<ColorRegister> pal;
-
-	if (pal.empty())
+	// The so-called "web-safe" palette with some extra shades of gray. It is
+	// built by the initializer so that threads can't race to fill it in.
+	static const SharedPalette pal = []
 	{
+		std::vector<ColorRegister> pal;
 		// Colors
 		for (int r = 0; r < 6; ++r)
 			for (int g = 0; g < 6; ++g)
@@ -209,65 +377,306 @@ static std::vector<ColorRegister> *DumbPalette()
 		// Grays
 		for (int g = 8; g < 256; g += 8)
 			pal.emplace_back(g, g, g);
-	}
+		return pal;
+	}();
 	return &pal;
 }
 
-void GIFWriter::AddFrame(PlanarBitmap *bitmap)
+// Microseconds elapsed since start, for the frame log.
+static int64_t ElapsedMicrosecs(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+}
+
+void GIFWriter::SelectFrame(unsigned frame)
 {
-	std::vector<ColorRegister> *palette = &bitmap->Palette;
-	int mincodesize = bitmap->NumPlanes;
+	if (PickFrame && FrameCount == 0)
+	{
+		Clips = { { frame, frame } };
+	}
+}
 
-	// Do aspect ratio correction for appropriate ModeIDs.
-	if (AutoAspectScale && FrameCount == 0)
+// Frames that come before the next clip don't need to be converted. Only the
+// first frame is, because it sets up the GIF.
+bool GIFWriter::SkipFrame(const FrameInfo &info)
+{
+	if (FrameCount == 0 || (!Clips.empty() && FrameCount + 1 >= Clips[0].first))
 	{
-		switch (bitmap->ModeID & (LACE | HIRES | SUPERHIRES))
+		return false;
+	}
+	if (info.Rate > 0 && !ForcedFrameRate)
+	{
+		FrameRate = info.Rate;
+	}
+	FrameCount++;
+	return true;
+}
+
+// Keeps track of how long frames take, and if the rest of them won't be done
+// before the deadline at this rate, gives up something to make them faster.
+// When there's no time left for even this frame, the GIF ends before it, and
+// this returns false.
+bool GIFWriter::MeetDeadline(const FrameInfo &info)
+{
+	auto now = std::chrono::steady_clock::now();
+	int64_t elapsed = std::chrono::duration_cast<std::chrono::microseconds>(now - StartTime).count();
+	int64_t limit = (int64_t)Deadline * 1000;
+	if (WriteQueue.Total() > 0)
+	{
+		// The time between frames includes loading and decoding them, which
+		// can't be made faster, but still has to be counted.
+		int64_t frame = std::chrono::duration_cast<std::chrono::microseconds>(now - FrameStart).count();
+		if (Samples++ == 0)
+		{
+			AvgFrame = frame;
+			AvgConvert = ConvertMicrosecs;
+			AvgEncode = EncodeMicrosecs;
+		}
+		else
 		{
-		case LACE:				ScaleX *= 2; break;
-		case HIRES:				ScaleY *= 2; break;
-		case SUPERHIRES:		ScaleY *= 4; break;
-		case SUPERHIRES | LACE:	ScaleY *= 2; break;
+			AvgFrame = (AvgFrame * 3 + frame) / 4;
+			AvgConvert = (AvgConvert * 3 + ConvertMicrosecs) / 4;
+			AvgEncode = (AvgEncode * 3 + EncodeMicrosecs) / 4;
+		}
+		// Dithering costs little next to finding the nearest colors, so giving
+		// it up might not have helped. If it didn't, take it back.
+		if (Trying != 0 && Samples == 2)
+		{
+			if (AvgConvert > TryingFrom / 10 * 9)
+			{
+				DiffusionMode = SavedDiffusion;
+				Degraded &= ~Trying;
+				Useless |= Trying;
+			}
+			Trying = 0;
+		}
+		if (elapsed + AvgConvert + AvgEncode > limit)
+		{
+			// The frames after the last real one repeat the start of the ANIM
+			// and are dropped anyway, so stopping there loses nothing.
+			uint32_t real = ExpectedFrames - std::min<uint32_t>(ExpectedFrames, info.Interleave);
+			if (ExpectedFrames == 0 || FrameCount < real)
+			{
+				Degrade(DEGRADE_CUT);
+				WriteQueue.SetDropFrames(0);
+			}
+			else
+			{
+				WriteQueue.SetDropFrames(FrameCount - real);
+			}
+			Clips.clear();
+			return false;
 		}
 	}
-	ChunkyBitmap chunky(*bitmap, ScaleX, ScaleY);
-	if (bitmap->ModeID & HAM)
+	FrameStart = now;
+	// Only the first frame of an ANIM says how many there are.
+	if (FrameCount == 0)
+	{
+		ExpectedFrames = (uint32_t)std::max(info.NumFrames, 0);
+	}
+	uint32_t total = ExpectedFrames;
+	if (!Clips.empty())
+	{
+		total = std::min(total, Clips.back().second);
+	}
+	int64_t left = total > FrameCount + 1 ? total - FrameCount - 1 : 0;
+	// Wait for a couple of frames after giving something up to see how much
+	// it helped before giving up anything else. Aim a little early, because
+	// this is only a guess.
+	if (Samples >= 2 && elapsed + AvgConvert + AvgEncode + left * AvgFrame > limit / 10 * 9)
+	{
+		int search = Effort >= 2 ? DEGRADE_SEARCH : 0;
+		int retry = Effort >= 1 ? DEGRADE_RETRY : 0;
+		int dither = TrueColor && DiffusionMode != 0 && !(Useless & DEGRADE_DITHER) ? DEGRADE_DITHER : 0;
+		// Give up something from whichever of converting and compressing takes
+		// longer, if there's anything left to give up there.
+		int what = (AvgConvert > AvgEncode && dither) ? dither : search ? search : retry ? retry : dither;
+		if (what != 0)
+		{
+			Degrade(what);
+		}
+	}
+	return true;
+}
+
+void GIFWriter::Degrade(int what)
+{
+	switch (what)
+	{
+	case DEGRADE_SEARCH:	Effort = 1; break;
+	case DEGRADE_RETRY:		Effort = 0; break;
+	case DEGRADE_DITHER:
+		Trying = what;
+		TryingFrom = AvgConvert;
+		SavedDiffusion = DiffusionMode;
+		DiffusionMode = 0;
+		break;
+	}
+	for (int i = 0; i < NUM_DEGRADES; ++i)
+	{
+		if (what == 1 << i)
+		{
+			DegradedAt[i] = FrameCount + 1;
+		}
+	}
+	Degraded |= what;
+	Samples = 0;
+}
+
+std::string GIFWriter::DescribeDegraded() const
+{
+	static const char *const names[NUM_DEGRADES] = { "search", "retry", "dither", "cut" };
+	std::string desc;
+	for (int i = 0; i < NUM_DEGRADES; ++i)
 	{
-		if (bitmap->NumPlanes <= 6)
+		if (Degraded & (1 << i))
 		{
-			if (palette->size() < 16)
-				palette->resize(16);
-			chunky = chunky.HAM6toRGB(*palette);
+			desc += (desc.empty() ? "" : ",") + std::string(names[i]);
 		}
-		else if (bitmap->NumPlanes <= 8)
+	}
+	return desc;
+}
+
+void GIFWriter::ReportDeadline() const
+{
+	static const char *const names[NUM_DEGRADES] =
+	{
+		"no extra search from", "no transparency retry from", "no dithering from", "stopped before"
+	};
+	int order[NUM_DEGRADES] = { 0, 1, 2, 3 };
+	std::stable_sort(order, order + NUM_DEGRADES, [this](int a, int b) { return DegradedAt[a] < DegradedAt[b]; });
+	const char *sep = "To meet the deadline: ";
+	for (int i : order)
+	{
+		if (Degraded & (1 << i))
+		{
+			printf("%s%s frame %u", sep, names[i], DegradedAt[i]);
+			sep = ", ";
+		}
+	}
+	printf("\n");
+}
+
+void GIFWriter::AddFrame(PlanarBitmap *bitmap)
+{
+	if (Failed)
+	{
+		return;
+	}
+	if (Budget > 0)
+	{
+		Record(*bitmap, ChunkyBitmap(*bitmap));
+		return;
+	}
+	if (SkipFrame(*bitmap))
+	{ // Nowhere to put it, so don't bother.
+		return;
+	}
+	if (Deadline > 0 && !MeetDeadline(*bitmap))
+	{
+		return;
+	}
+	if (UseSoloPool())
+	{
+		// The loader goes on to apply the next delta to bitmap, so the
+		// worker gets a copy of it.
+		auto frame = std::make_shared<SoloFrame>();
+		frame->Planar = std::make_unique<PlanarBitmap>(*bitmap);
+		QueueSolo(frame);
+		return;
+	}
+	auto starttime = std::chrono::steady_clock::now();
+	AddChunky(*bitmap, Prep.Convert(*bitmap), starttime);
+}
+
+void GIFWriter::AddFrame(FrameInfo &info, ChunkyBitmap &&chunky)
+{
+	if (Failed)
+	{
+		return;
+	}
+	if (Budget > 0)
+	{
+		Record(info, std::move(chunky));
+		return;
+	}
+	if (SkipFrame(info))
+	{
+		return;
+	}
+	if (Deadline > 0 && !MeetDeadline(info))
+	{
+		return;
+	}
+	if (UseSoloPool())
+	{
+		auto frame = std::make_shared<SoloFrame>();
+		frame->Info = info;
+		frame->Chunky = std::move(chunky);
+		QueueSolo(frame);
+		return;
+	}
+	auto starttime = std::chrono::steady_clock::now();
+	AddChunky(info, Prep.Convert(info, std::move(chunky)), starttime);
+}
+
+void GIFWriter::AddChunky(FrameInfo &info, ChunkyBitmap &&chunky, std::chrono::steady_clock::time_point starttime)
+{
+	const SharedPalette *palette = &info.Palette;
+	SharedPalette compact;
+
+	if (chunky.IsEmpty())
+	{
+		Failed = true;
+		return;
+	}
+	if (chunky.BytesPerPixel != 1 && !FixedPalette && Adaptive == nullptr && SampleFrames > 1)
+	{
+		PaletteSamples.push_back({ info, std::move(chunky) });
+		if (PaletteSamples.size() == SampleFrames)
 		{
-			if (palette->size() < 64)
-				palette->resize(64);
-			chunky = chunky.HAM8toRGB(*palette);
+			ReleaseSamples();
 		}
+		return;
 	}
 	if (chunky.BytesPerPixel != 1)
 	{
-		palette = DumbPalette();
-		chunky = chunky.RGBtoPalette(*palette, DiffusionMode);
-		mincodesize = 8;
+		if (FixedPalette)
+		{
+			palette = DumbPalette();
+			chunky = chunky.RGBtoPalette(*palette, DiffusionMode);
+		}
+		else
+		{
+			AdaptPalette(chunky);
+			palette = &Adaptive->Palette;
+			chunky = chunky.RGBtoPalette(*Adaptive, DiffusionMode);
+		}
+		TrueColor = true;
 	}
+	ConvertMicrosecs = ElapsedMicrosecs(starttime);
 
 	if (FrameCount == 0)
 	{ // Initialize some values from the initial frame.
-		printf("%dx%dx%d\n", bitmap->Width, bitmap->Height, bitmap->NumPlanes);
+		if (!Quiet) printf("%dx%dx%d\n", info.Width, info.Height, info.NumPlanes);
+		if (info.NumFrames == 1)
+		{
+			compact = CompactPalette(chunky, *palette, info.TransparentColor);
+			palette = &compact;
+		}
 		PageWidth = chunky.Width;
 		PageHeight = chunky.Height;
 		GlobalPalBits = ExtendPalette(GlobalPal, *palette);
-		DetectBackgroundColor(bitmap, chunky);
+		DetectBackgroundColor(&info, chunky);
 		if (SFrameLength == 0)
 		{ // Automatically decide what should be an adequate length for the frame number
 		  // part of the filename in solo mode if we haven't already got a length for it.
-			SFrameLength = numdigits(bitmap->NumFrames);
+			SFrameLength = numdigits(info.NumFrames);
 		}
 	}
-	if (bitmap->Rate > 0 && !ForcedFrameRate)
+	if (info.Rate > 0 && !ForcedFrameRate)
 	{
-		FrameRate = bitmap->Rate;
+		FrameRate = info.Rate;
 	}
 	FrameCount++;
 	// Only make the frame if it's in a desired clip range.
@@ -281,7 +690,7 @@ void GIFWriter::AddFrame(PlanarBitmap *bitmap)
 			{
 				WriteHeader(true);
 			}
-			MakeFrame(bitmap, std::move(chunky), *palette, mincodesize);
+			MakeFrame(&info, std::move(chunky), *palette);
 		}
 		if (FrameCount == Clips[0].second)
 		{
@@ -297,61 +706,209 @@ void GIFWriter::AddFrame(PlanarBitmap *bitmap)
 	}
 }
 
-void GIFWriter::WriteHeader(bool loop)
+// Makes one palette from the colors of every held back frame, and then
+// converts them with it.
+void GIFWriter::ReleaseSamples()
 {
-	LogicalScreenDescriptor lsd = { LittleShort(PageWidth), LittleShort(PageHeight), 0, BkgColor, 0 };
+	Histogram.Clear();
+	for (const HeldFrame &frame : PaletteSamples)
+	{
+		Histogram.Add(frame.Chunky);
+	}
+	Adaptive = std::make_unique<ColorLookup>(Histogram.MakePalette(255));
+	AdaptiveError = Histogram.Error(*Adaptive);
+	std::vector<HeldFrame> frames = std::move(PaletteSamples);
+	PaletteSamples.clear();
+	Releasing = true;
+	for (HeldFrame &frame : frames)
+	{
+		AddChunky(frame.Info, std::move(frame.Chunky), std::chrono::steady_clock::now());
+	}
+	Releasing = false;
+}
 
-	if (GlobalPalBits > 0)
+// Picks the palette for a HAM or 24-bit frame: The one the frames before it
+// used, if it suits this one well enough, or else one made for it. One color
+// is left free for transparency, except in solo mode, where every frame gets
+// a palette of its own, and there is nothing to be transparent over.
+void GIFWriter::AdaptPalette(const ChunkyBitmap &chunky)
+{
+	if (Releasing)
 	{
-		lsd.Flags = 0xF0 | (GlobalPalBits - 1);
+		return;
+	}
+	Histogram.Clear();
+	Histogram.Add(chunky);
+	if (Adaptive != nullptr && !SoloMode &&
+		Histogram.Error(*Adaptive) <= AdaptiveError * REFIT_RATIO + REFIT_SLACK)
+	{
+		return;
 	}
+	Adaptive = std::make_unique<ColorLookup>(Histogram.MakePalette(SoloMode ? 256 : 255));
+	AdaptiveError = Histogram.Error(*Adaptive);
+}
 
+void GIFWriter::WriteHeader(bool loop)
+{
 	if (SoloMode)
 	{
 		loop = false;	// never loop in solo mode (because there's only one frame)
-		if (File != nullptr && !FinishFile())
+		if (SinkOpen && !FinishFile())
 		{
-			BadWrite();
 			return;
 		}
 	}
-	assert(File == nullptr);
+	assert(!SinkOpen);
 	GenFilename();
-	File = _tfopen(Filename.c_str(), _T("wb"));
-	if (File == NULL)
+	if (!Sink.Begin(Filename))
 	{
-		_ftprintf(stderr, _T("Could not open %s: %s\n"), Filename.c_str(), _tcserror(errno));
+		Failed = true;
 		return;
 	}
-	WriteQueue.SetFile(File);
-	if (fwrite("GIF89a", 6, 1, File) != 1 || fwrite(&lsd, 7, 1, File) != 1)
+	SinkOpen = true;
+	WriteQueue.SetSink(&Sink);
+	if (!WriteScreen(Sink, loop))
 	{
 		BadWrite();
-		return;
+	}
+}
+
+// Writes everything that comes before the first frame.
+bool GIFWriter::WriteScreen(GIFSink &sink, bool loop) const
+{
+	LogicalScreenDescriptor lsd = { LittleShort(PageWidth), LittleShort(PageHeight), 0, BkgColor, 0 };
+
+	if (GlobalPalBits > 0)
+	{
+		lsd.Flags = 0xF0 | (GlobalPalBits - 1);
+	}
+	if (!sink.Write("GIF89a", 6) || !sink.Write(&lsd, 7))
+	{
+		return false;
 	}
 	// Write (or skip) palette
 	if (lsd.Flags & 0x80)
 	{
 		assert(GlobalPal.size() == (size_t)1 << GlobalPalBits);
-		if (fwrite(&GlobalPal[0], 3, GlobalPal.size(), File) != GlobalPal.size())
+		if (!sink.Write(&GlobalPal[0], 3 * GlobalPal.size()))
 		{
-			BadWrite();
-			return;
+			return false;
 		}
 	}
 	// Write (or skip) the looping extension
 	if (loop)
 	{
-		if (fwrite("\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00", 19, 1, File) != 1)
+		if (!sink.Write("\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00", 19))
 		{
-			BadWrite();
-			return;
+			return false;
+		}
+	}
+	return true;
+}
+
+// Sets used[c] for every color c in a palette image.
+static void FindUsedColors(const ChunkyBitmap &chunky, bool used[256])
+{
+	std::fill_n(used, 256, false);
+	const uint8_t *pix = chunky.Pixels;
+	for (int y = 0; y < chunky.Height; ++y, pix += chunky.Pitch)
+	{
+		for (int x = 0; x < chunky.Width; ++x)
+		{
+			used[pix[x]] = true;
+		}
+	}
+}
+
+// Returns the first entry in palette that is color, or -1 if none are.
+static int FindColor(const std::vector<ColorRegister> &palette, const ColorRegister &color)
+{
+	auto it = std::find(palette.begin(), palette.end(), color);
+	return it == palette.end() ? -1 : int(it - palette.begin());
+}
+
+// Drops the colors a still image does not use from its palette, so that both
+// the palette and the codes for its pixels can be smaller. If more frames do
+// come after it, they will just need a palette of their own.
+SharedPalette GIFWriter::CompactPalette(ChunkyBitmap &chunky, const SharedPalette &palette,
+	int &transcolor)
+{
+	bool used[256];
+	FindUsedColors(chunky, used);
+	if (transcolor >= 0)
+	{
+		used[transcolor] = true;
+	}
+	uint8_t remap[256];
+	std::vector<ColorRegister> compact;
+	for (int i = 0; i < 256; ++i)
+	{
+		remap[i] = (uint8_t)compact.size();
+		if (used[i])
+		{
+			compact.push_back(i < (int)palette.size() ? palette[i] : ColorRegister());
+		}
+	}
+	if (compact.size() == palette.size())
+	{
+		return palette;
+	}
+	chunky.Remap(remap);
+	if (transcolor >= 0)
+	{
+		transcolor = remap[transcolor];
+	}
+	return compact;
+}
+
+// If the global palette has every color a frame uses, redraws the frame with
+// the global palette's indices for them, so that it needs no palette of its
+// own.
+bool GIFWriter::UseGlobalPalette(ChunkyBitmap &chunky, const std::vector<ColorRegister> &palette,
+	const bool used[256]) const
+{
+	uint8_t remap[256] = { 0 };
+	for (int i = 0; i < 256; ++i)
+	{
+		if (used[i])
+		{
+			int c = i < (int)palette.size() ? FindColor(GlobalPal, palette[i]) : -1;
+			if (c < 0)
+			{
+				return false;
+			}
+			remap[i] = c;
 		}
 	}
+	chunky.Remap(remap);
+	return true;
+}
+
+// Redraws PrevFrame with the indices the new palette has for the same colors,
+// so that it can be compared with a frame that uses the new palette. Pixels
+// with colors the new palette does not have get one the frame does not use,
+// so that they will always be drawn over. Returns false if there is no such
+// color, because the frame uses every one.
+bool GIFWriter::RemapPrevious(const std::vector<ColorRegister> &oldpal, const std::vector<ColorRegister> &newpal,
+	const bool used[256])
+{
+	int spare = int(std::find(used, used + 256, false) - used);
+	if (spare == 256)
+	{
+		return false;
+	}
+	uint8_t remap[256];
+	for (int i = 0; i < 256; ++i)
+	{
+		int c = i < (int)oldpal.size() ? FindColor(newpal, oldpal[i]) : -1;
+		remap[i] = c >= 0 ? c : spare;
+	}
+	PrevFrame.Remap(remap);
+	return true;
 }
 
 // GIF palettes must be a power of 2 in size. CMAP chunks have no such restriction.
-int GIFWriter::ExtendPalette(std::vector<ColorRegister> &dest, const std::vector<ColorRegister> &src)
+int GIFWriter::ExtendPalette(SharedPalette &dest, const SharedPalette &src)
 {
 	if (src.empty())
 	{
@@ -363,46 +920,93 @@ int GIFWriter::ExtendPalette(std::vector<ColorRegister> &dest, const std::vector
 	while (numdest < src.size() && p < 8)
 		++p, numdest *= 2;
 
-	dest.resize(numdest);
+	// Most palettes are already the right size, and can just be shared.
+	if (src.size() == numdest)
+	{
+		dest = src;
+		return p;
+	}
+	std::vector<ColorRegister> colors(numdest);
 	// The source could potentially have more colors than we need, but also
 	// might not have enough.
 	for (i = 0; i < std::min(src.size(), numdest); ++i)
 	{
-		dest[i] = src[i];
+		colors[i] = src[i];
 	}
 	// Set extras to grayscale
 	for (; i < numdest; ++i)
 	{
-		dest[i].blue = dest[i].green = dest[i].red = uint8_t((i * 255) >> p);
+		colors[i].blue = colors[i].green = colors[i].red = uint8_t((i * 255) >> p);
 	}
+	dest = std::move(colors);
 	return p;
 }
 
-void GIFWriter::MakeFrame(PlanarBitmap *bitmap, ChunkyBitmap &&chunky, const std::vector<ColorRegister> &palette, int mincodesize)
+void GIFWriter::MakeFrame(const FrameInfo *info, ChunkyBitmap &&chunky, const SharedPalette &palette)
 {
+	auto starttime = std::chrono::steady_clock::now();
 	GIFFrame newframe, *oldframe;
-	bool palchanged;
+	FrameLogEntry logentry;
+	bool palchanged, redraw;
 
-	WriteQueue.SetDropFrames(SoloMode ? 0 : bitmap->Interleave);
+	WriteQueue.SetDropFrames(SoloMode ? 0 : info->Interleave);
 	newframe.IMD.Width = chunky.Width;
 	newframe.IMD.Height = chunky.Height;
 
 	// Is there a transparent color?
-	if (bitmap->TransparentColor >= 0)
+	if (info->TransparentColor >= 0)
 	{
 		newframe.GCE.Flags = 1;
-		newframe.GCE.TransparentColor = bitmap->TransparentColor;
+		newframe.GCE.TransparentColor = info->TransparentColor;
+	}
+	// Check for a palette different from the one we recorded for the global color table.
+	// Unlike ANIMs, where a CMAP chunk in one frame applies to that frame and all
+	// subsequent frames until another CMAP, GIF's local color table applies only to
+	// the frame where it appears. The palettes are compared as they will be
+	// written, since an adaptive palette is one short of the global one's size.
+	// A palette that only moves colors around or changes ones the frame doesn't
+	// use can still be done with the global one.
+	bool used[256];
+	newframe.LocalPalBits = ExtendPalette(newframe.LocalPalette, palette);
+	if (newframe.LocalPalette != GlobalPal)
+	{
+		FindUsedColors(chunky, used);
+	}
+	if (newframe.LocalPalette == GlobalPal ||
+		(info->TransparentColor < 0 && UseGlobalPalette(chunky, palette, used)))
+	{
+		newframe.LocalPalette = SharedPalette();
+		newframe.LocalPalBits = 0;
+	}
+	// Decoders won't repaint what earlier frames left on the screen with a new
+	// palette, so every pixel whose color changed must be drawn again. Once the
+	// previous frame is redrawn with the new palette's indices, it can be
+	// compared with this one as usual. Only if that's not possible is the
+	// entire frame redrawn.
+	oldframe = WriteQueue.MostRecent();
+	const SharedPalette &newpal = newframe.LocalPalBits > 0 ? newframe.LocalPalette : GlobalPal;
+	palchanged = oldframe != nullptr && newpal != (oldframe->LocalPalBits > 0 ? oldframe->LocalPalette : GlobalPal);
+	redraw = false;
+	if (palchanged && !PrevFrame.IsEmpty())
+	{
+		if (newframe.LocalPalBits == 0)
+		{
+			FindUsedColors(chunky, used);
+		}
+		redraw = !RemapPrevious(oldframe->LocalPalBits > 0 ? oldframe->LocalPalette : GlobalPal, newpal, used);
 	}
 	// Update properties on the preceding frame that couldn't be determined
 	// until this frame.
-	oldframe = WriteQueue.MostRecent();
+	uint8_t disposal = 0;
 	if (oldframe != NULL)
 	{
-		oldframe->GCE.Flags |= SelectDisposal(bitmap, newframe.IMD, chunky) << 2;
-		if (bitmap->Delay != 0)
+		disposal = SelectDisposal(info, newframe.IMD, chunky);
+		oldframe->GCE.Flags |= disposal << 2;
+		LogDisposal(disposal);
+		if (info->Delay != 0)
 		{
 			// GIF timing is in 1/100 sec. ANIM timing is in multiples of an FPS clock.
-			uint32_t tick = TotalTicks + bitmap->Delay;
+			uint32_t tick = TotalTicks + info->Delay;
 			uint32_t lasttime = GIFTime;
 			uint32_t nowtime = tick * 100 / FrameRate;
 			int delay = nowtime - lasttime;
@@ -411,77 +1015,307 @@ void GIFWriter::MakeFrame(PlanarBitmap *bitmap, ChunkyBitmap &&chunky, const std
 			GIFTime += delay;
 		}
 	}
-	// Check for a palette different from the one we recorded for the global color table.
-	// Unlike ANIMs, where a CMAP chunk in one frame applies to that frame and all
-	// subsequent frames until another CMAP, GIF's local color table applies only to
-	// the frame where it appears.
-	if (palette != GlobalPal)
+
+	// At the highest effort, also see if this frame is smaller drawn over
+	// what was under the previous frame, which is what will be there if the
+	// previous frame is disposed by restoring it.
+	bool restore = Effort >= 3 && disposal == 1 && !palchanged && !Under.IsEmpty();
+	GIFFrame restored;
+	ChunkyBitmap rchunky;
+	FrameLogEntry rlogentry = logentry;
+	if (restore)
+	{
+		restored = newframe;
+		rchunky = chunky.Scaled(1, 1);
+	}
+	Compress(newframe, info, PrevFrame, chunky, redraw, logentry);
+	if (restore)
+	{
+		Compress(restored, info, Under, rchunky, false, rlogentry);
+		restore = restored.LZW.size() < newframe.LZW.size();
+		if (restore)
+		{
+			newframe = std::move(restored);
+			chunky = std::move(rchunky);
+			logentry = rlogentry;
+			oldframe->GCE.Flags = (oldframe->GCE.Flags & ~0x1C) | (3 << 2);
+			LogDisposal(3);
+		}
+	}
+	EncodeMicrosecs = ElapsedMicrosecs(starttime);
+	if (Log != nullptr)
+	{
+		logentry.Frame = FrameCount;
+		logentry.DeltaOp = info->DeltaOp;
+		logentry.DeltaSize = info->DeltaSize;
+		logentry.Rect = newframe.IMD;
+		logentry.PalChanged = palchanged;
+		logentry.TransparentColor = (newframe.GCE.Flags & 1) ? newframe.GCE.TransparentColor : -1;
+		logentry.LZWKept = newframe.LZW.size();
+		logentry.ConvertMicrosecs = ConvertMicrosecs;
+		logentry.EncodeMicrosecs = EncodeMicrosecs;
+		LogFrame(logentry);
+	}
+	// Queue this frame for later writing, possibly flushing one frame to disk.
+	if (!WriteQueue.Enqueue(std::move(newframe)))
+	{
+		BadWrite();
+	}
+	if (SoloMode)
+	{
+		chunky.Clear();
+	}
+	if (Optimizing)
+	{
+		RecordChange(info, chunky, restore);
+	}
+	if (Effort >= 3 && !restore)
 	{
-		newframe.LocalPalBits = ExtendPalette(newframe.LocalPalette, palette);
+		// After a palette change, it may have colors the new palette doesn't.
+		Under = palchanged ? ChunkyBitmap() : std::move(PrevFrame);
 	}
-	// If the palette has changed from the previous frame, we must redraw the entire frame,
-	// because decoders probably won't repaint the old area with the new palette.
-	palchanged = oldframe != nullptr && newframe.LocalPalette != oldframe->LocalPalette;
+	PrevFrame = std::move(chunky);
+}
 
+// Compresses the part of chunky that differs from prev into frame. Unchanged
+// pixels are replaced with a transparent color, if there's room in the
+// palette and the effort level allows for seeing if that helps.
+void GIFWriter::Compress(GIFFrame &frame, const FrameInfo *info, const ChunkyBitmap &prev, ChunkyBitmap &chunky,
+	bool redraw, FrameLogEntry &logentry)
+{
+	const SharedPalette &palette = frame.LocalPalBits > 0 ? frame.LocalPalette : GlobalPal;
 	// Identify the minimum rectangle that needs to be updated.
-	if (!PrevFrame.IsEmpty() && !palchanged)
+	if (!prev.IsEmpty() && !redraw)
+	{
+		MinimumArea(prev, chunky, frame.IMD);
+	}
+	// Replaces unchanged pixels with a transparent color, if there's room in the palette.
+	int trans;
+	bool temptrans = false;
+	if (WriteQueue.Total() == 0 || prev.IsEmpty() || redraw || (frame.GCE.Flags & 0x1C0) == 0x80)
+	{
+		trans = -1;
+	}
+	else if (frame.GCE.Flags & 1)
+	{
+		trans = frame.GCE.TransparentColor;
+	}
+	else
+	{
+		trans = SelectTransparentColor(prev, chunky, frame.IMD, palette);
+		if (trans >= 0)
+		{
+			frame.GCE.Flags |= 1;
+			frame.GCE.TransparentColor = trans;
+			temptrans = true;
+		}
+	}
+	int mincodesize = MinCodeSize(chunky, frame.IMD, trans);
+	// Lossy compression uses the colors the frame will really be shown with.
+	LossyLZW *lossy = nullptr;
+	if (Lossy > 0)
+	{
+		if (LossyTable == nullptr || LossyPaletteId != palette.Id())
+		{
+			LossyTable = std::make_unique<LossyLZW>(palette, Lossy);
+			LossyPaletteId = palette.Id();
+		}
+		lossy = LossyTable.get();
+		lossy->Exact = trans >= 0 ? trans : info->TransparentColor;
+	}
+	// Compressed the image data. Unchanged pixels are transparent, or at
+	// effort 2 and up, either transparent or themselves, whichever matches
+	// more of what came before.
+	LZWCompress(frame.LZW, frame.IMD, prev, chunky, mincodesize, trans, lossy, Effort >= 2);
+	logentry.LZWOpaque = frame.LZW.size();
+	if (trans < 0)
+	{
+		return;
+	}
+	// That is usually better than making every one of them transparent, but
+	// not always.
+	if (Effort >= 2)
+	{
+		std::vector<uint8_t> all;
+		LZWCompress(all, frame.IMD, prev, chunky, mincodesize, trans, lossy);
+		if (all.size() < frame.LZW.size())
+		{
+			frame.LZW = std::move(all);
+		}
+	}
+	logentry.LZWTrans = frame.LZW.size();
+	logentry.LZWOpaque = 0;
+	// If we did transparent substitution, try again without. Sometimes it compresses
+	// better if we don't do that.
+	if (Effort >= 1)
+	{
+		std::vector<uint8_t> try2;
+		if (lossy != nullptr)
+		{
+			lossy->Exact = info->TransparentColor;
+		}
+		LZWCompress(try2, frame.IMD, prev, chunky, mincodesize, -1, lossy);
+		logentry.LZWOpaque = try2.size();
+		if (try2.size() <= frame.LZW.size())
+		{
+			frame.LZW = std::move(try2);
+			if (temptrans)
+			{ // Undo the transparent color
+				frame.GCE.Flags &= 0xFE;
+				frame.GCE.TransparentColor = 0;
+			}
+		}
+	}
+}
+
+// Does the same bookkeeping as AddChunky, but hands the frame to a worker.
+void GIFWriter::QueueSolo(std::shared_ptr<SoloFrame> frame)
+{
+	FrameCount++;
+	if (Clips.empty())
+	{
+		return;
+	}
+	if (FrameCount >= Clips[0].first)
+	{
+		if (Pool == nullptr)
+		{
+			// The first frame was made the usual way, and its GIF is still open.
+			if (!FinishFile())
+			{
+				return;
+			}
+			Pool = std::make_unique<SoloPool>(Threads);
+		}
+		if (Pool->Encoding.size() >= Pool->MaxEncoding && !WriteSolo(Pool->MaxEncoding - 1))
+		{
+			return;
+		}
+		GenFilename();
+		uint32_t framenum = FrameCount;
+		std::packaged_task<SoloGIF()> job([this, frame, framenum]
+		{
+			return EncodeSolo(*frame, framenum);
+		});
+		Pool->Encoding.push_back({ Filename, job.get_future() });
+		Pool->Jobs.Push(std::move(job));
+	}
+	if (FrameCount == Clips[0].second)
+	{
+		Clips.erase(begin(Clips));
+	}
+}
+
+// Makes a complete GIF out of one frame on a worker thread. This is what
+// AddChunky and MakeFrame do for a solo mode frame, which has no frame before
+// it to be compared with. Once the first frame has been converted, Prep and
+// everything about the screen stay the same, so it is safe for every worker
+// to use them at once.
+GIFWriter::SoloGIF GIFWriter::EncodeSolo(SoloFrame &frame, uint32_t framenum)
+{
+	auto starttime = std::chrono::steady_clock::now();
+	FrameInfo &info = frame.Planar != nullptr ? *frame.Planar : frame.Info;
+	ChunkyBitmap chunky = frame.Planar != nullptr ? Prep.Convert(*frame.Planar) : Prep.Convert(info, std::move(frame.Chunky));
+	const SharedPalette *palette = &info.Palette;
+	SoloGIF out;
+
+	if (chunky.IsEmpty())
+	{
+		return out;
+	}
+	std::unique_ptr<ColorLookup> lookup;
+	if (chunky.BytesPerPixel != 1)
+	{
+		if (FixedPalette)
+		{
+			palette = DumbPalette();
+			chunky = chunky.RGBtoPalette(*palette, DiffusionMode);
+		}
+		else
+		{
+			ColorHistogram histogram;
+			histogram.Add(chunky);
+			lookup = std::make_unique<ColorLookup>(histogram.MakePalette(256));
+			palette = &lookup->Palette;
+			chunky = chunky.RGBtoPalette(*lookup, DiffusionMode);
+		}
+	}
+	FrameLogEntry &logentry = out.LogEntry;
+	logentry.ConvertMicrosecs = ElapsedMicrosecs(starttime);
+	starttime = std::chrono::steady_clock::now();
+
+	GIFFrame gifframe;
+	gifframe.IMD.Width = chunky.Width;
+	gifframe.IMD.Height = chunky.Height;
+	if (info.TransparentColor >= 0)
 	{
-		MinimumArea(PrevFrame, chunky, newframe.IMD);
+		gifframe.GCE.Flags = 1;
+		gifframe.GCE.TransparentColor = info.TransparentColor;
 	}
-	// Replaces unchanged pixels with a transparent color, if there's room in the palette.
-	int trans;
-	bool temptrans = false;
-	if (WriteQueue.Total() == 0 || PrevFrame.IsEmpty() || palchanged || (newframe.GCE.Flags & 0x1C0) == 0x80)
+	gifframe.LocalPalBits = ExtendPalette(gifframe.LocalPalette, *palette);
+	if (gifframe.LocalPalette == GlobalPal)
 	{
-		trans = -1;
+		gifframe.LocalPalette = SharedPalette();
+		gifframe.LocalPalBits = 0;
 	}
-	else if (newframe.GCE.Flags & 1)
+	std::unique_ptr<LossyLZW> lossy;
+	if (Lossy > 0)
 	{
-		trans = newframe.GCE.TransparentColor;
+		lossy = std::make_unique<LossyLZW>(gifframe.LocalPalBits > 0 ? gifframe.LocalPalette : GlobalPal, Lossy);
+		lossy->Exact = info.TransparentColor;
 	}
-	else
+	LZWCompress(gifframe.LZW, gifframe.IMD, chunky, chunky, MinCodeSize(chunky, gifframe.IMD, -1), -1, lossy.get());
+
+	logentry.Frame = framenum;
+	logentry.DeltaOp = info.DeltaOp;
+	logentry.DeltaSize = info.DeltaSize;
+	logentry.Rect = gifframe.IMD;
+	logentry.TransparentColor = (gifframe.GCE.Flags & 1) ? gifframe.GCE.TransparentColor : -1;
+	logentry.LZWOpaque = logentry.LZWKept = gifframe.LZW.size();
+
+	MemorySink sink([&out](std::vector<uint8_t> &&gif)
 	{
-		trans = SelectTransparentColor(PrevFrame, chunky, newframe.IMD);
-		if (trans >= 0)
+		out.Data = std::move(gif);
+		return true;
+	});
+	sink.Begin(_T("memory.gif"));
+	sink.End(WriteScreen(sink, false) && gifframe.Write(&sink) && sink.Write("\x3B", 1));
+	logentry.EncodeMicrosecs = ElapsedMicrosecs(starttime);
+	return out;
+}
+
+// Writes the oldest GIFs from the pool until no more than keep are left.
+bool GIFWriter::WriteSolo(size_t keep)
+{
+	while (Pool->Encoding.size() > keep)
+	{
+		SoloPool::Waiting waiting = std::move(Pool->Encoding.front());
+		Pool->Encoding.pop_front();
+		SoloGIF gif = waiting.GIF.get();
+		if (Failed)
 		{
-			newframe.GCE.Flags |= 1;
-			newframe.GCE.TransparentColor = trans;
-			temptrans = true;
+			continue;
 		}
-	}
-	// Compressed the image data
-	LZWCompress(newframe.LZW, newframe.IMD, PrevFrame, chunky, mincodesize, trans);
-	// If we did transparent substitution, try again without. Sometimes it compresses
-	// better if we don't do that.
-	if (trans >= 0)
-	{
-		std::vector<uint8_t> try2;
-		LZWCompress(try2, newframe.IMD, PrevFrame, chunky, mincodesize, -1);
-		size_t l = newframe.LZW.size();
-		size_t r = try2.size();
-		if (try2.size() <= newframe.LZW.size())
+		if (gif.Data.empty() || !Sink.Begin(waiting.Filename))
 		{
-			newframe.LZW = std::move(try2);
-			if (temptrans)
-			{ // Undo the transparent color
-				newframe.GCE.Flags &= 0xFE;
-				newframe.GCE.TransparentColor = 0;
-			}
+			Failed = true;
+			continue;
+		}
+		if (!Sink.End(Sink.Write(gif.Data.data(), gif.Data.size())))
+		{
+			Failed = true;
+			continue;
+		}
+		SoloWritten++;
+		if (Log != nullptr)
+		{
+			Log->Add(gif.LogEntry);
 		}
 	}
-	// Queue this frame for later writing, possibly flushing one frame to disk.
-	if (!WriteQueue.Enqueue(std::move(newframe)))
-	{
-		BadWrite();
-	}
-	if (SoloMode)
-	{
-		chunky.Clear();
-	}
-	PrevFrame = std::move(chunky);
+	return !Failed;
 }
 
-void GIFWriter::DetectBackgroundColor(PlanarBitmap *bitmap, const ChunkyBitmap &chunky)
+void GIFWriter::DetectBackgroundColor(const FrameInfo *info, const ChunkyBitmap &chunky)
 {
 	// The GIF specification includes a background color. CompuServe probably actually
 	// used this. In practice, modern viewers just make the background be transparent
@@ -489,9 +1323,9 @@ void GIFWriter::DetectBackgroundColor(PlanarBitmap *bitmap, const ChunkyBitmap &
 	// either the same as the transparent color, or it doesn't matter what it is.
 
 	// If there is a transparent color, let it be the background.
-	if (bitmap->TransparentColor >= 0)
+	if (info->TransparentColor >= 0)
 	{
-		BkgColor = bitmap->TransparentColor;
+		BkgColor = info->TransparentColor;
 		assert(PrevFrame.IsEmpty());
 		PrevFrame = ChunkyBitmap(chunky, BkgColor);
 	}
@@ -563,10 +1397,10 @@ gotright:
 }
 
 // Select the disposal method for this frame.
-uint8_t GIFWriter::SelectDisposal(const PlanarBitmap *planar, const ImageDescriptor &imd, const ChunkyBitmap &chunky)
+uint8_t GIFWriter::SelectDisposal(const FrameInfo *info, const ImageDescriptor &imd, const ChunkyBitmap &chunky)
 {
 	// If there is no transparent color, then we can keep the old frame intact.
-	if (planar->TransparentColor < 0 || PrevFrame.IsEmpty())
+	if (info->TransparentColor < 0 || PrevFrame.IsEmpty())
 	{
 		return 1;
 	}
@@ -575,7 +1409,7 @@ uint8_t GIFWriter::SelectDisposal(const PlanarBitmap *planar, const ImageDescrip
 	// set a pixel transparent after it's been rendered opaque.
 	const uint8_t *src = PrevFrame.Pixels + imd.Left + imd.Top * PrevFrame.Pitch;
 	const uint8_t *dest = chunky.Pixels + imd.Left + imd.Top * chunky.Pitch;
-	const uint8_t trans = planar->TransparentColor;
+	const uint8_t trans = info->TransparentColor;
 	for (int y = 0; y < imd.Height; ++y)
 	{
 		for (int x = 0; x < imd.Width; ++x)
@@ -583,20 +1417,33 @@ uint8_t GIFWriter::SelectDisposal(const PlanarBitmap *planar, const ImageDescrip
 			if (src[x] != trans && dest[x] == trans)
 			{
 				// Dispose the preceding frame.
-				PrevFrame.SetSolidColor(planar->TransparentColor);
+				PrevFrame.SetSolidColor(info->TransparentColor);
 				return 2;
 			}
 		}
-		src += planar->Width;
-		dest += planar->Width;
+		src += PrevFrame.Pitch;
+		dest += chunky.Pitch;
 	}
 	return 1;
 }
 
+// A weighted RGB distance, with green counting the most and red the least,
+// roughly the way the eye does. Divided by 9 and square rooted, it is on the
+// same 0-255 scale as each component.
+static int ColorDistance2(const ColorRegister &a, const ColorRegister &b)
+{
+	int dr = a.red - b.red;
+	int dg = a.green - b.green;
+	int db = a.blue - b.blue;
+	return 2 * dr * dr + 4 * dg * dg + 3 * db * db;
+}
+
 // Compares pixels in the changed region and returns a color that is not used in the destination.
 // This can be used as a transparent color for this frame for better compression, since the
 // underlying unchanged pixels can be collapsed into a run of a single color.
-int GIFWriter::SelectTransparentColor(const ChunkyBitmap &cbprev, const ChunkyBitmap &cbnow, const ImageDescriptor &imd)
+// If every color is used, it may merge two colors in now to make room for one.
+int GIFWriter::SelectTransparentColor(const ChunkyBitmap &cbprev, ChunkyBitmap &cbnow, const ImageDescriptor &imd,
+	const std::vector<ColorRegister> &palette)
 {
 	uint8_t used[256 / 8] = { 0 };
 	uint8_t c;
@@ -616,7 +1463,8 @@ int GIFWriter::SelectTransparentColor(const ChunkyBitmap &cbprev, const ChunkyBi
 		prev += cbprev.Pitch;
 		now += cbnow.Pitch;
 	}
-	// Return the first unused color found. Returns -1 if they were all used.
+	// Return the first unused color found. Any unused color compresses the
+	// same as any other, since it's only ever used for the transparent pixels.
 	for (int i = 0; i < 256 / 8; ++i)
 	{
 		if (used[i] != 255)
@@ -629,21 +1477,107 @@ int GIFWriter::SelectTransparentColor(const ChunkyBitmap &cbprev, const ChunkyBi
 			// The color must be a part of the palette, if the palette has
 			// fewer than 256 colors.
 			int color = (i << 3) + j;
-			return (color < (1 << GlobalPalBits)) ? color : -1;
+			if (color < (int)palette.size())
+			{
+				return color;
+			}
+			break;
+		}
+	}
+	// They were all used, so make room by merging the two closest colors, if
+	// they are the same or close enough for the lossy level.
+	int count = (int)palette.size();
+	int keep = -1, drop = -1, best = 9 * Lossy * Lossy;
+	for (int a = 0; a < count && (drop < 0 || best > 0); ++a)
+	{
+		for (int b = a + 1; b < count; ++b)
+		{
+			int dist = ColorDistance2(palette[a], palette[b]);
+			if (dist <= best && (drop < 0 || dist < best))
+			{
+				keep = a;
+				drop = b;
+				best = dist;
+			}
+		}
+	}
+	if (drop < 0)
+	{
+		return -1;
+	}
+	// Only the changed pixels are merged. The unchanged ones will be
+	// transparent.
+	prev = cbprev.Pixels + imd.Left + imd.Top * cbprev.Pitch;
+	uint8_t *dest = cbnow.Pixels + imd.Left + imd.Top * cbnow.Pitch;
+	for (int y = 0; y < imd.Height; ++y)
+	{
+		for (int x = 0; x < imd.Width; ++x)
+		{
+			if (dest[x] == drop && prev[x] != drop)
+			{
+				dest[x] = keep;
+			}
+		}
+		prev += cbprev.Pitch;
+		dest += cbnow.Pitch;
+	}
+	return drop;
+}
+
+LossyLZW::LossyLZW(const std::vector<ColorRegister> &palette, int tolerance)
+	: Dist(256 * 256, TOO_FAR)
+{
+	size_t count = std::min<size_t>(palette.size(), 256);
+	for (size_t a = 0; a < count; ++a)
+	{
+		for (size_t b = 0; b < count; ++b)
+		{
+			int dist2 = ColorDistance2(palette[a], palette[b]);
+			if (dist2 <= 9 * tolerance * tolerance)
+			{
+				Dist[a * 256 + b] = (uint8_t)sqrt(dist2 / 9.0);
+			}
+		}
+	}
+}
+
+// The fewest bits a code can have and still cover every color in the area,
+// including trans, if it is one. This is usually the size of the palette,
+// but images often use fewer colors than there are in it.
+int MinCodeSize(const ChunkyBitmap &chunky, const ImageDescriptor &imd, int trans)
+{
+	// Every color fits in as many bits as all of them ORed together.
+	unsigned colors = trans >= 0 ? trans : 0;
+	const uint8_t *in = chunky.Pixels + imd.Left + imd.Top * chunky.Pitch;
+	for (int y = 0; y < imd.Height; ++y, in += chunky.Pitch)
+	{
+		uint8_t row = 0;
+		for (int x = 0; x < imd.Width; ++x)
+		{
+			row |= in[x];
 		}
+		colors |= row;
+	}
+	int bits = 2;
+	while ((colors >> bits) != 0)
+	{
+		++bits;
 	}
-	return -1;
+	return bits;
 }
 
+// If trans is a color, pixels that are the same as in cbprev are written as
+// trans. With either, they can also be written as themselves, whichever makes
+// for a longer match.
 void LZWCompress(std::vector<uint8_t> &vec, const ImageDescriptor &imd, const ChunkyBitmap &cbprev,
-	const ChunkyBitmap &chunky, uint8_t mincodesize, int trans)
+	const ChunkyBitmap &chunky, uint8_t mincodesize, int trans, const LossyLZW *lossy, bool either)
 {
 	if (mincodesize < 2)
 	{
 		mincodesize = 2;
 	}
 	vec.push_back(mincodesize);
-	CodeStream codes(mincodesize, vec);
+	CodeStream codes(mincodesize, vec, lossy);
 	const uint8_t *in = chunky.Pixels + imd.Left + imd.Top * chunky.Pitch;
 	if (trans < 0)
 	{
@@ -664,7 +1598,14 @@ void LZWCompress(std::vector<uint8_t> &vec, const ImageDescriptor &imd, const Ch
 		{
 			for (int x = 0; x < imd.Width; ++x)
 			{
-				codes.AddByte(prev[x] != in[x] ? in[x] : transcolor);
+				if (prev[x] != in[x])
+				{
+					codes.AddByte(in[x]);
+				}
+				else
+				{
+					codes.AddByte(transcolor, either ? in[x] : -1);
+				}
 			}
 			in += chunky.Pitch;
 			prev += cbprev.Pitch;
@@ -672,8 +1613,8 @@ void LZWCompress(std::vector<uint8_t> &vec, const ImageDescriptor &imd, const Ch
 	}
 }
 
-CodeStream::CodeStream(uint8_t mincodesize, std::vector<uint8_t> &codes)
-	: Codes(codes)
+CodeStream::CodeStream(uint8_t mincodesize, std::vector<uint8_t> &codes, const LossyLZW *lossy)
+	: Codes(codes), Lossy(lossy)
 {
 	assert(mincodesize >= 2 && mincodesize <= 8);
 	MinCodeSize = mincodesize;
@@ -683,6 +1624,10 @@ CodeStream::CodeStream(uint8_t mincodesize, std::vector<uint8_t> &codes)
 	BitPos = 0;
 	Accum = 0;
 	memset(Chunk, 0, sizeof(Chunk));
+	if (Lossy != nullptr)
+	{
+		Extensions.resize(CODE_LIMIT);
+	}
 	WriteCode(ClearCode);
 }
 
@@ -739,7 +1684,7 @@ void CodeStream::DumpAccum(bool full)
 	}
 }
 
-void CodeStream::AddByte(uint8_t p)
+void CodeStream::AddByte(uint8_t p, int alt)
 {
 	assert(p < (1 << MinCodeSize) && "p must be within the palette");
 	if (Match < 0)
@@ -750,13 +1695,26 @@ void CodeStream::AddByte(uint8_t p)
 	{ // Is Match..p in the dictionary?
 		uint32_t str = Match | (p << 16) | (1 << 24);
 		DictType::const_iterator got = Dict.find(str);
+		int close;
 		if (got != Dict.end())
 		{ // Yes, so continue matching it.
 			Match = got->second;
 		}
+		else if (alt >= 0 && (got = Dict.find(Match | (alt << 16) | (1 << 24))) != Dict.end())
+		{ // The pixel can be written as alt instead, and that's in it.
+			Match = got->second;
+		}
+		else if (Lossy != nullptr && (close = CloseMatch(alt >= 0 ? alt : p)) >= 0)
+		{ // Something close enough to it is, so pretend that's what p was.
+			Match = close;
+		}
 		else
 		{ // No, so write out the matched code and add this new string to the dictionary.
 			WriteCode(Match);
+			if (Lossy != nullptr)
+			{
+				Extensions[Match].emplace_back(p, NextCode);
+			}
 			Dict[str] = NextCode++;
 			if (NextCode == CODE_LIMIT)
 			{
@@ -773,12 +1731,33 @@ void CodeStream::AddByte(uint8_t p)
 	}
 }
 
+// Returns the code that extends Match with the color closest to p, or -1 if
+// none of them are close enough.
+int CodeStream::CloseMatch(uint8_t p) const
+{
+	int best = -1, bestdist = LossyLZW::TOO_FAR;
+	for (auto &ext : Extensions[Match])
+	{
+		int dist = Lossy->Distance(p, ext.first);
+		if (dist < bestdist)
+		{
+			best = ext.second;
+			bestdist = dist;
+		}
+	}
+	return best;
+}
+
 void CodeStream::ResetDict()
 {
 	CodeSize = MinCodeSize + 1;
 	NextCode = EOICode + 1;
 	Match = -1;
 	Dict.clear();
+	for (auto &ext : Extensions)
+	{
+		ext.clear();
+	}
 	// Initialize the dictionary with the raw bytes that can be in the image.
 	for (int i = (1 << MinCodeSize) - 1; i >= 0; --i)
 	{
@@ -828,14 +1807,14 @@ GIFFrame &GIFFrame::operator= (GIFFrame &&o) noexcept
 	return *this;
 }
 
-bool GIFFrame::Write(FILE *file)
+bool GIFFrame::Write(GIFSink *sink)
 {
-	if (file != NULL)
+	if (sink != NULL)
 	{
 		// Write Graphic Control Extension, if needed
 		if (GCE.Flags != 0 || GCE.DelayTime != 0)
 		{
-			if (fwrite(&GCE, 8, 1, file) != 1)
+			if (!sink->Write(&GCE, 8))
 			{
 				return false;
 			}
@@ -845,30 +1824,30 @@ bool GIFFrame::Write(FILE *file)
 			IMD.Flags = 0x80 | (LocalPalBits - 1);	// Set Local Color Table Flag
 		}
 		// Write the image descriptor
-		if (fputc(0x2C, file) /* Identify the Image Separator */ == EOF ||
-			fwrite(&IMD, 9, 1, file) != 1)
+		if (!sink->Write("\x2C", 1) /* Identify the Image Separator */ ||
+			!sink->Write(&IMD, 9))
 		{
 			return false;
 		}
 		// Write local color table
-		if (LocalPalBits > 0 && fwrite(&LocalPalette[0], 3, LocalPalette.size(), file) != LocalPalette.size())
+		if (LocalPalBits > 0 && !sink->Write(&LocalPalette[0], 3 * LocalPalette.size()))
 		{
 			return false;
 		}
 		// Write the compressed image data
-		if (fwrite(&LZW[0], 1, LZW.size(), file) != LZW.size())
+		if (!sink->Write(LZW.data(), LZW.size()))
 		{
 			return false;
 		}
 		return true;
 	}
-	// Pretend success if no file open
+	// Pretend success if no GIF open
 	return true;
 }
 
 GIFFrameQueue::GIFFrameQueue()
 {
-	File = NULL;
+	Sink = NULL;
 	FinalFramesToDrop = 0;
 }
 
@@ -888,18 +1867,31 @@ bool GIFFrameQueue::Flush()
 			break;
 		}
 	}
-	Queue = {};
+	Queue.clear();
+	return wrote;
+}
+
+// Goes back to writing frames as they are queued, and writes the ones that
+// were kept until then.
+bool GIFFrameQueue::KeepRecent()
+{
+	bool wrote = true;
+	Limit = MAX_QUEUE_SIZE;
+	while (wrote && Queue.size() > Limit)
+	{
+		wrote = Shift();
+	}
 	return wrote;
 }
 
 bool GIFFrameQueue::Enqueue(GIFFrame &&frame)
 {
 	bool wrote = true;
-	if (Queue.size() >= MAX_QUEUE_SIZE)
+	if (Queue.size() >= Limit)
 	{
 		wrote = Shift();
 	}
-	Queue.emplace(std::move(frame));
+	Queue.emplace_back(std::move(frame));
 	TotalQueued++;
 	return wrote;
 }
@@ -910,8 +1902,334 @@ bool GIFFrameQueue::Shift()
 	bool wrote = true;
 	if (!Queue.empty())
 	{
-		wrote = Queue.front().Write(File);
-		Queue.pop();
+		wrote = Queue.front().Write(Sink);
+		if (wrote && Sink != nullptr)
+		{
+			TotalWritten++;
+		}
+		Queue.pop_front();
 	}
 	return wrote;
 }
+
+
+FileSink::~FileSink()
+{
+	if (File != nullptr && File != stdout)
+	{
+		fclose(File);
+	}
+}
+
+bool FileSink::Begin(const tstring &filename)
+{
+	assert(File == nullptr);
+	Filename = filename;
+	if (Filename == _T("-"))
+	{
+#ifdef _WIN32
+		_setmode(_fileno(stdout), _O_BINARY);
+#endif
+		File = stdout;
+		return true;
+	}
+	File = _tfopen(Filename.c_str(), _T("wb"));
+	if (File == nullptr)
+	{
+		_ftprintf(stderr, _T("Could not open %s: %s\n"), Filename.c_str(), _tcserror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool FileSink::Write(const void *data, size_t len)
+{
+	if (File == nullptr)
+	{
+		return false;
+	}
+	if (len != 0 && fwrite(data, 1, len, File) != len)
+	{
+		_ftprintf(stderr, _T("Could not write to %s: %s\n"), Filename.c_str(), _tcserror(errno));
+		return false;
+	}
+	return true;
+}
+
+bool FileSink::End(bool ok)
+{
+	if (File == nullptr)
+	{
+		return ok;
+	}
+	bool closed = (File == stdout ? fflush(File) : fclose(File)) == 0;
+	File = nullptr;
+	if (ok && !closed)
+	{
+		_ftprintf(stderr, _T("Could not write to %s: %s\n"), Filename.c_str(), _tcserror(errno));
+	}
+	return ok && closed;
+}
+
+bool MemorySink::Write(const void *data, size_t len)
+{
+	Data.insert(Data.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+	return true;
+}
+
+bool MemorySink::End(bool ok)
+{
+	if (!ok)
+	{
+		Data.clear();
+		return false;
+	}
+	return OnGIF(std::move(Data));
+}
+
+ThreadedSink::ThreadedSink(GIFSink &sink)
+	: Sink(sink), Ops(MAX_WAITING)
+{
+	Writer = std::thread([this] { Run(); });
+}
+
+ThreadedSink::~ThreadedSink()
+{
+	Close();
+}
+
+void ThreadedSink::Send(Op &&op)
+{
+	if (!Ops.Push(std::move(op)))
+	{
+		Failed = true;
+	}
+}
+
+void ThreadedSink::Flush()
+{
+	if (!Buffer.empty())
+	{
+		Op op;
+		op.Data = std::move(Buffer);
+		Buffer.clear();
+		Send(std::move(op));
+	}
+}
+
+bool ThreadedSink::Begin(const tstring &filename)
+{
+	Op op;
+	op.Type = Op::BEGIN;
+	op.Filename = filename;
+	Send(std::move(op));
+	return !Failed;
+}
+
+bool ThreadedSink::Write(const void *data, size_t len)
+{
+	Buffer.insert(Buffer.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+	if (Buffer.size() >= BUFFER_SIZE)
+	{
+		Flush();
+	}
+	return !Failed;
+}
+
+bool ThreadedSink::End(bool ok)
+{
+	Flush();
+	Op op;
+	op.Type = Op::END;
+	op.OK = ok;
+	Send(std::move(op));
+	return ok && !Failed;
+}
+
+// Waits for everything to be written. Returns false if anything failed.
+bool ThreadedSink::Close()
+{
+	if (!Closed)
+	{
+		Closed = true;
+		Flush();
+		Ops.Stop();
+		Writer.join();
+	}
+	return !Failed;
+}
+
+// The writer thread. Once something fails, the rest of that GIF is skipped,
+// but later ones are still tried.
+void ThreadedSink::Run()
+{
+	Op op;
+	bool open = false, ok = false;
+	while (Ops.Pop(op))
+	{
+		switch (op.Type)
+		{
+		case Op::BEGIN:
+			open = ok = Sink.Begin(op.Filename);
+			Failed = Failed || !open;
+			break;
+		case Op::WRITE:
+			if (ok && !Sink.Write(op.Data.data(), op.Data.size()))
+			{
+				ok = false;
+				Failed = true;
+			}
+			break;
+		case Op::END:
+			// Whoever asked for End(false) already knows that it failed.
+			if (open && !Sink.End(op.OK && ok) && op.OK && ok)
+			{
+				Failed = true;
+			}
+			open = ok = false;
+			break;
+		}
+	}
+}
+
+// Writes a GIF that was made in memory to a file.
+bool WriteGIF(const tstring &filename, const std::vector<uint8_t> &gif)
+{
+	FileSink sink;
+	bool ok = sink.Begin(filename) && sink.Write(gif.data(), gif.size());
+	return sink.End(ok);
+}
+
+// Counts the images in a GIF by skipping over everything else. If centisecs
+// is given, it also adds up how long they are shown.
+uint32_t CountGIFFrames(const std::vector<uint8_t> &gif, uint32_t *centisecs)
+{
+	uint32_t frames = 0;
+	size_t pos = 13;	// Skip the header and logical screen descriptor
+	if (gif.size() < pos)
+	{
+		return 0;
+	}
+	if (gif[10] & 0x80)
+	{ // Skip the global palette
+		pos += 3 << ((gif[10] & 7) + 1);
+	}
+	while (pos < gif.size())
+	{
+		uint8_t block = gif[pos++];
+		if (block == 0x2C)
+		{ // Image descriptor, optional local palette, then the LZW code size
+			if (pos + 9 > gif.size())
+			{
+				break;
+			}
+			frames++;
+			uint8_t flags = gif[pos + 8];
+			pos += 9;
+			if (flags & 0x80)
+			{
+				pos += 3 << ((flags & 7) + 1);
+			}
+			pos++;
+		}
+		else if (block == 0x21)
+		{ // Extension label
+			if (centisecs != nullptr && pos + 5 < gif.size() && gif[pos] == 0xF9 && gif[pos + 1] == 4)
+			{ // Graphic control extension
+				*centisecs += gif[pos + 3] | (gif[pos + 4] << 8);
+			}
+			pos++;
+		}
+		else
+		{ // Trailer
+			break;
+		}
+		// Skip the data sub-blocks
+		while (pos < gif.size() && gif[pos] != 0)
+		{
+			pos += gif[pos] + 1;
+		}
+		pos++;
+	}
+	return frames;
+}
+
+
+FrameLog::~FrameLog()
+{
+	if (File != nullptr)
+	{
+		WritePending();
+		if (JSON)
+		{
+			fputs(NumWritten > 0 ? "\n]\n" : "]\n", File);
+		}
+		fclose(File);
+	}
+}
+
+// The format is chosen by the extension: .json gets JSON, anything else gets CSV.
+bool FrameLog::Open(const tstring &filename)
+{
+	File = _tfopen(filename.c_str(), _T("w"));
+	if (File == nullptr)
+	{
+		_ftprintf(stderr, _T("Could not open %s: %s\n"), filename.c_str(), _tcserror(errno));
+		return false;
+	}
+	auto stop = filename.find_last_of(_T('.'));
+	JSON = stop != tstring::npos && filename.compare(stop, tstring::npos, _T(".json")) == 0;
+	if (JSON)
+	{
+		fputs("[", File);
+	}
+	else
+	{
+		fputs("frame,op,deltasize,left,top,width,height,palchanged,transparent,disposal,"
+			"lzwtrans,lzwopaque,lzwkept,convertus,encodeus\n", File);
+	}
+	return true;
+}
+
+void FrameLog::Add(const FrameLogEntry &entry)
+{
+	if (File != nullptr)
+	{
+		WritePending();
+		Pending = entry;
+		HavePending = true;
+	}
+}
+
+void FrameLog::WritePending()
+{
+	if (!HavePending)
+	{
+		return;
+	}
+	const FrameLogEntry &e = Pending;
+	if (JSON)
+	{
+		fprintf(File, "%s\n{\"frame\":%u,\"op\":%d,\"deltasize\":%u,"
+			"\"left\":%u,\"top\":%u,\"width\":%u,\"height\":%u,"
+			"\"palchanged\":%s,\"transparent\":%d,\"disposal\":%d,"
+			"\"lzwtrans\":%zu,\"lzwopaque\":%zu,\"lzwkept\":%zu,"
+			"\"convertus\":%lld,\"encodeus\":%lld}",
+			NumWritten > 0 ? "," : "", e.Frame, e.DeltaOp, e.DeltaSize,
+			e.Rect.Left, e.Rect.Top, e.Rect.Width, e.Rect.Height,
+			e.PalChanged ? "true" : "false", e.TransparentColor, e.Disposal,
+			e.LZWTrans, e.LZWOpaque, e.LZWKept,
+			(long long)e.ConvertMicrosecs, (long long)e.EncodeMicrosecs);
+	}
+	else
+	{
+		fprintf(File, "%u,%d,%u,%u,%u,%u,%u,%d,%d,%d,%zu,%zu,%zu,%lld,%lld\n",
+			e.Frame, e.DeltaOp, e.DeltaSize,
+			e.Rect.Left, e.Rect.Top, e.Rect.Width, e.Rect.Height,
+			e.PalChanged, e.TransparentColor, e.Disposal,
+			e.LZWTrans, e.LZWOpaque, e.LZWKept,
+			(long long)e.ConvertMicrosecs, (long long)e.EncodeMicrosecs);
+	}
+	NumWritten++;
+	HavePending = false;
+}
@@ -16,42 +16,98 @@
 ** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
 */
 
+#include <algorithm>
+#include <limits.h>
 #include <stdio.h>
 #include <string>
 #include <fstream>
+#include <thread>
 #include "iff2gif.h"
 
 static int usage(_TCHAR *progname)
 {
 	_ftprintf(stderr, _T(
 "Usage: %s [options] <source IFF> [dest GIF]\n"
+"       %s [options] -S <socket> [-j <threads>]\n"
 "  Options:\n"
+"    -a <frames>      Number of ANIM frames to read ahead of the one being\n"
+"                     decoded, on another thread. 0 turns it off. [8]\n"
+"    -b <size>        Budget: Give up quality until the GIF is no bigger than\n"
+"                     this many bytes, or kilobytes or megabytes with k or\n"
+"                     m at the end. With /s at the end, it is per second.\n"
+"    -C <x,y,w,h>     Only convert this part of the image. With \"auto\",\n"
+"                     crop away borders that are a solid color in the\n"
+"                     first frame.\n"
 "    -c <frames>      Clip out only the specified frames from the source.\n"
 "                     This is a comma-separated range of frames of the\n"
 "                     form \"start-end\" or a single frame number.\n"
+"    -D               Instead of a GIF, write a frame store holding the decoded\n"
+"                     frames. A frame store can be converted like any other\n"
+"                     input, without decoding it again. Its name defaults to\n"
+"                     the source with a .frames extension.\n"
 "    -f               Save each frame to a separate file. If consecutive\n"
 "                     '0's are present at the end of [dest GIF], they will\n"
 "                     be replaced with the frame number. Otherwise, the\n"
 "                     frame number will be inserted before the .gif\n"
 "                     extension.\n"
+"    -K <directory>   Keep converted GIFs in this directory, and copy them\n"
+"                     from there instead of converting the same file with\n"
+"                     the same options again. Not used with -f or -t.\n"
+"    -l <level>       Lossy LZW: Let pixels be written up to this far off\n"
+"                     their real color (0-254) if it makes the GIF smaller.\n"
+"                     Try 10-30. [0 = exact]\n"
 "    -n               No aspect ratio correction for (super)hires/interlace.\n"
+"    -O <level>       Effort: How hard to try to make each frame smaller.\n"
+"                     0 = fastest, 3 = smallest per frame, 4 = also go\n"
+"                     over the whole animation again at the end. [1]\n"
+"    -p <frame>       Preview: Write only this frame, and stop reading the\n"
+"                     source there. With \"auto\", pick the frame that\n"
+"                     changes the most, judging by the size of its delta.\n"
+"    -P <palette>     Palette for HAM and 24-bit images: \"adaptive\" to make\n"
+"                     one from their colors, or \"fixed\" for a web-safe one.\n"
+"                     [adaptive]\n"
 "    -r <frame rate>  Override the frame rate from the ANIM.\n"
-"    -x <x scale>     Scale image horizontally. Must be at least 1.\n"
-"    -y <y scale>     Scale image vertically. Must be at least 1.\n"
+"    -R <format>      Instead of a GIF, write uncompressed video for another\n"
+"                     encoder: rgb, rgba, or y4m. It goes to stdout unless\n"
+"                     [dest GIF] is given. Frames are repeated to keep a\n"
+"                     constant frame rate.\n"
+"    -S <socket>      Run as a server, taking conversion requests from the\n"
+"                     Unix domain socket, or from stdin if <socket> is -.\n"
+"                     The other options become defaults for every request.\n"
+"    -j <threads>     Number of conversions the server runs at once, or with\n"
+"                     -f, the number of frames encoded at once.\n"
+"    -T <ms>          Deadline: Give up quality to finish converting in this\n"
+"                     many milliseconds, and end the GIF early if that's\n"
+"                     not enough. Not used with -f or -b.\n"
+"    -t <log file>    Write a log of the encoder's decisions for each frame.\n"
+"                     The log is JSON if the name ends in .json, else CSV.\n"
+"    -x <x scale>     Scale image horizontally. Either a whole number, or a\n"
+"                     fraction such as 1/2 or 2/3 to shrink it.\n"
+"    -y <y scale>     Scale image vertically, like -x.\n"
 "    -s <scale>       Set both horizontal and vertical scale.\n"
 ),
-		progname);
+		progname, progname);
 	return 1;
 }
 
-static bool parseclip(std::vector<std::pair<unsigned, unsigned>> &clips, _TCHAR *clipstr)
+static bool parseclip(std::vector<std::pair<unsigned, unsigned>> &clips, const _TCHAR *clipstr)
 {
-	// Split into comma-seperated values
-	for (_TCHAR *tok = _tcstok(clipstr, _T(",")); tok != nullptr; tok = _tcstok(nullptr, _T(",")))
+	// Split into comma-seperated values. This does not use strtok, because
+	// the server parses options on more than one thread.
+	for (const _TCHAR *tok = clipstr; *tok != 0; )
 	{
-		_TCHAR *brk = _tcspbrk(tok, _T(":-"));
+		const _TCHAR *stop = _tcschr(tok, _T(','));
+		if (stop == nullptr) stop = tok + _tcslen(tok);
+		if (stop == tok)
+		{ // Empty value
+			tok++;
+			continue;
+		}
+		const _TCHAR *brk = tok;
+		while (brk < stop && *brk != _T(':') && *brk != _T('-'))
+			brk++;
 		unsigned start, end;
-		if (brk == nullptr)
+		if (brk == stop)
 		{
 			// Only one value, no range: Extract a single frame.
 			start = end = _tcstoul(tok, nullptr, 10);
@@ -70,26 +126,159 @@ static bool parseclip(std::vector<std::pair<unsigned, unsigned>> &clips, _TCHAR
 			return false;
 		}
 		clips.push_back(std::make_pair(start, end));
+		tok = *stop != 0 ? stop + 1 : stop;
 	}
 	return true;
 }
 
-void sortclips(std::vector<std::pair<unsigned, unsigned>> &clips)
+// A scale is either a whole number or a fraction like 1/2 or 2/3.
+static void parsescale(const _TCHAR *arg, int &scale, int &shrink)
 {
-	// Sort by start frame.
-	std::sort(begin(clips), end(clips));
+	const _TCHAR *slash = _tcschr(arg, _T('/'));
+	scale = _ttoi(arg);
+	shrink = slash != nullptr ? _ttoi(slash + 1) : 1;
+}
 
-	// Now check for overlapping or abutting ranges and combine them.
-	for (size_t i = 1; i < size(clips); ++i)
+// A crop is either "auto" or "x,y,w,h".
+static bool parsecrop(const _TCHAR *arg, GIFOptions &options)
+{
+	if (_tcscmp(arg, _T("auto")) == 0)
+	{
+		options.AutoCrop = true;
+		return true;
+	}
+	int *fields[4] = { &options.Crop.Left, &options.Crop.Top, &options.Crop.Width, &options.Crop.Height };
+	for (int i = 0; i < 4; ++i)
 	{
-		if (clips[i - 1].second >= clips[i].first - 1)
+		_TCHAR *end;
+		*fields[i] = (int)_tcstoul(arg, &end, 10);
+		if (end == arg || *end != (i < 3 ? _T(',') : 0))
 		{
-			clips[i - 1].second = std::max(clips[i - 1].second, clips[i].second);
-			clips.erase(begin(clips) + i);
-			// Backup since we deleted an element and need to recheck entry i.
-			--i;
+			_ftprintf(stderr, _T("Crop must be \"auto\" or \"x,y,width,height\"\n"));
+			return false;
 		}
+		arg = end + 1;
+	}
+	if (options.Crop.Width <= 0 || options.Crop.Height <= 0)
+	{
+		_ftprintf(stderr, _T("Crop width and height must be at least 1\n"));
+		return false;
 	}
+	options.AutoCrop = false;
+	return true;
+}
+
+// A budget is a number of bytes, optionally followed by k or m for kilobytes
+// or megabytes, and /s to make it per second.
+static bool parsebudget(const _TCHAR *arg, GIFOptions &options)
+{
+	_TCHAR *end;
+	unsigned long long size = _tcstoull(arg, &end, 10);
+	if (*end == _T('k') || *end == _T('K'))
+	{
+		size *= 1024, end++;
+	}
+	else if (*end == _T('m') || *end == _T('M'))
+	{
+		size *= 1024 * 1024, end++;
+	}
+	options.BudgetPerSecond = _tcscmp(end, _T("/s")) == 0;
+	if (end == arg || (*end != 0 && !options.BudgetPerSecond) || size == 0 || size > UINT32_MAX)
+	{
+		_ftprintf(stderr, _T("Budget must be a number of bytes, like 500000, 500k, or 2m, optionally followed by /s\n"));
+		return false;
+	}
+	options.Budget = (uint32_t)size;
+	return true;
+}
+
+int ParseGIFOption(int opt, const _TCHAR *arg, GIFOptions &options)
+{
+	switch (opt)
+	{
+	case 'f':
+		options.Solo = true;
+		break;
+	case 'r':
+		options.ForcedRate = _ttoi(arg);
+		break;
+	case 'c':
+		if (!parseclip(options.Clips, arg))
+			return -1;
+		break;
+	case 'x':
+		parsescale(arg, options.ScaleX, options.ShrinkX);
+		break;
+	case 'y':
+		parsescale(arg, options.ScaleY, options.ShrinkY);
+		break;
+	case 's':
+		parsescale(arg, options.ScaleX, options.ShrinkX);
+		parsescale(arg, options.ScaleY, options.ShrinkY);
+		break;
+	case 'n':
+		options.AspectScale = false;
+		break;
+	case 'd':
+		options.DiffusionMode = _ttoi(arg);
+		break;
+	case 'l':
+		options.Lossy = _ttoi(arg);
+		if (options.Lossy < 0 || options.Lossy >= LossyLZW::TOO_FAR)
+		{
+			_ftprintf(stderr, _T("Lossy level must be between 0 and %d\n"), LossyLZW::TOO_FAR - 1);
+			return -1;
+		}
+		break;
+	case 'b':
+		if (!parsebudget(arg, options))
+			return -1;
+		break;
+	case 'O':
+		options.Effort = _ttoi(arg);
+		if (options.Effort < 0 || options.Effort > 4)
+		{
+			_ftprintf(stderr, _T("Effort level must be between 0 and 4\n"));
+			return -1;
+		}
+		break;
+	case 'T':
+		if (_ttoi(arg) <= 0)
+		{
+			_ftprintf(stderr, _T("Deadline must be a number of milliseconds\n"));
+			return -1;
+		}
+		options.Deadline = _ttoi(arg);
+		break;
+	case 'C':
+		if (!parsecrop(arg, options))
+			return -1;
+		break;
+	case 'P':
+		if (_tcscmp(arg, _T("adaptive")) != 0 && _tcscmp(arg, _T("fixed")) != 0)
+		{
+			_ftprintf(stderr, _T("Palette must be \"adaptive\" or \"fixed\"\n"));
+			return -1;
+		}
+		options.FixedPalette = _tcscmp(arg, _T("fixed")) == 0;
+		break;
+	case 'p':
+		options.Preview = _tcscmp(arg, _T("auto")) == 0 ? -1 : _ttoi(arg);
+		if (options.Preview == 0 || options.Preview < -1)
+		{
+			_ftprintf(stderr, _T("Preview frame must be a frame number or \"auto\"\n"));
+			return -1;
+		}
+		break;
+	default:
+		return 0;
+	}
+	if (options.ScaleX < 1 || options.ScaleY < 1 || options.ShrinkX < 1 || options.ShrinkY < 1)
+	{
+		_ftprintf(stderr, _T("Scale must be a positive whole number or fraction\n"));
+		return -1;
+	}
+	return 1;
 }
 
 int _tmain(int argc, _TCHAR* argv[])
@@ -98,55 +287,65 @@ int _tmain(int argc, _TCHAR* argv[])
 	std::ifstream infile;
 	tstring outstring;
 	int opt;
-	bool solomode = false;
-	int forcedrate = 0;
-	int diffusionmode = 1;
-	int scalex = 1, scaley = 1;
-	bool aspectscale = true;
-	std::vector<std::pair<unsigned, unsigned>> clips;
+	GIFOptions options;
+	FrameLog framelog;
+	_TCHAR *server = nullptr;
+	_TCHAR *cachedir = nullptr;
+	bool logging = false;
+	bool dumpframes = false;
+	bool raw = false;
+	RawWriter::Format rawformat = RawWriter::RGB24;
+	int threads = 0;
+	int readahead = 8;
 
-	while ((opt = getopt(argc, argv, "fr:c:x:y:s:nd:")) != -1)
+	while ((opt = getopt(argc, argv, GIF_OPTIONS "t:S:j:K:DR:a:")) != -1)
 	{
 		switch (opt)
 		{
-		case 'f':
-			solomode = true;
+		case 't':
+			if (!framelog.Open(optarg))
+				return 2;
+			logging = true;
 			break;
-		case 'r':
-			forcedrate = _ttoi(optarg);
-			break;
-		case 'c':
-			if (!parseclip(clips, optarg))
-				return 1;
+		case 'K':
+			cachedir = optarg;
 			break;
-		case 'x':
-			scalex = _ttoi(optarg);
+		case 'D':
+			dumpframes = true;
 			break;
-		case 'y':
-			scaley = _ttoi(optarg);
+		case 'R':
+			if (!RawWriter::ParseFormat(optarg, rawformat))
+			{
+				_ftprintf(stderr, _T("Unknown raw format %s\n"), optarg);
+				return 1;
+			}
+			raw = true;
 			break;
-		case 's':
-			scalex = scaley = _ttoi(optarg);
+		case 'S':
+			server = optarg;
 			break;
-		case 'n':
-			aspectscale = false;
+		case 'j':
+			threads = _ttoi(optarg);
 			break;
-		case 'd':
-			diffusionmode = _ttoi(optarg);
+		case 'a':
+			readahead = std::max(0, _ttoi(optarg));
 			break;
 		default:
-			return usage(argv[0]);
+			switch (ParseGIFOption(opt, optarg, options))
+			{
+			case 0:
+				return usage(argv[0]);
+			case -1:
+				return 1;
+			}
 		}
 	}
 
-	if (scalex < 1 || scaley < 1)
+	if (server != nullptr)
 	{
-		_ftprintf(stderr, _T("Scale must be at least 1\n"));
-		return 1;
+		return RunServer(server, threads, options, cachedir);
 	}
-
-	sortclips(clips);
-
+	options.Threads = threads > 0 ? threads : std::max(1u, std::thread::hardware_concurrency());
 	if (optind >= argc)
 	{
 		return usage(argv[0]);
@@ -162,6 +361,10 @@ int _tmain(int argc, _TCHAR* argv[])
 	{
 		outstring = argv[optind + 1];
 	}
+	else if (raw)
+	{
+		outstring = _T("-");
+	}
 	else
 	{
 		outstring = inparm;
@@ -177,10 +380,52 @@ int _tmain(int argc, _TCHAR* argv[])
 				outstring.resize(stop);
 			}
 		}
-		// Append the .gif extension to the input name.
-		outstring += _T(".gif");
+		// Append the .gif (or .frames) extension to the input name.
+		outstring += dumpframes ? _T(".frames") : _T(".gif");
+	}
+	if (dumpframes)
+	{
+		FrameStoreWriter store;
+		if (!store.Open(outstring))
+		{
+			return 2;
+		}
+		bool loaded = LoadFile(inparm, infile, store, readahead);
+		return store.Close() && loaded ? 0 : 1;
+	}
+	if (outstring == _T("-"))
+	{
+		// Keep stdout for the output.
+		options.Quiet = true;
+	}
+	if (raw)
+	{
+		FileSink file;
+		ThreadedSink sink(file);
+		RawWriter writer(sink, outstring, options, rawformat);
+		bool loaded = LoadFile(inparm, infile, writer, readahead);
+		bool written = writer.Finish();
+		return sink.Close() && written && loaded ? 0 : 1;
+	}
+	if (cachedir != nullptr && !options.Solo && !logging)
+	{
+		// The whole file is needed to look it up in the cache.
+		GIFCache cache(cachedir);
+		std::vector<uint8_t> data, gif;
+		uint32_t frames;
+		if (!ReadIFF(inparm, infile, data) ||
+			!cache.Convert(data.data(), data.size(), options, inparm, gif, frames))
+		{
+			return 1;
+		}
+		return WriteGIF(outstring, gif) ? 0 : 1;
 	}
-	GIFWriter writer(outstring, solomode, forcedrate, scalex, scaley, aspectscale, clips, diffusionmode);
-	LoadFile(argv[1], infile, writer);
-	return 0;
+	// Writing happens on another thread, so the encoder doesn't wait for it.
+	FileSink file;
+	ThreadedSink sink(file);
+	GIFWriter writer(sink, outstring, options);
+	writer.SetFrameLog(&framelog);
+	bool loaded = LoadFile(inparm, infile, writer, readahead);
+	bool written = writer.Finish();
+	return sink.Close() && written && loaded ? 0 : 1;
 }
@@ -18,23 +18,82 @@
 
 #include <vector>
 #include <queue>
+#include <deque>
+#include <memory>
+#include <functional>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 #include <iostream>
 #include "types.h"
 #include "iff.h"
 
-struct PlanarBitmap
+// A palette that can't be changed. Every palette with the same colors shares
+// one copy of them, so copying one is cheap, and two are the same if they
+// point at the same copy. Id tells palettes apart for as long as the program
+// runs, without keeping them alive, so things made from one palette can be
+// remembered by it. See palette.cpp.
+class SharedPalette
 {
-	int Width = 0, Height = 0, Pitch = 0;
+public:
+	struct Colors;
+
+	SharedPalette() noexcept {}
+	SharedPalette(std::vector<ColorRegister> &&colors);
+	SharedPalette(const std::vector<ColorRegister> &colors);
+
+	const std::vector<ColorRegister> &Entries() const noexcept;
+	operator const std::vector<ColorRegister> &() const noexcept { return Entries(); }
+	uint64_t Hash() const noexcept;
+	uint64_t Id() const noexcept;
+
+	// Returns a copy with colors cut off or black ones added at the end.
+	SharedPalette Resized(size_t size) const;
+
+	bool operator==(const SharedPalette &o) const noexcept { return Shared == o.Shared; }
+	bool operator!=(const SharedPalette &o) const noexcept { return Shared != o.Shared; }
+
+	size_t size() const noexcept { return Entries().size(); }
+	bool empty() const noexcept { return Shared == nullptr; }
+	const ColorRegister &operator[](size_t i) const noexcept { return Entries()[i]; }
+	const ColorRegister *data() const noexcept { return Entries().data(); }
+	std::vector<ColorRegister>::const_iterator begin() const noexcept { return Entries().begin(); }
+	std::vector<ColorRegister>::const_iterator end() const noexcept { return Entries().end(); }
+
+private:
+	std::shared_ptr<const Colors> Shared;
+
+	void Intern(std::vector<ColorRegister> &&colors);
+};
+
+// Everything about a frame except its pixels.
+struct FrameInfo
+{
+	int Width = 0, Height = 0;
 	int NumPlanes = 0;
-	std::vector<ColorRegister> Palette;
-	uint8_t *Planes[32]{nullptr};	// Points into PlaneData
-	uint8_t *PlaneData = nullptr;
+	SharedPalette Palette;
 	int TransparentColor = -1;
 	int Delay = 0;
 	int Rate = 60;
 	uint8_t Interleave = 0;
 	int NumFrames = 0;				// A hint, not authoritative
 	int ModeID = 0;
+	int DeltaOp = 0;				// ANIM operation that produced this frame (0 = BODY)
+	uint32_t DeltaSize = 0;			// Size of the BODY or DLTA chunk it came from
+};
+
+struct CropRect
+{
+	int Left = 0, Top = 0, Width = 0, Height = 0;
+};
+
+struct PlanarBitmap : FrameInfo
+{
+	int Pitch = 0;
+	uint8_t *Planes[32]{nullptr};	// Points into PlaneData
+	uint8_t *PlaneData = nullptr;
 
 	PlanarBitmap(int w, int h, int nPlanes);
 	PlanarBitmap(const PlanarBitmap &o);
@@ -45,8 +104,19 @@ struct PlanarBitmap
 	// destextrawidth is the number of pixels between the end of the row
 	// in the source image and the end of the row in the dest image.
 	void ToChunky(void *dest, int destextrawidth) const;
+	void ToChunky(void *dest, int destextrawidth, int left, int top, int width, int height) const;
+
+	// The reverse of ToChunky, for writing ILBMs. srcextrawidth is the number
+	// of pixels between the end of a row in this image and the end of the row
+	// in the source image.
+	void FromChunky(const void *src, int srcextrawidth);
+
+private:
+	uint32_t GetPixel(uint32_t rowstart, int x) const;
 };
 
+class ColorLookup;
+
 class ChunkyBitmap
 {
 public:
@@ -54,23 +124,38 @@ public:
 	uint8_t *Pixels = nullptr;
 
 	ChunkyBitmap() {}
-	ChunkyBitmap(const PlanarBitmap &o, int scalex = 1, int scaley = 1);
+	ChunkyBitmap(const PlanarBitmap &o, int scalex = 1, int scaley = 1, const CropRect *crop = nullptr);
 	ChunkyBitmap(const ChunkyBitmap &o, int fillcolor);
 	ChunkyBitmap(int w, int h, int bpp = 1);
 	ChunkyBitmap(ChunkyBitmap &&o) noexcept;
-	ChunkyBitmap &ChunkyBitmap::operator=(ChunkyBitmap &&o) noexcept;
+	ChunkyBitmap &operator=(ChunkyBitmap &&o) noexcept;
 	~ChunkyBitmap();
 
-	bool IsEmpty() noexcept { return Pixels == nullptr; }
+	bool IsEmpty() const noexcept { return Pixels == nullptr; }
 	void Clear(bool release=true) noexcept;
 	void SetSolidColor(int color) noexcept;
 
+	// Replaces every color in a palette image with the one it maps to.
+	void Remap(const uint8_t remap[256]) noexcept;
+
 	// Expand an image in the upper left corner of the bitmap to fill the
 	// entire bitmap.
 	void Expand(int scalex, int scaley) noexcept;
 
+	// Returns a copy that is scalex times wider and scaley times taller.
+	ChunkyBitmap Scaled(int scalex, int scaley) const;
+
+	// Returns a copy of part of the bitmap.
+	ChunkyBitmap Cropped(const CropRect &rect) const;
+
+	// Returns a copy that is divx times narrower and divy times shorter,
+	// rounded up. Palette images use the nearest pixel, and RGB images use the
+	// average of every pixel that went into each one.
+	ChunkyBitmap Shrunk(int divx, int divy) const;
+
 	// Reduce higher bit depth image to 8-bits
 	ChunkyBitmap RGBtoPalette(const std::vector<ColorRegister> &pal, int dithermode) const;
+	ChunkyBitmap RGBtoPalette(ColorLookup &lookup, int dithermode) const;
 
 	// Convert HAM to RGB
 	ChunkyBitmap HAM6toRGB(const std::vector<ColorRegister> &pal) const;
@@ -92,14 +177,103 @@ private:
 	void Expand2(int scalex, int scaley, int srcwidth, int srcheight, const uint16_t *src, uint16_t *dest) noexcept;
 	void Expand4(int scalex, int scaley, int srcwidth, int srcheight, const uint32_t *src, uint32_t *dest) noexcept;
 
-	// Helper functions for RGBtoPalette
-	void RGB2P_BasicQuantize(ChunkyBitmap &out, const std::vector<ColorRegister> &pal) const;
-	void RGB2P_ErrorDiffusion(ChunkyBitmap &out, const std::vector<ColorRegister> &pal, const Diffuser *kernel) const;
+	// Helper functions for Shrunk
+	void Shrink1(ChunkyBitmap &out, int divx, int divy) const noexcept;
+	void Shrink4(ChunkyBitmap &out, int divx, int divy) const noexcept;
+
+	// Helper functions for RGBtoPalette. The lookup is optional.
+	ChunkyBitmap RGB2P(const std::vector<ColorRegister> &pal, ColorLookup *lookup, int dithermode) const;
+	void RGB2P_BasicQuantize(ChunkyBitmap &out, const std::vector<ColorRegister> &pal, ColorLookup *lookup) const;
+	void RGB2P_ErrorDiffusion(ChunkyBitmap &out, const std::vector<ColorRegister> &pal, const Diffuser *kernel,
+		ColorLookup *lookup) const;
 
 	// Allocate the buffer
 	void Alloc(int w, int h, int bpp);
 };
 
+// Finds the nearest color in a palette, remembering the answer for every
+// color close to it (6 bits per channel), so that each is only searched for
+// once. Not safe to share between threads.
+class ColorLookup
+{
+public:
+	ColorLookup(std::vector<ColorRegister> &&pal);
+
+	int Nearest(int r, int g, int b);
+
+	const SharedPalette Palette;
+
+private:
+	std::vector<uint16_t> Cache;
+};
+
+// Counts the colors of RGB images, to make a palette for them. See quantize.cpp.
+class ColorHistogram
+{
+public:
+	ColorHistogram();
+
+	void Clear();
+	void Add(const ChunkyBitmap &rgb);
+
+	// Makes a palette of up to numcolors colors, fewer if there aren't
+	// that many different ones.
+	std::vector<ColorRegister> MakePalette(int numcolors) const;
+
+	// The average weighted squared distance of the counted colors from the
+	// ones lookup would pick for them.
+	double Error(ColorLookup &lookup) const;
+
+private:
+	struct Cell
+	{
+		uint64_t Count = 0;
+		uint64_t Sum[3] = {};
+	};
+	struct Box;
+	std::vector<Cell> Cells;
+	uint64_t Total = 0;
+
+	void Fit(Box &box) const;
+	bool Split(Box &box, Box &other) const;
+};
+
+// Converts a chunky HAM frame to RGB, leaving other frames untouched.
+void DecodeHAM(FrameInfo &info, ChunkyBitmap &chunky);
+
+// Multiplies scalex and scaley to correct the aspect ratio of (super)hires
+// and interlaced screen modes.
+void AspectCorrection(int modeid, int &scalex, int &scaley);
+
+// Reduces the fraction scale/shrink, so that a frame is not enlarged only to
+// be shrunk again.
+void ReduceScale(int &scale, int &shrink);
+
+// Receives frames as they are read, either still planar, straight from the
+// IFF, or already converted to chunky (e.g. from a frame store). Chunky frames
+// are not scaled, and HAM frames have not been decoded yet, so they are either
+// 8-bit palette indices or RGB for deep images.
+class FrameConsumer
+{
+public:
+	virtual ~FrameConsumer() {}
+
+	// By default, converts the frame to chunky and passes it to the other AddFrame.
+	virtual void AddFrame(PlanarBitmap *bitmap);
+	virtual void AddFrame(FrameInfo &info, ChunkyBitmap &&chunky) = 0;
+	virtual bool IsQuiet() const { return false; }
+
+	// Loaders stop reading frames once this returns true.
+	virtual bool IsDone() const { return false; }
+
+	// If this returns true, loaders first look at how big each frame's delta
+	// is, without decoding anything, and pass the number of the frame with
+	// the biggest one to SelectFrame. It's only a guess at which frame
+	// changes the most, but a cheap one.
+	virtual bool WantsBusiestFrame() const { return false; }
+	virtual void SelectFrame(unsigned /*frame*/) {}
+};
+
 class IFFChunk
 {
 public:
@@ -136,6 +310,20 @@ private:
 	uint32_t Pos;
 };
 
+// Builds an IFF file in memory. FORMs may be nested.
+class IFFWriter
+{
+public:
+	void PushForm(uint32_t type);
+	void PopForm();
+	void AddChunk(uint32_t id, const void *data, uint32_t len);
+	void AddChunk(uint32_t id, const std::vector<uint8_t> &data) { AddChunk(id, data.data(), (uint32_t)data.size()); }
+	const std::vector<uint8_t> &GetData() const { return Data; }
+
+private:
+	std::vector<uint8_t> Data;
+	std::vector<size_t> Forms;	// Offsets of the length fields of open FORMs
+};
 
 struct LogicalScreenDescriptor
 {
@@ -166,6 +354,53 @@ struct ImageDescriptor
 	uint8_t Flags;
 };
 
+// Where GIFWriter sends its output. Each GIF starts with a call to Begin
+// and ends with a call to End. In solo mode, there is one GIF per frame.
+class GIFSink
+{
+public:
+	virtual ~GIFSink() {}
+
+	// filename is only a suggestion. Sinks that don't write files can ignore it.
+	virtual bool Begin(const tstring &filename) = 0;
+	virtual bool Write(const void *data, size_t len) = 0;
+	// If ok is false, the GIF is incomplete because something failed.
+	virtual bool End(bool ok) = 0;
+};
+
+// Writes each GIF to the file it is named after, or to stdout if that is "-".
+class FileSink : public GIFSink
+{
+public:
+	~FileSink();
+
+	bool Begin(const tstring &filename) override;
+	bool Write(const void *data, size_t len) override;
+	bool End(bool ok) override;
+
+private:
+	FILE *File = nullptr;
+	tstring Filename;
+};
+
+// Collects each GIF in memory and hands it to a callback once it is complete.
+// If the callback returns false, conversion stops.
+class MemorySink : public GIFSink
+{
+public:
+	typedef std::function<bool(std::vector<uint8_t> &&gif)> Callback;
+
+	MemorySink(Callback callback) : OnGIF(std::move(callback)) {}
+
+	bool Begin(const tstring &/*filename*/) override { Data.clear(); return true; }
+	bool Write(const void *data, size_t len) override;
+	bool End(bool ok) override;
+
+private:
+	Callback OnGIF;
+	std::vector<uint8_t> Data;
+};
+
 struct GIFFrame
 {
 	GIFFrame();
@@ -175,12 +410,12 @@ struct GIFFrame
 
 	void SetDelay(int centisecs) { GCE.DelayTime = centisecs; }
 	void SetDisposal(int method) { GCE.Flags = (GCE.Flags & 0x1C0) | (method << 2); }
-	bool Write(FILE *file);
+	bool Write(GIFSink *sink);
 
 	GraphicControlExtension GCE;
 	ImageDescriptor IMD;
 	uint8_t LocalPalBits = 0;
-	std::vector<ColorRegister> LocalPalette;
+	SharedPalette LocalPalette;
 	std::vector<uint8_t> LZW;
 };
 
@@ -197,9 +432,14 @@ public:
 	bool Enqueue(GIFFrame &&frame);
 	bool Flush();
 	void SetDropFrames(int count) { FinalFramesToDrop = count; }
+	size_t DropCount() const { return FinalFramesToDrop; }
 	GIFFrame* MostRecent() { return Queue.empty() ? nullptr : &Queue.back(); }
+	void KeepAll() { Limit = SIZE_MAX; }	// Writes nothing until Flush
+	bool KeepRecent();					// Undoes KeepAll
+	std::deque<GIFFrame> &Frames() { return Queue; }
 	unsigned int Total() { return TotalQueued; }
-	void SetFile(FILE *f) { File = f; }
+	unsigned int Written() { return TotalWritten; }
+	void SetSink(GIFSink *sink) { Sink = sink; }
 
 private:
 	bool Shift();
@@ -208,25 +448,256 @@ private:
 	// doesn't really matter what this is.
 	enum { MAX_QUEUE_SIZE = 8 };
 
-	FILE *File;
+	GIFSink *Sink;
 	size_t FinalFramesToDrop;		// ANIMs duplicate frames at the end to facilitate looping
-	std::queue<GIFFrame> Queue;		// oldest frames come first
+	size_t Limit = MAX_QUEUE_SIZE;
+	std::deque<GIFFrame> Queue;		// oldest frames come first
 	unsigned TotalQueued = 0;		// Total # of frames that have ever been queued (not just queued now)
+	unsigned TotalWritten = 0;		// Total # of frames that made it to the sink
 };
 
-class GIFWriter
+// Lets LZWCompress write a pixel as a different color than it really is, if
+// that makes for a longer match and the colors are no more than a tolerance
+// apart. The Exact color, which is the transparent one, is never substituted,
+// and nothing is ever substituted with it.
+class LossyLZW
 {
 public:
-	GIFWriter(tstring filename, bool solo, int forcedrate, int scalex, int scaley,
-		bool aspectscale, std::vector<std::pair<unsigned, unsigned>> &clips, int diffusionmode);
-	~GIFWriter();
+	enum { TOO_FAR = 255 };
+
+	LossyLZW(const std::vector<ColorRegister> &palette, int tolerance);
 
-	void AddFrame(PlanarBitmap *bitmap);
+	int Exact = -1;
+
+	// Returns TOO_FAR if b can't be written in place of a.
+	int Distance(int a, int b) const { return a == Exact || b == Exact ? (int)TOO_FAR : (int)Dist[a * 256 + b]; }
+
+private:
+	std::vector<uint8_t> Dist;
+};
+
+// An optional per-frame record of the encoder's decisions, written as either
+// CSV or JSON. Entries are held back by one frame, because the disposal
+// method for a frame is not known until the following frame is made.
+struct FrameLogEntry
+{
+	uint32_t Frame = 0;
+	int DeltaOp = 0;
+	uint32_t DeltaSize = 0;
+	ImageDescriptor Rect = {};
+	bool PalChanged = false;
+	int TransparentColor = -1;		// Transparent color used by this frame, -1 if none
+	int Disposal = 0;
+	size_t LZWTrans = 0;			// Size with transparent substitution, 0 if not tried
+	size_t LZWOpaque = 0;			// Size without transparent substitution
+	size_t LZWKept = 0;
+	int64_t ConvertMicrosecs = 0;	// Planar to chunky, HAM, and quantization
+	int64_t EncodeMicrosecs = 0;	// Everything in MakeFrame
+};
+
+class FrameLog
+{
+public:
+	FrameLog() {}
+	~FrameLog();
+
+	bool Open(const tstring &filename);
+	void Add(const FrameLogEntry &entry);
+	void SetDisposal(int method) { if (HavePending) Pending.Disposal = method; }
 
 private:
+	void WritePending();
+
 	FILE *File = nullptr;
+	bool JSON = false;
+	bool HavePending = false;
+	unsigned NumWritten = 0;
+	FrameLogEntry Pending;
+};
+
+// Jobs waiting for a worker thread. The queue is bounded, so whatever is
+// adding jobs faster than they can be done gets slowed down instead of
+// filling memory with them.
+template<class Job>
+class WorkQueue
+{
+public:
+	WorkQueue(size_t limit) : Limit(limit) {}
+
+	bool Push(Job &&job)
+	{
+		std::unique_lock<std::mutex> lock(Lock);
+		NotFull.wait(lock, [this] { return Queue.size() < Limit || Stopping; });
+		if (Stopping)
+			return false;
+		Queue.push_back(std::move(job));
+		NotEmpty.notify_one();
+		return true;
+	}
+
+	// Returns false once the queue has been stopped and emptied.
+	bool Pop(Job &job)
+	{
+		std::unique_lock<std::mutex> lock(Lock);
+		NotEmpty.wait(lock, [this] { return !Queue.empty() || Stopping; });
+		if (Queue.empty())
+			return false;
+		job = std::move(Queue.front());
+		Queue.pop_front();
+		NotFull.notify_one();
+		return true;
+	}
+
+	void Stop()
+	{
+		std::lock_guard<std::mutex> lock(Lock);
+		Stopping = true;
+		NotEmpty.notify_all();
+		NotFull.notify_all();
+	}
+
+private:
+	std::mutex Lock;
+	std::condition_variable NotEmpty, NotFull;
+	std::deque<Job> Queue;
+	size_t Limit;
+	bool Stopping = false;
+};
+
+// Passes everything on to another sink from a thread of its own, so whatever
+// is writing never waits for the disk or a pipe. Writes are collected into
+// buffers, and only a few of them can be waiting at once. Since the real sink
+// runs later, its errors show up late: Once it fails, Write and End return
+// false, and so does Close, which waits for everything to be written.
+class ThreadedSink : public GIFSink
+{
+public:
+	ThreadedSink(GIFSink &sink);
+	~ThreadedSink();
+
+	bool Begin(const tstring &filename) override;
+	bool Write(const void *data, size_t len) override;
+	bool End(bool ok) override;
+	bool Close();
+
+private:
+	struct Op
+	{
+		enum { BEGIN, WRITE, END } Type = WRITE;
+		tstring Filename;			// For BEGIN
+		std::vector<uint8_t> Data;	// For WRITE
+		bool OK = true;				// For END
+	};
+	enum { BUFFER_SIZE = 64 * 1024, MAX_WAITING = 4 };
+
+	GIFSink &Sink;
+	WorkQueue<Op> Ops;
+	std::vector<uint8_t> Buffer;
+	std::atomic<bool> Failed{ false };
+	bool Closed = false;
+	std::thread Writer;
+
+	void Send(Op &&op);
+	void Flush();
+	void Run();
+};
+
+// Everything that controls how GIFWriter converts frames.
+struct GIFOptions
+{
+	bool Solo = false;				// Write each frame to a separate GIF
+	int Threads = 1;				// Frames to encode at once in solo mode
+	int ForcedRate = 0;				// Frame rate to use instead of the ANIM's, if > 0
+	int ScaleX = 1, ScaleY = 1;
+	int ShrinkX = 1, ShrinkY = 1;	// The size is multiplied by Scale and then divided by Shrink
+	bool AspectScale = true;		// Correct the aspect ratio of (super)hires and interlaced modes
+	CropRect Crop;					// Part of the image to convert, before scaling; Width 0 for all of it
+	bool AutoCrop = false;			// Crop away borders that are one solid color in the first frame
+	int DiffusionMode = 1;			// For RGBtoPalette
+	bool FixedPalette = false;		// Use DumbPalette for HAM and 24-bit images instead of one made for them
+	int Lossy = 0;					// How far off a pixel's color may be written for better LZW (0-254)
+	int Effort = 1;					// How hard to try for smaller frames (0-4; 4 is 3 with Solo or a Deadline)
+	uint32_t Budget = 0;			// If > 0, give up quality until the GIF is no bigger than this
+	bool BudgetPerSecond = false;	// Budget is per second of animation instead of for the whole GIF
+	uint32_t Deadline = 0;			// If > 0, give up quality to finish in this many milliseconds
+	bool Quiet = false;				// Don't print informational messages to stdout
+	int Preview = 0;				// Only convert this frame (-1 = the busiest one), overriding Clips
+	std::vector<std::pair<unsigned, unsigned>> Clips;	// Ranges of frames to convert; empty for all
+};
+
+// The command line options that fill in a GIFOptions, in getopt form. The
+// server accepts the same options with each request.
+#define GIF_OPTIONS "fr:c:x:y:s:nd:p:C:l:O:b:T:P:"
+
+// Turns frames into chunky pixels the way they will be written: Cropped,
+// scaled, aspect corrected, HAM decoded, and shrunk. The first frame decides
+// the scale and the crop for the rest of them.
+class FramePrep
+{
+public:
+	FramePrep(const GIFOptions &options);
+
+	// These return an empty bitmap if the crop is not inside the first frame.
+	ChunkyBitmap Convert(PlanarBitmap &bitmap);
+	ChunkyBitmap Convert(FrameInfo &info, ChunkyBitmap &&chunky);
+
+private:
+	int ScaleX, ScaleY;
+	int ShrinkX, ShrinkY;
+	bool AutoAspectScale;
+	bool AutoCrop;
+	CropRect Crop;
+	bool Started = false;
+	bool Failed = false;
+
+	bool Start(FrameInfo &info, const ChunkyBitmap &unscaled);
+	ChunkyBitmap Finish(FrameInfo &info, ChunkyBitmap &&chunky, bool ham);
+};
+
+class GIFWriter : public FrameConsumer
+{
+public:
+	GIFWriter(GIFSink &sink, tstring filename, const GIFOptions &options);
+	~GIFWriter();
+
+	void AddFrame(PlanarBitmap *bitmap) override;
+	void AddFrame(FrameInfo &info, ChunkyBitmap &&chunky) override;
+	void SetFrameLog(FrameLog *log) { Log = log; }
+	uint32_t GetFrameCount() const { return FrameCount; }
+	uint32_t GetFramesWritten() { return WriteQueue.Written() + SoloWritten + BudgetWritten; }
+	bool IsQuiet() const override { return Quiet; }
+	bool IsDone() const override { return Failed || Clips.empty(); }
+	bool WantsBusiestFrame() const override { return PickFrame; }
+	void SelectFrame(unsigned frame) override;
+
+	// What was given up to meet a deadline, as flags.
+	enum
+	{
+		DEGRADE_SEARCH = 1,		// The extra searches done at effort 2 and 3
+		DEGRADE_RETRY = 2,		// Compressing each frame again without transparency
+		DEGRADE_DITHER = 4,		// Dithering, for HAM and 24-bit images
+		DEGRADE_CUT = 8,		// The frames still left when time ran out
+
+		NUM_DEGRADES = 4
+	};
+	int GetDegraded() const { return Degraded; }
+	std::string DescribeDegraded() const;	// Like "retry,dither", or empty for nothing
+
+	// Writes anything still queued and finishes the last GIF. This is done
+	// automatically by the destructor, but calling it yourself lets you know
+	// whether everything was written successfully.
+	bool Finish();
+
+	static void MinimumArea(const ChunkyBitmap &prev, const ChunkyBitmap &cur, ImageDescriptor &imd);
+
+private:
+	GIFSink &Sink;
+	bool SinkOpen = false;
+	bool Failed = false;
+	bool Finished = false;
 	tstring BaseFilename;
 	ChunkyBitmap PrevFrame;
+	ChunkyBitmap Under;		// At effort 3: What was there before PrevFrame was drawn
 	GIFFrameQueue WriteQueue;
 	uint32_t FrameCount = 0;
 	uint32_t TotalTicks = 0;
@@ -235,13 +706,56 @@ private:
 	LogicalScreenDescriptor LSD;
 	uint8_t BkgColor = 0;
 	uint16_t PageWidth = 0, PageHeight = 0;
-	std::vector<ColorRegister> GlobalPal;
+	SharedPalette GlobalPal;
 	uint8_t GlobalPalBits = 0;
-	int ScaleX = 1, ScaleY = 1;
-	bool AutoAspectScale;
+	FramePrep Prep;
 	bool ForcedFrameRate;
 	int DiffusionMode = 0;
+	int Lossy = 0;
+	std::unique_ptr<LossyLZW> LossyTable;	// Kept for as long as the palette it was made for is used
+	uint64_t LossyPaletteId = 0;
+	int Effort = 1;
+	bool Quiet = false;
+	int Preview = 0;
+	bool PickFrame = false;
 	std::vector<std::pair<unsigned, unsigned>> Clips;
+	FrameLog *Log = nullptr;
+	int64_t ConvertMicrosecs = 0;	// For the frame log: time spent converting the current frame
+	int64_t EncodeMicrosecs = 0;	// Time spent compressing the last frame
+
+	// With a deadline, how long frames have been taking recently, and what
+	// was given up at which frame to keep up.
+	uint32_t Deadline = 0;			// Milliseconds
+	std::chrono::steady_clock::time_point StartTime, FrameStart;
+	int64_t AvgFrame = 0, AvgConvert = 0, AvgEncode = 0;
+	int Samples = 0;				// Frames timed since the last thing was given up
+	uint32_t ExpectedFrames = 0;
+	bool TrueColor = false;			// Frames are quantized, so dithering matters
+	int Degraded = 0;
+	uint32_t DegradedAt[NUM_DEGRADES] = {};
+	int Trying = 0;					// Given up, but not yet known to help
+	int64_t TryingFrom = 0;			// AvgConvert before giving it up
+	int SavedDiffusion = 0;
+	int Useless = 0;				// Given up once and taken back
+
+	// A frame kept to be converted later.
+	struct HeldFrame
+	{
+		FrameInfo Info;
+		ChunkyBitmap Chunky;
+	};
+
+	// HAM and 24-bit frames get a palette made from their colors, unless
+	// FixedPalette is set. The first few frames are held back until there
+	// are enough of them to make one palette for them all. After that, the
+	// palette only changes when a frame's colors are too far from it.
+	bool FixedPalette = false;
+	std::unique_ptr<ColorLookup> Adaptive;
+	double AdaptiveError = 0;		// How well it fits the colors it was made from
+	ColorHistogram Histogram;
+	std::vector<HeldFrame> PaletteSamples;
+	size_t SampleFrames = 1;
+	bool Releasing = false;
 
 	bool SoloMode = false;
 	int SFrameIndex = 0;	// In solo mode: Character index where frame number starts
@@ -249,13 +763,84 @@ private:
 	int SExtIndex = -1;		// In solo mode: Character index where extension starts
 	tstring Filename;
 
-	static int ExtendPalette(std::vector<ColorRegister> &dest, const std::vector<ColorRegister> &src);
+	// In solo mode with more than one thread, every frame after the first is
+	// encoded by Pool, and the GIFs are written here in order by WriteSolo.
+	struct SoloPool;
+	struct SoloFrame
+	{
+		std::unique_ptr<PlanarBitmap> Planar;	// Either this, which is also the info,
+		FrameInfo Info;							// or this and Chunky
+		ChunkyBitmap Chunky;
+	};
+	struct SoloGIF
+	{
+		std::vector<uint8_t> Data;				// Empty if the frame failed
+		FrameLogEntry LogEntry;
+	};
+	std::unique_ptr<SoloPool> Pool;
+	int Threads = 1;
+	uint32_t SoloWritten = 0;
+
+	// With a size budget, frames are kept in Recording as they come in, and
+	// FitBudget converts them when they are all here. See budget.cpp.
+	struct BudgetStep;
+	uint32_t Budget = 0;
+	bool BudgetPerSecond = false;
+	GIFOptions BudgetOptions;
+	std::vector<HeldFrame> Recording;
+	uint32_t BudgetWritten = 0;
+
+	// At effort 4, every frame is kept until the end, along with what it
+	// changed, and OptimizeFrames goes over them all again together. See
+	// optimize.cpp.
+	struct FrameChange
+	{
+		ImageDescriptor Rect;			// Where it differs from the frame before, 0x0 if nowhere
+		std::vector<uint8_t> Pixels;	// What is there now
+		uint32_t Base;					// The frame MakeFrame compressed it over
+	};
+	bool Optimizing = false;
+	std::vector<FrameChange> Changes;
+	ChunkyBitmap Canvas;			// The last frame, as it was drawn
+	uint32_t UnderFrame = 0;		// The frame Under is
+	std::vector<FrameLogEntry> HeldLog;	// Not written to Log until the frames are final
+
+	static int ExtendPalette(SharedPalette &dest, const SharedPalette &src);
+	static SharedPalette CompactPalette(ChunkyBitmap &chunky, const SharedPalette &palette,
+		int &transcolor);
+	bool UseGlobalPalette(ChunkyBitmap &chunky, const std::vector<ColorRegister> &palette, const bool used[256]) const;
+	bool RemapPrevious(const std::vector<ColorRegister> &oldpal, const std::vector<ColorRegister> &newpal,
+		const bool used[256]);
+	bool SkipFrame(const FrameInfo &info);
+	bool MeetDeadline(const FrameInfo &info);
+	void AdaptPalette(const ChunkyBitmap &chunky);
+	void ReleaseSamples();
+	void Degrade(int what);
+	void ReportDeadline() const;
+	void AddChunky(FrameInfo &info, ChunkyBitmap &&chunky, std::chrono::steady_clock::time_point starttime);
 	void WriteHeader(bool loop);
-	void MakeFrame(PlanarBitmap *bitmap, ChunkyBitmap &&chunky, const std::vector<ColorRegister> &pal, int mincodesize);
-	void MinimumArea(const ChunkyBitmap &prev, const ChunkyBitmap &cur, ImageDescriptor &imd);
-	void DetectBackgroundColor(PlanarBitmap *bitmap, const ChunkyBitmap &chunky);
-	uint8_t SelectDisposal(const PlanarBitmap *bitmap, const ImageDescriptor &imd, const ChunkyBitmap &chunky);
-	int SelectTransparentColor(const ChunkyBitmap &prev, const ChunkyBitmap &now, const ImageDescriptor &imd);
+	bool WriteScreen(GIFSink &sink, bool loop) const;
+	bool UseSoloPool() const { return SoloMode && Threads > 1 && FrameCount > 0; }
+	void QueueSolo(std::shared_ptr<SoloFrame> frame);
+	SoloGIF EncodeSolo(SoloFrame &frame, uint32_t framenum);
+	bool WriteSolo(size_t keep);
+	void Record(FrameInfo &info, ChunkyBitmap &&chunky);
+	void Prepare(const BudgetStep &step, std::vector<HeldFrame> &frames) const;
+	bool Encode(const std::vector<HeldFrame> &frames, bool decimated, int lossy, std::vector<uint8_t> &gif,
+		FrameLog *log) const;
+	bool FitBudget();
+	void MakeFrame(const FrameInfo *info, ChunkyBitmap &&chunky, const SharedPalette &pal);
+	void RecordChange(const FrameInfo *info, const ChunkyBitmap &chunky, bool restored);
+	void OptimizeFrames();
+	void LogFrame(const FrameLogEntry &entry);
+	void LogDisposal(int method);
+	void ReleaseLog();
+	void Compress(GIFFrame &frame, const FrameInfo *info, const ChunkyBitmap &prev, ChunkyBitmap &chunky,
+		bool redraw, FrameLogEntry &logentry);
+	void DetectBackgroundColor(const FrameInfo *info, const ChunkyBitmap &chunky);
+	uint8_t SelectDisposal(const FrameInfo *info, const ImageDescriptor &imd, const ChunkyBitmap &chunky);
+	int SelectTransparentColor(const ChunkyBitmap &prev, ChunkyBitmap &now, const ImageDescriptor &imd,
+		const std::vector<ColorRegister> &palette);
 	bool FinishFile();	// Finish writing the file. Returns true on success.
 	void BadWrite();
 	void CheckForIndexSpot();
@@ -263,7 +848,162 @@ private:
 };
 
 #define ID_PP20 MAKE_ID('P','P','2','0')
+#define ID_IGFS MAKE_ID('I','G','F','S')	// Frame store
+
+// Writes decoded frames to a file that can be converted again later without
+// decoding the original IFF. The format is described in framestore.cpp.
+class FrameStoreWriter : public FrameConsumer
+{
+public:
+	~FrameStoreWriter();
+
+	bool Open(const tstring &filename);
+	void AddFrame(FrameInfo &info, ChunkyBitmap &&chunky) override;
+	bool Close();	// Returns true if everything was written.
+
+private:
+	FILE *File = nullptr;
+	tstring Filename;
+	std::vector<uint64_t> Index;
+	uint64_t Pos = 0;
+	bool Failed = false;
+
+	bool Write(const void *data, size_t len);
+};
+
+// Writes frames as uncompressed video, for encoders that want something other
+// than a GIF. Frames are scaled, aspect corrected, and clipped the same way
+// GIFWriter does it, but are never quantized. Raw video has no timestamps, so
+// the output runs at the ANIM's frame rate, and each frame is repeated for as
+// many ticks as it is displayed.
+class RawWriter : public FrameConsumer
+{
+public:
+	enum Format
+	{
+		RGB24,			// 3 bytes per pixel
+		RGBA,			// 4 bytes per pixel; the transparent color has alpha 0
+		Y4M				// YUV4MPEG2, 4:4:4, BT.601 limited range
+	};
+
+	RawWriter(GIFSink &sink, tstring filename, const GIFOptions &options, Format format);
+	~RawWriter();
+
+	void AddFrame(PlanarBitmap *bitmap) override;
+	void AddFrame(FrameInfo &info, ChunkyBitmap &&chunky) override;
+	bool IsQuiet() const override { return Quiet; }
+	bool IsDone() const override { return Failed || Clips.empty(); }
+	uint32_t GetFramesWritten() const { return FramesWritten; }
+
+	// Writes the frames still queued. Returns true if everything was written.
+	bool Finish();
 
-void LoadFile(_TCHAR *filename, std::istream &file, GIFWriter &writer);
+	// Parses "rgb", "rgba", or "y4m".
+	static bool ParseFormat(const _TCHAR *name, Format &format);
+
+private:
+	struct Pending
+	{
+		std::vector<uint8_t> Data;	// One frame, already in the output format
+		int Repeat = 1;
+	};
+
+	// Like GIFFrameQueue, this only needs to be larger than the interleave.
+	enum { MAX_QUEUE_SIZE = 4 };
+
+	GIFSink &Sink;
+	tstring Filename;
+	Format OutFormat;
+	FramePrep Prep;
+	bool ForcedFrameRate;
+	bool Quiet;
+	bool SinkOpen = false;
+	bool Failed = false;
+	bool Finished = false;
+	int FrameRate = 50;
+	int Width = 0, Height = 0;
+	uint32_t FrameCount = 0;
+	uint32_t FramesWritten = 0;
+	size_t FinalFramesToDrop = 0;
+	std::vector<std::pair<unsigned, unsigned>> Clips;
+	std::deque<Pending> Queue;
+
+	bool SkipFrame(const FrameInfo &info);
+	void AddChunky(FrameInfo &info, ChunkyBitmap &&chunky);
+	void Convert(const FrameInfo &info, const ChunkyBitmap &chunky, std::vector<uint8_t> &out) const;
+	bool Shift();
+};
+
+// readahead is the number of ANIM frames to read ahead of the one being
+// decoded, on another thread. 0 reads them as they are needed.
+bool LoadFile(_TCHAR *filename, std::istream &file, FrameConsumer &writer, int readahead = 0);
+bool LoadMemory(const void *data, size_t len, FrameConsumer &writer, const _TCHAR *name = _T("(memory)"));
+bool LoadFrameStore(const _TCHAR *filename, std::istream &file, FrameConsumer &writer);
+bool ReadIFF(_TCHAR *filename, std::istream &file, std::vector<uint8_t> &data);
+unsigned BusiestFrame(const std::vector<uint32_t> &deltasizes, size_t dropframes);
+bool UnpackIfPowerPacked(std::vector<uint8_t> &data);
+void SortClips(std::vector<std::pair<unsigned, unsigned>> &clips);
+
+// Converts an IFF file that is already in memory. These do not touch any
+// global state, so they can be used from several threads at once. The
+// first puts the GIF in out and ignores options.Solo. The second calls
+// callback with each GIF as it is finished: Once, or in solo mode, once
+// per frame. Both return false if the input could not be converted or the
+// callback asked to stop.
+bool ConvertToGIF(const void *data, size_t len, const GIFOptions &options, std::vector<uint8_t> &out);
+bool ConvertToGIF(const void *data, size_t len, const GIFOptions &options, const MemorySink::Callback &callback);
 std::unique_ptr<uint8_t[]> LoadPowerPackerFile(std::istream &file, size_t filesize, unsigned &unpackedsize);
+std::unique_ptr<uint8_t[]> UnpackPowerPacker(const uint8_t *packed, size_t packedsize, unsigned &unpackedsize);
 void rotate8x8(unsigned char *src, int srcstep, unsigned char *dst, int dststep);
+
+// The individual stages of the pipeline, for the benchmarks.
+void UnpackBody(PlanarBitmap *planes, BitmapHeader &header, uint32_t len, const void *data);
+void Delta5(PlanarBitmap *bitmap, AnimHeader *head, uint32_t len, const void *delta);
+void Delta7Short(PlanarBitmap *bitmap, AnimHeader *head, uint32_t len, const void *delta);
+void Delta7Long(PlanarBitmap *bitmap, AnimHeader *head, uint32_t len, const void *delta);
+void Delta8Short(PlanarBitmap *bitmap, AnimHeader *head, uint32_t len, const void *delta);
+void Delta8Long(PlanarBitmap *bitmap, AnimHeader *head, uint32_t len, const void *delta);
+void LZWCompress(std::vector<uint8_t> &vec, const ImageDescriptor &imd, const ChunkyBitmap &cbprev,
+	const ChunkyBitmap &chunky, uint8_t mincodesize, int trans, const LossyLZW *lossy = nullptr, bool either = false);
+int MinCodeSize(const ChunkyBitmap &chunky, const ImageDescriptor &imd, int trans);
+const SharedPalette *DumbPalette();
+
+// Writing ILBMs and ANIMs, for synthesizing test input.
+void AddILBMHeader(IFFWriter &iff, const PlanarBitmap &planar, Compression compression);
+void PackBody(const PlanarBitmap &planar, Compression compression, std::vector<uint8_t> &body);
+std::vector<uint8_t> MakeANHD(uint8_t operation, uint32_t bits, uint32_t reltime, uint8_t interleave);
+bool MakeDelta(const PlanarBitmap &prev, const PlanarBitmap &cur, int op, bool longdata, std::vector<uint8_t> &delta);
+std::vector<uint8_t> PowerPack(const uint8_t *data, size_t len);
+
+// A directory of converted GIFs, named after a hash of the input and of every
+// option that changes the output, so that converting the same file the same
+// way again is just a copy. Entries are written atomically, so any number of
+// processes can share one. Solo mode is not cached, since it makes more than
+// one GIF.
+class GIFCache
+{
+public:
+	GIFCache(const tstring &dir) : Dir(dir) {}
+
+	// The input must already be unpacked, if it was PowerPacked (see ReadIFF).
+	std::string Key(const void *data, size_t len, const GIFOptions &options) const;
+	bool Fetch(const std::string &key, std::vector<uint8_t> &gif) const;
+	void Store(const std::string &key, const std::vector<uint8_t> &gif) const;
+
+	// Does all of the above. frames is set to the number of frames in the GIF,
+	// and degraded to what a deadline made the conversion give up, if anything.
+	// A GIF that gave up anything is not stored.
+	bool Convert(const void *data, size_t len, const GIFOptions &options, const _TCHAR *name,
+		std::vector<uint8_t> &gif, uint32_t &frames, std::string *degraded = nullptr) const;
+
+private:
+	tstring Dir;
+};
+
+bool WriteGIF(const tstring &filename, const std::vector<uint8_t> &gif);
+uint32_t CountGIFFrames(const std::vector<uint8_t> &gif, uint32_t *centisecs = nullptr);
+
+// The command line front end. ParseGIFOption returns 1 if it set an option,
+// 0 if opt is not one of GIF_OPTIONS, or -1 if arg is bad.
+int ParseGIFOption(int opt, const _TCHAR *arg, GIFOptions &options);
+int RunServer(const _TCHAR *socketpath, int threads, const GIFOptions &defaults, const _TCHAR *cachedir);
@@ -18,8 +18,8 @@
 
 
 #include <algorithm>
-#include <filesystem>
 #include <iostream>
+#include <thread>
 #include <assert.h>
 #include <string.h>
 #include <malloc.h>
@@ -37,7 +37,7 @@ IFFChunk::IFFChunk(std::istream &file, uint32_t id, uint32_t len)
 
 	if (!file.read(reinterpret_cast<char *>(ChunkData), len))
 	{
-		fprintf(stderr, "Only read %llu of %u bytes in chunk %4s\n", file.gcount(), len, (char *)&ChunkID);
+		fprintf(stderr, "Only read %llu of %u bytes in chunk %4s\n", (unsigned long long)file.gcount(), len, (char *)&ChunkID);
 		ChunkID = 0;
 	}
 	if (len & 1)
@@ -192,7 +192,7 @@ void MakeEHBPalette(std::vector<ColorRegister> &pal)
 	{ // What palette?
 		return;
 	}
-	pal.reserve(64);
+	pal.resize(64);
 	for (int i = 0; i < 32; ++i)
 	{
 		pal[32 + i].red = pal[i].red >> 1;
@@ -512,7 +512,7 @@ void Delta8Long(PlanarBitmap *bitmap, AnimHeader *head, uint32_t len, const void
 	const uint32_t *planes = (const uint32_t *)delta;
 	int numcols = (bitmap->Width + 31) / 32;
 	int pitch = bitmap->Pitch;
-	bool lastisshort = (bitmap->Width & 16) != 0;
+	bool lastisshort = (bitmap->Pitch & 2) != 0;
 	const uint16_t xormask = (head->bits & ANIM_XOR) ? 0xFF : 0x00;
 	for (int p = 0; p < bitmap->NumPlanes; ++p)
 	{
@@ -574,6 +574,8 @@ PlanarBitmap *ApplyDelta(PlanarBitmap *bitmap, AnimHeader *head, uint32_t len, c
 {
 	bitmap->Interleave = 2 - (head->interleave & 1);
 	bitmap->Delay = head->reltime;
+	bitmap->DeltaOp = head->operation;
+	bitmap->DeltaSize = len;
 	switch (head->operation)
 	{
 	case 5:
@@ -609,7 +611,7 @@ PlanarBitmap *ApplyDelta(PlanarBitmap *bitmap, AnimHeader *head, uint32_t len, c
 	return bitmap;
 }
 
-PlanarBitmap *LoadILBM(FORMReader &form, PlanarBitmap *history[2])
+PlanarBitmap *LoadILBM(FORMReader &form, PlanarBitmap *history[2], bool quiet)
 {
 	PlanarBitmap *planes = nullptr;
 	BitmapHeader header;
@@ -699,7 +701,7 @@ PlanarBitmap *LoadILBM(FORMReader &form, PlanarBitmap *history[2])
 			break;
 
 		case ID_ANNO:
-			printf("Annotation: %.*s\n", chunk->GetLen(), (char *)chunk->GetData());
+			if (!quiet) printf("Annotation: %.*s\n", chunk->GetLen(), (char *)chunk->GetData());
 			break;
 
 		case ID_DPAN:
@@ -714,7 +716,7 @@ PlanarBitmap *LoadILBM(FORMReader &form, PlanarBitmap *history[2])
 			// only be considered a hint. You should still read as many
 			// frames as you can.
 			numframes = BigShort(dpan->nframes);
-			printf("%u frames @ %u fps\n", numframes, dpan->speed);
+			if (!quiet) printf("%u frames @ %u fps\n", numframes, dpan->speed);
 			break;
 		}
 
@@ -731,6 +733,8 @@ PlanarBitmap *LoadILBM(FORMReader &form, PlanarBitmap *history[2])
 				return NULL;
 			}
 			UnpackBody(planes, header, chunk->GetLen(), chunk->GetData());
+			planes->DeltaOp = 0;
+			planes->DeltaSize = chunk->GetLen();
 			break;
 
 		case ID_DLTA:
@@ -793,17 +797,136 @@ PlanarBitmap *LoadILBM(FORMReader &form, PlanarBitmap *history[2])
 	return NULL;
 }
 
-static void LoadANIM(FORMReader &form, GIFWriter &writer)
+// This class from https://gist.github.com/mlfarrell/28ea0e7b10756042956b579781ac0dd8
+struct membuf : std::streambuf
+{
+	membuf(char *begin, char *end) : begin(begin), end(end)
+	{
+		this->setg(begin, begin, end);
+	}
+
+	virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which = std::ios_base::in) override
+	{
+		if (dir == std::ios_base::cur)
+			gbump((int)off);
+		else if (dir == std::ios_base::end)
+			setg(begin, end + off, end);
+		else if (dir == std::ios_base::beg)
+			setg(begin, begin + off, end);
+
+		return gptr() - eback();
+	}
+
+	virtual pos_type seekpos(std::streampos pos, std::ios_base::openmode mode) override
+	{
+		return seekoff(pos - pos_type(off_type(0)), std::ios_base::beg, mode);
+	}
+
+	char *begin, *end;
+};
+
+// Reads the FORMs of an ANIM on another thread, up to some number of them
+// ahead of the one being decoded, so decoding doesn't wait for the file to be
+// read. Once this has been created, the file belongs to the reading thread
+// until this is destroyed.
+class FORMPrefetcher
+{
+public:
+	FORMPrefetcher(_TCHAR *filename, std::istream &file, uint32_t formlen, int ahead)
+		: Filename(filename), Forms(ahead)
+	{
+		Reader = std::thread([this, &file, formlen] { Read(file, formlen); });
+	}
+
+	~FORMPrefetcher()
+	{
+		Forms.Stop();
+		Reader.join();
+	}
+
+	// Works like NextChunk(NULL, form) on the ANIM's FORMReader.
+	bool NextForm(FORMReader **form)
+	{
+		*form = NULL;
+		if (!Forms.Pop(Current))
+		{
+			return false;
+		}
+		char *data = (char *)Current.Data.data();
+		Buffer = std::make_unique<membuf>(data, data + Current.Data.size());
+		Stream = std::make_unique<std::istream>(Buffer.get());
+		*form = new FORMReader(Filename, *Stream, Current.Len);
+		return true;
+	}
+
+private:
+	struct Form
+	{
+		uint32_t Len = 0;				// From the FORM's header
+		std::vector<uint8_t> Data;		// Includes the pad byte; shorter if the file is cut off
+	};
+
+	_TCHAR *Filename;
+	WorkQueue<Form> Forms;
+	Form Current;
+	std::unique_ptr<membuf> Buffer;
+	std::unique_ptr<std::istream> Stream;
+	std::thread Reader;
+
+	// Chunks that aren't FORMs are skipped, just like NextChunk would.
+	void Read(std::istream &file, uint32_t formlen)
+	{
+		// Don't trust a FORM's length to be any bigger than the file, if
+		// there is any way to know how big the file is.
+		uint64_t left = UINT64_MAX;
+		auto start = file.tellg();
+		if (start != std::streampos(-1))
+		{
+			file.seekg(0, file.end);
+			left = (uint64_t)(file.tellg() - start);
+			file.seekg(start);
+		}
+
+		uint32_t pos = 4;
+		uint32_t head[2];	// ID, Len
+		while (pos < formlen && file.read(reinterpret_cast<char *>(head), 8))
+		{
+			uint32_t len = BigLong(head[1]);
+			uint32_t padded = len + (len & 1);
+			pos += 8 + padded;
+			left -= std::min<uint64_t>(left, 8);
+			if (head[0] != ID_FORM)
+			{
+				file.seekg(padded, std::ios_base::cur);
+				left -= std::min<uint64_t>(left, padded);
+				continue;
+			}
+			Form form;
+			form.Len = len;
+			form.Data.resize((size_t)std::min<uint64_t>(left, padded));
+			file.read(reinterpret_cast<char *>(form.Data.data()), form.Data.size());
+			form.Data.resize((size_t)file.gcount());
+			left -= form.Data.size();
+			if (!Forms.Push(std::move(form)) || !file)
+			{
+				break;
+			}
+		}
+		Forms.Stop();
+	}
+};
+
+static void LoadANIM(FORMReader &form, FrameConsumer &writer, FORMPrefetcher *prefetch)
 {
 	FORMReader *chunk;
 	PlanarBitmap *history[2] = { NULL, NULL };
 
-	while (form.NextChunk(NULL, &chunk))
+	while (!writer.IsDone() && (prefetch != NULL ? prefetch->NextForm(&chunk) : form.NextChunk(NULL, &chunk)))
 	{
 		if (chunk->GetID() == ID_ILBM)
 		{
 			PlanarBitmap *planar;
-			while (NULL != (planar = LoadILBM(*chunk, history)))
+			while (!writer.IsDone() && NULL != (planar = LoadILBM(*chunk, history, writer.IsQuiet())))
 			{
 				writer.AddFrame(planar);
 				if (history[0] == NULL)
@@ -835,77 +958,192 @@ static void LoadANIM(FORMReader &form, GIFWriter &writer)
 	if (history[1] != NULL) delete history[1];
 }
 
-// This class from https://gist.github.com/mlfarrell/28ea0e7b10756042956b579781ac0dd8
-struct membuf : std::streambuf
+// Picks the frame with the biggest delta, ignoring the first frame, which is
+// a complete image, and the final frames that repeat the first ones, unless
+// there is nothing else. Frames are numbered from 1.
+unsigned BusiestFrame(const std::vector<uint32_t> &deltasizes, size_t dropframes)
 {
-	membuf(char *begin, char *end) : begin(begin), end(end)
+	unsigned best = 1;
+	for (size_t i = 1; i + dropframes < deltasizes.size(); ++i)
 	{
-		this->setg(begin, begin, end);
+		if (best == 1 || deltasizes[i] > deltasizes[best - 1])
+		{
+			best = unsigned(i + 1);
+		}
 	}
+	return best;
+}
 
-	virtual pos_type seekoff(off_type off, std::ios_base::seekdir dir, std::ios_base::openmode which = std::ios_base::in) override
-	{
-		if (dir == std::ios_base::cur)
-			gbump((int)off);
-		else if (dir == std::ios_base::end)
-			setg(begin, end + off, end);
-		else if (dir == std::ios_base::beg)
-			setg(begin, begin + off, end);
-
-		return gptr() - eback();
-	}
+// Finds the busiest frame of an ANIM by reading only the chunk headers (and
+// ANHDs) of each frame, skipping over the data. The file must be positioned
+// just after the ANIM's type. Returns 0 if there are no frames.
+static unsigned ScanANIM(std::istream &file, uint32_t formlen)
+{
+	std::vector<uint32_t> sizes;
+	size_t dropframes = 0;
+	uint32_t pos = 4;
+	uint32_t head[2];	// ID, Len
 
-	virtual pos_type seekpos(std::streampos pos, std::ios_base::openmode mode) override
+	while (pos + 8 <= formlen && file.read(reinterpret_cast<char *>(head), 8))
 	{
-		return seekoff(pos - pos_type(off_type(0)), std::ios_base::beg, mode);
+		uint32_t len = BigLong(head[1]);
+		uint32_t padded = len + (len & 1);
+		pos += 8 + padded;
+		if (head[0] != ID_FORM || len < 4)
+		{
+			file.seekg(padded, std::ios_base::cur);
+			continue;
+		}
+		uint32_t size = 0;
+		uint32_t subpos = 4;
+		file.seekg(4, std::ios_base::cur);
+		while (subpos + 8 <= len && file.read(reinterpret_cast<char *>(head), 8))
+		{
+			uint32_t sublen = BigLong(head[1]);
+			uint32_t subpadded = sublen + (sublen & 1);
+			subpos += 8 + subpadded;
+			if (head[0] == ID_BODY || head[0] == ID_DLTA)
+			{
+				size = sublen;
+			}
+			else if (head[0] == ID_ANHD && sublen >= 19)
+			{
+				// Interleave is the 19th byte.
+				char interleave;
+				file.seekg(18, std::ios_base::cur);
+				file.get(interleave);
+				dropframes = 2 - (interleave & 1);
+				subpadded -= 19;
+			}
+			file.seekg(subpadded, std::ios_base::cur);
+		}
+		if (!file)
+		{
+			break;
+		}
+		// Skip anything after the last chunk, including the FORM's padding.
+		file.seekg(padded - std::min(subpos, padded), std::ios_base::cur);
+		sizes.push_back(size);
 	}
+	return sizes.empty() ? 0 : BusiestFrame(sizes, dropframes);
+}
 
-	char *begin, *end;
-};
-
-
-void LoadFile(_TCHAR *filename, std::istream &file, GIFWriter &writer)
+// Returns false if the file could not be read at all.
+bool LoadFile(_TCHAR *filename, std::istream &file, FrameConsumer &writer, int readahead)
 {
 	uint32_t id = 0;
 
-	if (file.read(reinterpret_cast<char *>(&id), 4).good())
+	if (!file.read(reinterpret_cast<char *>(&id), 4).good())
+	{
+		_ftprintf(stderr, _T("%s is too short\n"), filename);
+		return false;
+	}
+	if (id == ID_PP20)
 	{
-		if (id == ID_PP20)
+		// The stream knows how big it is, so this works for any stream,
+		// not just ones that came from a file.
+		file.seekg(0, file.end);
+		size_t filesize = (size_t)file.tellg();
+		unsigned unpackedsize;
+		std::unique_ptr<uint8_t[]> unpacked = LoadPowerPackerFile(file, filesize, unpackedsize);
+		if (unpacked == nullptr)
 		{
-			std::filesystem::path p(filename);
-			unsigned unpackedsize;
-			std::unique_ptr<uint8_t[]> unpacked =
-				LoadPowerPackerFile(file, (size_t)std::filesystem::file_size(p), unpackedsize);
-
-			membuf sbuf((char *)unpacked.get(), (char *)unpacked.get() + unpackedsize);
-			std::istream unppfile(&sbuf);
-			LoadFile(filename, unppfile, writer);
-			return;
+			return false;
 		}
-		if (id != ID_FORM)
+		membuf sbuf((char *)unpacked.get(), (char *)unpacked.get() + unpackedsize);
+		std::istream unppfile(&sbuf);
+		// It's all in memory now, so there is nothing to read ahead.
+		return LoadFile(filename, unppfile, writer);
+	}
+	if (id == ID_IGFS)
+	{
+		file.seekg(0, file.beg);
+		return LoadFrameStore(filename, file, writer);
+	}
+	if (id != ID_FORM)
+	{
+		_ftprintf(stderr, _T("%s is not an IFF FORM\n"), filename);
+		return false;
+	}
+	FORMReader iff(filename, file);
+	id = iff.GetID();
+	if (id == ID_ILBM)
+	{
+		PlanarBitmap *planar = LoadILBM(iff, NULL, writer.IsQuiet());
+		if (planar == NULL)
 		{
-			_ftprintf(stderr, _T("%s is not an IFF FORM\n"), filename);
-			return;
+			return false;
 		}
-		FORMReader iff(filename, file);
-		uint32_t id = iff.GetID();
-		if (id == ID_ILBM)
+		planar->NumFrames = 1;
+		writer.AddFrame(planar);
+		delete planar;
+	}
+	else if (id == ID_ANIM)
+	{
+		if (writer.WantsBusiestFrame())
 		{
-			PlanarBitmap *planar = LoadILBM(iff, NULL);
-			if (planar != NULL)
+			auto start = file.tellg();
+			unsigned frame = ScanANIM(file, iff.GetLen());
+			file.clear();
+			file.seekg(start);
+			if (frame != 0)
 			{
-				writer.AddFrame(planar);
-				delete planar;
+				writer.SelectFrame(frame);
 			}
 		}
-		else if (id == ID_ANIM)
+		std::unique_ptr<FORMPrefetcher> prefetch;
+		if (readahead > 0)
 		{
-			LoadANIM(iff, writer);
+			prefetch = std::make_unique<FORMPrefetcher>(filename, file, iff.GetLen(), readahead);
 		}
-		else
+		LoadANIM(iff, writer, prefetch.get());
+	}
+	else
+	{
+		fprintf(stderr, "Unsupported IFF type %.4s\n", (char *)&id);
+		return false;
+	}
+	return true;
+}
+
+// Like LoadFile, but for a file that is already in memory.
+bool LoadMemory(const void *data, size_t len, FrameConsumer &writer, const _TCHAR *name)
+{
+	tstring filename = name;
+	// membuf never writes, so casting away the const is safe.
+	membuf sbuf((char *)data, (char *)data + len);
+	std::istream file(&sbuf);
+	return LoadFile(&filename[0], file, writer);
+}
+
+// Unpacks a file in memory if it was PowerPacked, so that identical files are
+// identical in memory regardless of how they were stored.
+bool UnpackIfPowerPacked(std::vector<uint8_t> &data)
+{
+	while (data.size() >= 4 && *(uint32_t *)&data[0] == ID_PP20)
+	{
+		unsigned unpackedsize;
+		std::unique_ptr<uint8_t[]> unpacked = UnpackPowerPacker(data.data(), data.size(), unpackedsize);
+		if (unpacked == nullptr)
 		{
-			fprintf(stderr, "Unsupported IFF type %4s", (char *)&id);
-			return;
+			return false;
 		}
+		data.assign(unpacked.get(), unpacked.get() + unpackedsize);
+	}
+	return true;
+}
+
+// Reads an entire file into memory and unpacks it.
+bool ReadIFF(_TCHAR *filename, std::istream &file, std::vector<uint8_t> &data)
+{
+	file.seekg(0, file.end);
+	size_t filesize = (size_t)file.tellg();
+	file.seekg(0, file.beg);
+	data.resize(filesize);
+	if (!file.read((char *)data.data(), filesize))
+	{
+		_ftprintf(stderr, _T("Could not read %s\n"), filename);
+		return false;
 	}
+	return UnpackIfPowerPacked(data);
 }
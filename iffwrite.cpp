@@ -0,0 +1,308 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// The writing half of iffread.cpp. iff2gif itself never writes IFF files,
+// but this lets us synthesize inputs of any size and type for benchmarking
+// and testing instead of relying on a collection of real Amiga files.
+
+#include <algorithm>
+#include <assert.h>
+#include <string.h>
+
+#include "iff2gif.h"
+
+static void PutBig(std::vector<uint8_t> &out, uint32_t val, int size)
+{
+	for (int i = size - 1; i >= 0; --i)
+	{
+		out.push_back(uint8_t(val >> (i * 8)));
+	}
+}
+
+static void SetBig(std::vector<uint8_t> &out, size_t pos, uint32_t val)
+{
+	out[pos] = uint8_t(val >> 24);
+	out[pos + 1] = uint8_t(val >> 16);
+	out[pos + 2] = uint8_t(val >> 8);
+	out[pos + 3] = uint8_t(val);
+}
+
+void IFFWriter::PushForm(uint32_t type)
+{
+	Data.insert(Data.end(), (const uint8_t *)"FORM", (const uint8_t *)"FORM" + 4);
+	Forms.push_back(Data.size());
+	PutBig(Data, 0, 4);		// Filled in by PopForm
+	Data.insert(Data.end(), (const uint8_t *)&type, (const uint8_t *)&type + 4);
+}
+
+void IFFWriter::PopForm()
+{
+	assert(!Forms.empty());
+	size_t lenpos = Forms.back();
+	Forms.pop_back();
+	SetBig(Data, lenpos, uint32_t(Data.size() - lenpos - 4));
+}
+
+void IFFWriter::AddChunk(uint32_t id, const void *data, uint32_t len)
+{
+	Data.insert(Data.end(), (const uint8_t *)&id, (const uint8_t *)&id + 4);
+	PutBig(Data, len, 4);
+	Data.insert(Data.end(), (const uint8_t *)data, (const uint8_t *)data + len);
+	if (len & 1)
+	{ // Chunks are padded to an even length.
+		Data.push_back(0);
+	}
+}
+
+// Writes the BMHD, CMAP, and CAMG chunks that describe planar.
+void AddILBMHeader(IFFWriter &iff, const PlanarBitmap &planar, Compression compression)
+{
+	std::vector<uint8_t> bmhd;
+	PutBig(bmhd, planar.Width, 2);
+	PutBig(bmhd, planar.Height, 2);
+	PutBig(bmhd, 0, 2);		// x
+	PutBig(bmhd, 0, 2);		// y
+	bmhd.push_back(uint8_t(planar.NumPlanes));
+	bmhd.push_back(planar.TransparentColor >= 0 ? mskHasTransparentColor : mskNone);
+	bmhd.push_back(compression);
+	bmhd.push_back(0);		// pad1
+	PutBig(bmhd, std::max(planar.TransparentColor, 0), 2);
+	bmhd.push_back(10);		// xAspect
+	bmhd.push_back(11);		// yAspect
+	PutBig(bmhd, planar.Width, 2);
+	PutBig(bmhd, planar.Height, 2);
+	iff.AddChunk(ID_BMHD, bmhd);
+
+	if (!planar.Palette.empty())
+	{
+		iff.AddChunk(ID_CMAP, &planar.Palette[0], uint32_t(planar.Palette.size() * 3));
+	}
+	if (planar.ModeID != 0)
+	{
+		std::vector<uint8_t> camg;
+		PutBig(camg, planar.ModeID, 4);
+		iff.AddChunk(ID_CAMG, camg);
+	}
+}
+
+// Compresses one row with ByteRun1: runs of three or more identical bytes
+// are stored as repeats, and everything else as literals.
+static void PackRow(std::vector<uint8_t> &out, const uint8_t *row, int len)
+{
+	for (int i = 0; i < len;)
+	{
+		int run = 1;
+		while (i + run < len && run < 128 && row[i + run] == row[i])
+			run++;
+		if (run >= 3)
+		{
+			out.push_back(uint8_t(1 - run));
+			out.push_back(row[i]);
+			i += run;
+			continue;
+		}
+		int lit = 0;
+		while (i + lit < len && lit < 128 &&
+			!(i + lit + 2 < len && row[i + lit] == row[i + lit + 1] && row[i + lit] == row[i + lit + 2]))
+			lit++;
+		out.push_back(uint8_t(lit - 1));
+		out.insert(out.end(), row + i, row + i + lit);
+		i += lit;
+	}
+}
+
+// The reverse of UnpackBody.
+void PackBody(const PlanarBitmap &planar, Compression compression, std::vector<uint8_t> &body)
+{
+	for (int y = 0; y < planar.Height; ++y)
+	{
+		for (int p = 0; p < planar.NumPlanes; ++p)
+		{
+			const uint8_t *row = planar.Planes[p] + y * planar.Pitch;
+			if (compression == cmpByteRun1)
+				PackRow(body, row, planar.Pitch);
+			else
+				body.insert(body.end(), row, row + planar.Pitch);
+		}
+	}
+}
+
+std::vector<uint8_t> MakeANHD(uint8_t operation, uint32_t bits, uint32_t reltime, uint8_t interleave)
+{
+	std::vector<uint8_t> anhd;
+	anhd.push_back(operation);
+	anhd.push_back(0);		// mask
+	PutBig(anhd, 0, 2);		// w
+	PutBig(anhd, 0, 2);		// h
+	PutBig(anhd, 0, 2);		// x
+	PutBig(anhd, 0, 2);		// y
+	PutBig(anhd, 0, 4);		// abstime
+	PutBig(anhd, reltime, 4);
+	anhd.push_back(interleave);
+	anhd.push_back(0);		// pad0
+	PutBig(anhd, bits, 4);
+	anhd.resize(40, 0);		// pad[16]
+	return anhd;
+}
+
+// One operation in a vertical delta column. Ops 5, 7, and 8 only differ in
+// how these are stored.
+struct ColumnOp
+{
+	enum { Skip, Same, Uniq } Type;
+	int Count;
+	int Row;	// First row of data for Same and Uniq
+};
+
+static uint32_t GetUnit(const uint8_t *p, int unit)
+{
+	uint32_t val = 0;
+	memcpy(&val, p, unit);
+	return val;
+}
+
+// Finds the ops to turn one column of prev into the same column of cur.
+// Skips are only used for runs of at least two unchanged rows, and repeats
+// for runs of at least three identical rows.
+static void EncodeColumn(const uint8_t *prev, const uint8_t *cur, int pitch, int height, int unit,
+	int maxcount, std::vector<ColumnOp> &ops)
+{
+	auto changed = [&](int y) { return memcmp(prev + y * pitch, cur + y * pitch, unit) != 0; };
+	auto same = [&](int a, int b) { return GetUnit(cur + a * pitch, unit) == GetUnit(cur + b * pitch, unit); };
+
+	ops.clear();
+	for (int y = 0; y < height;)
+	{
+		int s = y;
+		while (s < height && !changed(s))
+			s++;
+		if (s == height)
+		{ // Nothing else changes in this column.
+			break;
+		}
+		for (; y < s; y += std::min(s - y, maxcount))
+		{
+			ops.push_back({ ColumnOp::Skip, std::min(s - y, maxcount), y });
+		}
+		int run = 1;
+		while (y + run < height && run < maxcount && same(y, y + run))
+			run++;
+		if (run >= 3)
+		{
+			ops.push_back({ ColumnOp::Same, run, y });
+			y += run;
+			continue;
+		}
+		int u = y;
+		while (u < height && u - y < maxcount)
+		{
+			if (u > y && u + 1 < height && !changed(u) && !changed(u + 1))
+				break;
+			if (u > y && u + 2 < height && same(u, u + 1) && same(u, u + 2))
+				break;
+			u++;
+		}
+		ops.push_back({ ColumnOp::Uniq, u - y, y });
+		y = u;
+	}
+}
+
+// Builds a DLTA chunk that turns prev into cur using vertical delta
+// compression. Op 5 works on bytes and op 7 and 8 on shorts or longs. Op 7
+// keeps the ops and the data in separate lists, while ops 5 and 8 interleave
+// them. All data is stored in set mode rather than XOR mode, and it is stored
+// in memory order, since the decoders copy it without swapping.
+bool MakeDelta(const PlanarBitmap &prev, const PlanarBitmap &cur, int op, bool longdata, std::vector<uint8_t> &delta)
+{
+	if ((op != 5 && op != 7 && op != 8) || cur.NumPlanes > 8 ||
+		prev.Width != cur.Width || prev.Height != cur.Height || prev.NumPlanes != cur.NumPlanes)
+	{
+		return false;
+	}
+	const int unit = op == 5 ? 1 : longdata ? 4 : 2;
+	// Match the decoders' idea of how many columns there are. For op 8, a
+	// final column that is only 16 pixels wide uses shorts.
+	const int numcols = op == 5 ? (cur.Width + 7) / 8 :
+		(op == 7 && longdata) ? (cur.Width + 15) / 32 : (cur.Width + unit * 8 - 1) / (unit * 8);
+	const bool lastisshort = op == 8 && longdata && (cur.Pitch & 2);
+	std::vector<ColumnOp> colops;
+
+	delta.assign(16 * 4, 0);
+	for (int p = 0; p < cur.NumPlanes; ++p)
+	{
+		std::vector<uint8_t> ops, data;
+		bool planechanged = false;
+		for (int x = 0; x < numcols; ++x)
+		{
+			const int u = (lastisshort && x == numcols - 1) ? 2 : unit;
+			const int opsize = op == 8 ? u : 1;
+			const uint32_t highbit = 1u << (opsize * 8 - 1);
+			const int maxcount = (int)std::min<uint32_t>(highbit - 1, opsize == 1 ? 127 : 0xFFFF);
+			const uint8_t *prevcol = prev.Planes[p] + x * unit;
+			const uint8_t *curcol = cur.Planes[p] + x * unit;
+			EncodeColumn(prevcol, curcol, cur.Pitch, cur.Height, u, maxcount, colops);
+			if (opsize == 1 && colops.size() > 255)
+			{ // Too many ops for the count byte, so just store the entire column.
+				colops.clear();
+				for (int y = 0; y < cur.Height; y += maxcount)
+				{
+					colops.push_back({ ColumnOp::Uniq, std::min(maxcount, cur.Height - y), y });
+				}
+			}
+			planechanged |= !colops.empty();
+			std::vector<uint8_t> &dest = op == 7 ? data : ops;
+			PutBig(ops, (uint32_t)colops.size(), opsize);
+			for (const ColumnOp &cop : colops)
+			{
+				const uint8_t *src = curcol + cop.Row * cur.Pitch;
+				switch (cop.Type)
+				{
+				case ColumnOp::Skip:
+					PutBig(ops, cop.Count, opsize);
+					break;
+				case ColumnOp::Same:
+					PutBig(ops, 0, opsize);
+					PutBig(ops, cop.Count, opsize);
+					dest.insert(dest.end(), src, src + u);
+					break;
+				case ColumnOp::Uniq:
+					PutBig(ops, highbit | cop.Count, opsize);
+					for (int y = 0; y < cop.Count; ++y, src += cur.Pitch)
+					{
+						dest.insert(dest.end(), src, src + u);
+					}
+					break;
+				}
+			}
+		}
+		if (!planechanged)
+		{ // A null pointer means nothing changed in this plane.
+			continue;
+		}
+		if (op == 7)
+		{
+			delta.resize((delta.size() + 3) & ~3);
+			SetBig(delta, (8 + p) * 4, (uint32_t)delta.size());
+			delta.insert(delta.end(), data.begin(), data.end());
+		}
+		delta.resize((delta.size() + 3) & ~3);
+		SetBig(delta, p * 4, (uint32_t)delta.size());
+		delta.insert(delta.end(), ops.begin(), ops.end());
+	}
+	return true;
+}
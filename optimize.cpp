@@ -0,0 +1,357 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Whole-animation optimization: MakeFrame decides how to draw each frame
+// knowing only the frames before it. At effort 4, the frames are also kept
+// until the end, along with a record of the pixels each one changed, and then
+// gone over again together:
+//
+// - Frames that change nothing are dropped, and the frame before them is
+//   shown for longer.
+// - Every frame can be drawn over either the frame before it, or what was
+//   under that frame, by disposing of it with "restore previous". Which of
+//   those is smaller for one frame depends on the choices made for the frames
+//   before it, so a few of the best ways of getting to each frame are kept,
+//   and the way to the last frame that makes for the smallest GIF wins.
+//
+// A frame is only compressed again if it is drawn over something other than
+// what MakeFrame drew it over, and its transparent color is picked again for
+// that. Frames that really are transparent are left to MakeFrame, since they
+// may need to be disposed of to the background.
+//
+// The frame log is held back until then too, so that it describes the frames
+// as they are written.
+
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <stdint.h>
+#include "iff2gif.h"
+
+// How many ways of getting to each frame are kept.
+static const size_t BEAM_WIDTH = 4;
+
+namespace
+{
+	struct Way
+	{
+		uint32_t Base;		// The kept frame this one is drawn over
+		uint64_t Size;		// Of every frame up to and including this one
+		size_t From;		// The way to the frame before
+		std::unique_ptr<GIFFrame> Frame;	// Compressed again, or null to keep MakeFrame's
+		FrameLogEntry Log;					// For Frame
+	};
+}
+
+// Remembers the pixels that changed since the last frame, once the frame is
+// compressed, since the compressor may have merged colors.
+void GIFWriter::RecordChange(const FrameInfo *info, const ChunkyBitmap &chunky, bool restored)
+{
+	uint32_t frame = WriteQueue.Total() - 1;
+	if (info->TransparentColor >= 0 || chunky.BytesPerPixel != 1 ||
+		(!Canvas.IsEmpty() && (Canvas.Width != chunky.Width || Canvas.Height != chunky.Height)))
+	{
+		Optimizing = false;
+		Changes.clear();
+		Canvas.Clear();
+		ReleaseLog();
+		if (!WriteQueue.KeepRecent())
+		{
+			BadWrite();
+		}
+		return;
+	}
+	FrameChange change;
+	change.Base = frame == 0 ? 0 : restored ? UnderFrame : frame - 1;
+	change.Rect = {};
+	change.Rect.Width = chunky.Width;
+	change.Rect.Height = chunky.Height;
+	if (!restored && frame > 0)
+	{
+		UnderFrame = frame - 1;
+	}
+	if (Canvas.IsEmpty())
+	{
+		Canvas = chunky.Scaled(1, 1);
+	}
+	else
+	{
+		MinimumArea(Canvas, chunky, change.Rect);
+		if (change.Rect.Width == 1 && change.Rect.Height == 1 &&
+			Canvas.Pixels[change.Rect.Left + change.Rect.Top * Canvas.Pitch] ==
+			chunky.Pixels[change.Rect.Left + change.Rect.Top * chunky.Pitch])
+		{
+			change.Rect.Width = change.Rect.Height = 0;
+		}
+	}
+	change.Pixels.resize(change.Rect.Width * change.Rect.Height);
+	for (int y = 0; y < change.Rect.Height; ++y)
+	{
+		size_t at = change.Rect.Left + (change.Rect.Top + y) * chunky.Pitch;
+		memcpy(&change.Pixels[y * change.Rect.Width], chunky.Pixels + at, change.Rect.Width);
+		memcpy(Canvas.Pixels + at, chunky.Pixels + at, change.Rect.Width);
+	}
+	Changes.push_back(std::move(change));
+}
+
+void GIFWriter::OptimizeFrames()
+{
+	std::deque<GIFFrame> &frames = WriteQueue.Frames();
+	size_t count = frames.size() - std::min(frames.size(), WriteQueue.DropCount());
+	if (Changes.size() != frames.size() || count < 2)
+	{
+		return;
+	}
+	auto palette = [this](const GIFFrame &frame) -> const SharedPalette &
+	{
+		return frame.LocalPalBits > 0 ? frame.LocalPalette : GlobalPal;
+	};
+
+	// Drop the frames that change nothing. Each frame's place among the kept
+	// ones is its slot, and a dropped frame's slot is the one of the frame
+	// before it, which looks the same.
+	std::vector<uint32_t> kept = { 0 }, slot(count);
+	for (uint32_t i = 1; i < count; ++i)
+	{
+		GIFFrame &last = frames[kept.back()];
+		if (Changes[i].Rect.Width == 0 && palette(frames[i]) == palette(last) &&
+			last.GCE.DelayTime + frames[i].GCE.DelayTime <= UINT16_MAX)
+		{
+			last.GCE.DelayTime += frames[i].GCE.DelayTime;
+		}
+		else
+		{
+			kept.push_back(i);
+		}
+		slot[i] = uint32_t(kept.size() - 1);
+	}
+
+	ChunkyBitmap canvas(Canvas.Width, Canvas.Height);
+	uint32_t applied = 0;
+	auto apply = [&](const FrameChange &change)
+	{
+		for (int y = 0; y < change.Rect.Height; ++y)
+		{
+			memcpy(canvas.Pixels + change.Rect.Left + (change.Rect.Top + y) * canvas.Pitch,
+				&change.Pixels[y * change.Rect.Width], change.Rect.Width);
+		}
+	};
+	apply(Changes[0]);
+	std::map<uint32_t, ChunkyBitmap> canvases;	// By slot, for every base still in use
+	canvases[0] = canvas.Scaled(1, 1);
+
+	std::vector<std::vector<Way>> ways(kept.size());
+	ways[0].push_back({ 0, frames[0].LZW.size(), 0, nullptr, {} });
+	for (uint32_t s = 1; s < kept.size(); ++s)
+	{
+		while (applied < kept[s])
+		{
+			apply(Changes[++applied]);
+		}
+		GIFFrame &frame = frames[kept[s]];
+		uint32_t base1 = slot[Changes[kept[s]].Base];
+		const std::vector<Way> &before = ways[s - 1];
+
+		// How big this frame is drawn over a base. That's already known for
+		// the one MakeFrame used. Drawing it over any other needs the same
+		// palette, and must not change how it looks.
+		auto draw = [&](uint32_t base, std::unique_ptr<GIFFrame> &made, FrameLogEntry &logentry) -> uint64_t
+		{
+			if (base == base1)
+			{
+				return frame.LZW.size();
+			}
+			if (palette(frame) != palette(frames[kept[base]]))
+			{
+				return UINT64_MAX;
+			}
+			made = std::make_unique<GIFFrame>();
+			made->IMD.Width = canvas.Width;
+			made->IMD.Height = canvas.Height;
+			made->GCE.DelayTime = frame.GCE.DelayTime;
+			made->LocalPalBits = frame.LocalPalBits;
+			made->LocalPalette = frame.LocalPalette;
+			FrameInfo info;
+			ChunkyBitmap chunky = canvas.Scaled(1, 1);
+			Compress(*made, &info, canvases[base], chunky, false, logentry);
+			if (memcmp(chunky.Pixels, canvas.Pixels, (size_t)canvas.Pitch * canvas.Height) != 0)
+			{
+				made.reset();
+				return UINT64_MAX;
+			}
+			return made->LZW.size();
+		};
+
+		// Over the frame before, which stays.
+		std::vector<Way> now(1);
+		size_t best = 0;
+		for (size_t w = 1; w < before.size(); ++w)
+		{
+			if (before[w].Size < before[best].Size)
+			{
+				best = w;
+			}
+		}
+		uint64_t size = draw(s - 1, now[0].Frame, now[0].Log);
+		now[0].Base = s - 1;
+		now[0].From = best;
+		now[0].Size = size == UINT64_MAX ? UINT64_MAX : before[best].Size + size;
+
+		// Over what was under the frame before, which is restored.
+		for (size_t w = 0; w < before.size() && s > 1; ++w)
+		{
+			if (before[w].Size == UINT64_MAX)
+			{
+				continue;
+			}
+			Way way;
+			size = draw(before[w].Base, way.Frame, way.Log);
+			if (size != UINT64_MAX)
+			{
+				way.Base = before[w].Base;
+				way.From = w;
+				way.Size = before[w].Size + size;
+				now.push_back(std::move(way));
+			}
+		}
+		// The way MakeFrame went is always kept, so there's at least one
+		// that gets to the end.
+		if (now.size() > BEAM_WIDTH)
+		{
+			std::partial_sort(now.begin() + 1, now.begin() + BEAM_WIDTH, now.end(),
+				[base1](const Way &a, const Way &b)
+				{
+					return std::make_pair(a.Base != base1, a.Size) < std::make_pair(b.Base != base1, b.Size);
+				});
+			now.resize(BEAM_WIDTH);
+		}
+		ways[s] = std::move(now);
+
+		canvases[s] = canvas.Scaled(1, 1);
+		for (auto it = canvases.begin(); it != canvases.end(); )
+		{
+			bool used = it->first == s;
+			for (const Way &way : ways[s])
+			{
+				used |= way.Base == it->first;
+			}
+			it = used ? std::next(it) : canvases.erase(it);
+		}
+	}
+
+	// Follow the best way to the last frame back to the first.
+	bool logging = HeldLog.size() == frames.size();
+	size_t w = 0;
+	for (size_t i = 1; i < ways.back().size(); ++i)
+	{
+		if (ways.back()[i].Size < ways.back()[w].Size)
+		{
+			w = i;
+		}
+	}
+	for (size_t s = kept.size() - 1; s > 0; --s)
+	{
+		Way &way = ways[s][w];
+		if (way.Frame != nullptr)
+		{
+			int disposal = frames[kept[s]].GCE.Flags & 0x1C;
+			frames[kept[s]] = std::move(*way.Frame);
+			frames[kept[s]].GCE.Flags |= disposal;
+			if (logging)
+			{
+				HeldLog[kept[s]].LZWTrans = way.Log.LZWTrans;
+				HeldLog[kept[s]].LZWOpaque = way.Log.LZWOpaque;
+			}
+		}
+		GIFFrame &before = frames[kept[s - 1]];
+		int disposal = way.Base == s - 1 ? 1 : 3;
+		before.GCE.Flags = (before.GCE.Flags & ~0x1C) | (disposal << 2);
+		w = way.From;
+	}
+
+	std::deque<GIFFrame> optimized;
+	for (uint32_t i : kept)
+	{
+		optimized.push_back(std::move(frames[i]));
+	}
+	for (size_t i = count; i < frames.size(); ++i)
+	{
+		optimized.push_back(std::move(frames[i]));
+	}
+	frames = std::move(optimized);
+	Changes.clear();
+
+	if (logging)
+	{
+		std::vector<FrameLogEntry> log;
+		for (size_t i = 0; i < kept.size(); ++i)
+		{
+			const GIFFrame &frame = frames[i];
+			FrameLogEntry entry = HeldLog[kept[i]];
+			entry.Rect = frame.IMD;
+			entry.TransparentColor = (frame.GCE.Flags & 1) ? frame.GCE.TransparentColor : -1;
+			entry.Disposal = (frame.GCE.Flags >> 2) & 7;
+			entry.LZWKept = frame.LZW.size();
+			log.push_back(entry);
+		}
+		log.insert(log.end(), HeldLog.begin() + count, HeldLog.end());
+		HeldLog = std::move(log);
+	}
+}
+
+// While optimizing, the log entries wait in HeldLog, since OptimizeFrames may
+// still change or drop their frames.
+void GIFWriter::LogFrame(const FrameLogEntry &entry)
+{
+	if (Optimizing)
+	{
+		HeldLog.push_back(entry);
+	}
+	else
+	{
+		Log->Add(entry);
+	}
+}
+
+void GIFWriter::LogDisposal(int method)
+{
+	if (Log == nullptr)
+	{
+		return;
+	}
+	if (Optimizing)
+	{
+		if (!HeldLog.empty())
+		{
+			HeldLog.back().Disposal = method;
+		}
+	}
+	else
+	{
+		Log->SetDisposal(method);
+	}
+}
+
+void GIFWriter::ReleaseLog()
+{
+	for (const FrameLogEntry &entry : HeldLog)
+	{
+		Log->Add(entry);
+	}
+	HeldLog.clear();
+}
@@ -0,0 +1,145 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Shared palettes: Every palette with the same colors is the same object,
+// found through a table of every palette in use. The table only holds weak
+// references, and a palette takes itself out of it when the last reference
+// to it goes away.
+
+#include <unordered_map>
+#include "iff2gif.h"
+
+struct SharedPalette::Colors
+{
+	std::vector<ColorRegister> Entries;
+	uint64_t Hash;
+	uint64_t Id;
+};
+
+namespace
+{
+	struct InternEntry
+	{
+		const SharedPalette::Colors *Ptr;
+		std::weak_ptr<const SharedPalette::Colors> Weak;
+	};
+
+	// Palettes are made on the reading and encoding threads, so the table
+	// is locked.
+	struct InternTable
+	{
+		std::mutex Lock;
+		std::unordered_multimap<uint64_t, InternEntry> Palettes;
+		uint64_t NextId = 1;
+	};
+}
+
+static InternTable &Table()
+{
+	// Never destroyed, so palettes that outlive main can still take
+	// themselves out of it.
+	static InternTable *table = new InternTable;
+	return *table;
+}
+
+static uint64_t HashColors(const std::vector<ColorRegister> &colors)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (const ColorRegister &color : colors)
+	{
+		hash = (hash ^ color.red) * 0x100000001b3ull;
+		hash = (hash ^ color.green) * 0x100000001b3ull;
+		hash = (hash ^ color.blue) * 0x100000001b3ull;
+	}
+	return hash;
+}
+
+SharedPalette::SharedPalette(std::vector<ColorRegister> &&colors)
+{
+	Intern(std::move(colors));
+}
+
+SharedPalette::SharedPalette(const std::vector<ColorRegister> &colors)
+{
+	Intern(std::vector<ColorRegister>(colors));
+}
+
+const std::vector<ColorRegister> &SharedPalette::Entries() const noexcept
+{
+	static const std::vector<ColorRegister> empty;
+	return Shared != nullptr ? Shared->Entries : empty;
+}
+
+uint64_t SharedPalette::Hash() const noexcept
+{
+	return Shared != nullptr ? Shared->Hash : 0;
+}
+
+uint64_t SharedPalette::Id() const noexcept
+{
+	return Shared != nullptr ? Shared->Id : 0;
+}
+
+SharedPalette SharedPalette::Resized(size_t size) const
+{
+	std::vector<ColorRegister> colors = Entries();
+	colors.resize(size);
+	return SharedPalette(std::move(colors));
+}
+
+void SharedPalette::Intern(std::vector<ColorRegister> &&colors)
+{
+	if (colors.empty())
+	{
+		return;
+	}
+	uint64_t hash = HashColors(colors);
+	InternTable &table = Table();
+	std::lock_guard<std::mutex> lock(table.Lock);
+	auto range = table.Palettes.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		// A palette whose last reference is gone, but that hasn't taken
+		// itself out yet, can't be locked, so a new one is made instead.
+		auto found = it->second.Weak.lock();
+		if (found != nullptr && found->Entries == colors)
+		{
+			Shared = std::move(found);
+			return;
+		}
+	}
+	auto made = new Colors{ std::move(colors), hash, table.NextId++ };
+	Shared = std::shared_ptr<const Colors>(made, [](const Colors *colors)
+	{
+		InternTable &table = Table();
+		{
+			std::lock_guard<std::mutex> lock(table.Lock);
+			auto range = table.Palettes.equal_range(colors->Hash);
+			for (auto it = range.first; it != range.second; ++it)
+			{
+				if (it->second.Ptr == colors)
+				{
+					table.Palettes.erase(it);
+					break;
+				}
+			}
+		}
+		delete colors;
+	});
+	table.Palettes.insert({ hash, { made, Shared } });
+}
@@ -49,17 +49,8 @@ PlanarBitmap::PlanarBitmap(int w, int h, int nPlanes)
 }
 
 PlanarBitmap::PlanarBitmap(const PlanarBitmap &o)
+	: FrameInfo(o), Pitch(o.Pitch)
 {
-	Width = o.Width;
-	Height = o.Height;
-	Pitch = o.Pitch;
-	NumPlanes = o.NumPlanes;
-	Palette = o.Palette;
-	TransparentColor = o.TransparentColor;
-	Interleave = o.Interleave;
-	Delay = o.Delay;
-	Rate = o.Rate;
-	ModeID = o.ModeID;
 
 	int realplanes = std::max(NumPlanes, 8);
 	PlaneData = new uint8_t[Pitch * Height * realplanes];
@@ -92,14 +83,41 @@ void PlanarBitmap::FillBitplane(int plane, bool set)
 	memset(Planes[plane], -(uint8_t)set, Pitch * Height);
 }
 
+// Combines the bits of every plane for one pixel. rowstart is the offset of
+// the pixel's row in each plane.
+inline uint32_t PlanarBitmap::GetPixel(uint32_t rowstart, int x) const
+{
+	const int bit = 7 - (x & 7);
+	const uint32_t byte = rowstart + (x >> 3);
+	uint32_t pixel = 0;
+	for (int i = NumPlanes - 1; i >= 0; --i)
+	{
+		pixel = (pixel << 1) | ((Planes[i][byte] >> bit) & 1);
+	}
+	return pixel;
+}
+
+void PlanarBitmap::ToChunky(void *dest, int destextrawidth) const
+{
+	ToChunky(dest, destextrawidth, 0, 0, Width, Height);
+}
+
 // Converts bitplanes to chunky pixels. The size of dest is selected based
 // on the number of planes:
 //	    0: do nothing
 //    1-8: one byte
 //	 9-16: two bytes
 //  17-32: four bytes
-void PlanarBitmap::ToChunky(void *dest, int destextrawidth) const
+// Only the given rectangle is converted. Whole bytes of the bitplanes are
+// converted 8 pixels at a time, and any pixels at the left and right edges
+// that share a byte with pixels outside the rectangle are done one by one.
+void PlanarBitmap::ToChunky(void *dest, int destextrawidth, int left, int top, int width, int height) const
 {
+	assert(left >= 0 && top >= 0 && left + width <= Width && top + height <= Height);
+	const int right = left + width;
+	const int alignedleft = std::min((left + 7) & ~7, right);
+	const int alignedright = std::max(right & ~7, alignedleft);
+
 	if (NumPlanes <= 0)
 	{
 		return;
@@ -107,26 +125,23 @@ void PlanarBitmap::ToChunky(void *dest, int destextrawidth) const
 	else if (NumPlanes <= 8)
 	{
 		uint8_t *out = (uint8_t *)dest;
-		uint32_t in = 0;
+		uint32_t in = top * Pitch;
 		const int srcstep = Pitch * Height;
-		for (int x, y = 0; y < Height; ++y)
+		for (int x, y = 0; y < height; ++y)
 		{
+			for (x = left; x < alignedleft; ++x)
+			{
+				*out++ = (uint8_t)GetPixel(in, x);
+			}
 			// Do 8 pixels at a time
-			for (x = 0; x < Width >> 3; ++x, out += 8)
+			for (; x < alignedright; x += 8, out += 8)
 			{
-				rotate8x8(PlaneData + in + x, srcstep, out, 1);
+				rotate8x8(PlaneData + in + (x >> 3), srcstep, out, 1);
 			}
 			// Do overflow
-			uint32_t byte = in + x;
-			for (x <<= 3; x < Width; ++x)
+			for (; x < right; ++x)
 			{
-				const int bit = 7 - (x & 7);
-				uint8_t pixel = 0;
-				for (int i = NumPlanes - 1; i >= 0; --i)
-				{
-					pixel = (pixel << 1) | ((Planes[i][byte] >> bit) & 1);
-				}
-				*out++ = pixel;
+				*out++ = (uint8_t)GetPixel(in, x);
 			}
 			out += destextrawidth;
 			in += Pitch;
@@ -135,18 +150,12 @@ void PlanarBitmap::ToChunky(void *dest, int destextrawidth) const
 	else if (NumPlanes <= 16)
 	{
 		uint16_t *out = (uint16_t *)dest;
-		uint32_t in = 0;
-		for (int y = 0; y < Height; ++y)
+		uint32_t in = top * Pitch;
+		for (int y = 0; y < height; ++y)
 		{
-			for (int x = 0; x < Width; ++x)
+			for (int x = left; x < right; ++x)
 			{
-				int bit = 7 - (x & 7), byte = in + (x >> 3);
-				uint16_t pixel = 0;
-				for (int i = NumPlanes - 1; i >= 0; --i)
-				{
-					pixel = (pixel << 1) | ((Planes[i][byte] >> bit) & 1);
-				}
-				*out++ = pixel;
+				*out++ = (uint16_t)GetPixel(in, x);
 			}
 			out += destextrawidth;
 			in += Pitch;
@@ -155,19 +164,34 @@ void PlanarBitmap::ToChunky(void *dest, int destextrawidth) const
 	else
 	{
 		uint8_t *out = (uint8_t *)dest;
-		uint32_t in = 0;
+		uint32_t in = top * Pitch;
 		const int srcstep = Pitch * Height;
-		for (int x, y = 0; y < Height; ++y)
+		auto onepixel = [&](int x)
+		{
+			uint32_t pixel = GetPixel(in, x);
+			if (NumPlanes < 32) pixel |= 0xFF000000;	// solid alpha if not 32-bit
+			out[0] = pixel & 0xFF;			// Red
+			out[1] = (pixel >> 8) & 0xFF;	// Green
+			out[2] = (pixel >> 16) & 0xFF;	// Blue
+			out[3] = (pixel >> 24) & 0xFF;	// Alpha
+			out += 4;
+		};
+		for (int x, y = 0; y < height; ++y)
 		{
+			for (x = left; x < alignedleft; ++x)
+			{
+				onepixel(x);
+			}
 			// Do 8 pixels at a time
-			for (x = 0; x < Width / 8; ++x, out += 8*4)
+			for (; x < alignedright; x += 8, out += 8*4)
 			{
-				rotate8x8(PlaneData + in + x, srcstep, out, 4);							// Red
-				rotate8x8(Planes[8] + in + x, srcstep, out + 1, 4);						// Green
-				rotate8x8(Planes[16] + in + x, srcstep, out + 2, 4);					// Blue
+				const uint32_t byte = in + (x >> 3);
+				rotate8x8(PlaneData + byte, srcstep, out, 4);							// Red
+				rotate8x8(Planes[8] + byte, srcstep, out + 1, 4);						// Green
+				rotate8x8(Planes[16] + byte, srcstep, out + 2, 4);						// Blue
 				if (Planes[24])															// Alpha
 				{
-					rotate8x8(Planes[24] + in + x, srcstep, out + 3, 4);
+					rotate8x8(Planes[24] + byte, srcstep, out + 3, 4);
 				}
 				else
 				{ // Set alpha to opaque for images that don't have an alpha channel.
@@ -177,24 +201,44 @@ void PlanarBitmap::ToChunky(void *dest, int destextrawidth) const
 				}
 			}
 			// Do overflow
-			uint32_t byte = in + x;
-			for (x *= 8; x < Width; ++x)
+			for (; x < right; ++x)
 			{
-				const int bit = 7 - (x & 7);
-				uint32_t pixel = 0;
-				for (int i = NumPlanes - 1; i >= 0; --i)
-				{
-					pixel = (pixel << 1) | ((Planes[i][byte] >> bit) & 1);
-				}
-				if (NumPlanes < 32) pixel |= 0xFF000000;	// solid alpha if not 32-bit
-				out[0] = pixel & 0xFF;			// Red
-				out[1] = (pixel >> 8) & 0xFF;	// Green
-				out[2] = (pixel >> 16) & 0xFF;	// Blue
-				out[3] = (pixel >> 24) & 0xFF;	// Alpha
-				out += 4;
+				onepixel(x);
 			}
 			out += destextrawidth * 4;
 			in += Pitch;
 		}
 	}
 }
+
+// Converts chunky pixels to bitplanes, using the same pixel sizes as ToChunky.
+// This isn't used for conversion to GIF, so it favors simplicity over speed.
+void PlanarBitmap::FromChunky(const void *src, int srcextrawidth)
+{
+	const int bpp = NumPlanes <= 8 ? 1 : NumPlanes <= 16 ? 2 : 4;
+	const uint8_t *in = (const uint8_t *)src;
+	for (int i = 0; i < NumPlanes; ++i)
+	{
+		FillBitplane(i, false);
+	}
+	for (int y = 0; y < Height; ++y)
+	{
+		for (int x = 0; x < Width; ++x, in += bpp)
+		{
+			// Deep pixels are stored as R, G, B, A bytes, which is little-endian
+			// with red in the lowest planes.
+			uint32_t pixel = bpp == 1 ? in[0] : bpp == 2 ? (in[0] | (in[1] << 8)) :
+				(in[0] | (in[1] << 8) | (in[2] << 16) | ((uint32_t)in[3] << 24));
+			const int byte = y * Pitch + (x >> 3);
+			const uint8_t bit = 0x80 >> (x & 7);
+			for (int i = 0; i < NumPlanes; ++i, pixel >>= 1)
+			{
+				if (pixel & 1)
+				{
+					Planes[i][byte] |= bit;
+				}
+			}
+		}
+		in += srcextrawidth * bpp;
+	}
+}
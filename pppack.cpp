@@ -0,0 +1,209 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A PowerPacker cruncher, so that synthesized files can exercise the
+// decruncher in ppunpack.cpp. See there for a description of the format.
+//
+// Since PowerPacker decrunches backwards, it is easiest to think of the data
+// as being reversed. Then it is ordinary LZ77: a match copies from (offset+1)
+// bytes before the current position. The only complications are that every
+// run of literals must be followed by a match (except at the very end), and
+// that the bitstream is read from the end of the file.
+
+#include <algorithm>
+#include <string.h>
+
+#include "iff2gif.h"
+
+static const uint8_t Efficiency[4] = { 9, 10, 12, 13 };
+
+class PPBitWriter
+{
+public:
+	// Values are read most significant bit first.
+	void Put(uint32_t val, unsigned nbits)
+	{
+		while (nbits-- > 0)
+		{
+			Bits.push_back((val >> nbits) & 1);
+		}
+	}
+
+	// Packs the bits into big endian words, starting with the low bit of the
+	// final word and working toward the front. Unused bits are added at the
+	// start of the stream, and the decruncher is told to skip them.
+	void Finish(std::vector<uint8_t> &out, uint8_t &skipbits)
+	{
+		skipbits = uint8_t((32 - Bits.size() % 32) % 32);
+		Bits.insert(Bits.begin(), skipbits, 0);
+		size_t numwords = Bits.size() / 32;
+		size_t base = out.size();
+		out.resize(base + numwords * 4);
+		for (size_t k = 0; k < numwords; ++k)
+		{
+			uint32_t word = 0;
+			for (int j = 0; j < 32; ++j)
+			{
+				word |= uint32_t(Bits[k * 32 + j]) << j;
+			}
+			uint8_t *p = &out[base + (numwords - 1 - k) * 4];
+			p[0] = uint8_t(word >> 24);
+			p[1] = uint8_t(word >> 16);
+			p[2] = uint8_t(word >> 8);
+			p[3] = uint8_t(word);
+		}
+	}
+
+private:
+	std::vector<uint8_t> Bits;
+};
+
+// The farthest back a match of the given length can reach.
+static unsigned MaxDistance(unsigned len)
+{
+	return 1u << Efficiency[std::min(len, 5u) - 2];
+}
+
+// The shortest match that can reach dist bytes back.
+static unsigned MinLength(unsigned dist)
+{
+	unsigned len = 2;
+	while (len < 5 && dist > MaxDistance(len))
+		len++;
+	return len;
+}
+
+static void PutLiterals(PPBitWriter &bits, const uint8_t *lits, unsigned count)
+{
+	bits.Put(0, 1);
+	unsigned extra = count - 1;
+	for (; extra >= 3; extra -= 3)
+	{
+		bits.Put(3, 2);
+	}
+	bits.Put(extra, 2);
+	for (unsigned i = 0; i < count; ++i)
+	{
+		bits.Put(lits[i], 8);
+	}
+}
+
+static void PutMatch(PPBitWriter &bits, unsigned len, unsigned dist)
+{
+	unsigned offset = dist - 1;
+	if (len < 5)
+	{
+		bits.Put(len - 2, 2);
+		bits.Put(offset, Efficiency[len - 2]);
+		return;
+	}
+	bits.Put(3, 2);
+	if (dist <= 128)
+	{
+		bits.Put(0, 1);
+		bits.Put(offset, 7);
+	}
+	else
+	{
+		bits.Put(1, 1);
+		bits.Put(offset, Efficiency[3]);
+	}
+	unsigned extra = len - 5;
+	for (; extra >= 7; extra -= 7)
+	{
+		bits.Put(7, 3);
+	}
+	bits.Put(extra, 3);
+}
+
+// Crunches data into a complete PP20 file. The length field only has room
+// for 24 bits, so data must be less than 16 MB.
+std::vector<uint8_t> PowerPack(const uint8_t *data, size_t len)
+{
+	const unsigned MAX_CHAIN = 256;
+	const size_t window = MaxDistance(5);
+	std::vector<uint8_t> rev(data, data + len);
+	std::reverse(rev.begin(), rev.end());
+	std::vector<int> head(65536, -1), prev(len, -1);
+	PPBitWriter bits;
+	size_t litstart = 0;
+
+	auto hash = [&](size_t i) { return rev[i] | (rev[i + 1] << 8); };
+	auto insert = [&](size_t i)
+	{
+		if (i + 1 < len)
+		{
+			int &h = head[hash(i)];
+			prev[i] = h;
+			h = (int)i;
+		}
+	};
+
+	for (size_t i = 0; i < len;)
+	{
+		unsigned bestlen = 0, bestdist = 0;
+		if (i + 1 < len)
+		{
+			unsigned chain = 0;
+			for (int c = head[hash(i)]; c >= 0 && i - c <= window && chain < MAX_CHAIN; c = prev[c], ++chain)
+			{
+				unsigned dist = unsigned(i - c);
+				unsigned m = 0;
+				while (i + m < len && rev[c + m] == rev[i + m])
+					m++;
+				// Short matches can't reach as far back as long ones.
+				if (m > bestlen && m >= MinLength(dist))
+				{
+					bestlen = m;
+					bestdist = dist;
+				}
+			}
+		}
+		if (bestlen >= 2)
+		{
+			if (i > litstart)
+				PutLiterals(bits, &rev[litstart], unsigned(i - litstart));
+			else
+				bits.Put(1, 1);
+			PutMatch(bits, bestlen, bestdist);
+			for (size_t j = i + bestlen; i < j; ++i)
+			{
+				insert(i);
+			}
+			litstart = i;
+		}
+		else
+		{
+			insert(i);
+			i++;
+		}
+	}
+	if (litstart < len)
+	{
+		PutLiterals(bits, &rev[litstart], unsigned(len - litstart));
+	}
+
+	std::vector<uint8_t> out = { 'P', 'P', '2', '0', Efficiency[0], Efficiency[1], Efficiency[2], Efficiency[3] };
+	uint8_t skipbits;
+	bits.Finish(out, skipbits);
+	out.push_back(uint8_t(len >> 16));
+	out.push_back(uint8_t(len >> 8));
+	out.push_back(uint8_t(len));
+	out.push_back(skipbits);
+	return out;
+}
@@ -270,13 +270,26 @@ std::unique_ptr<uint8_t[]> LoadPowerPackerFile(std::istream &file, size_t filesi
 	{
 		return nullptr;
 	}
-	unpackedsize = (packed[filesize - 4] << 16) | (packed[filesize - 3] << 8) | packed[filesize - 2];
+	return UnpackPowerPacker(packed.get(), filesize, unpackedsize);
+}
+
+// Decrunches an entire PowerPacker file that is already in memory.
+std::unique_ptr<uint8_t[]> UnpackPowerPacker(const uint8_t *packed, size_t packedsize, unsigned &unpackedsize)
+{
+	if (packedsize < 12)
+	{ // Not even room for the header and trailer.
+		fprintf(stderr, "PowerPacked data is truncated\n");
+		unpackedsize = 0;
+		return nullptr;
+	}
+	unpackedsize = (packed[packedsize - 4] << 16) | (packed[packedsize - 3] << 8) | packed[packedsize - 2];
 	std::unique_ptr<uint8_t[]> unpacked(new uint8_t[unpackedsize]);
-	PPBitstream bits(packed.get(), filesize);
+	PPBitstream bits(packed, packedsize);
 	if (PPUnpack(unpacked.get(), unpackedsize, bits))
 	{
 		return unpacked;
 	}
 	fprintf(stderr, "Failed to decompress PowerPacked data\n");
+	unpackedsize = 0;
 	return nullptr;
 }
\ No newline at end of file
@@ -0,0 +1,256 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Adaptive palettes: A histogram counts the colors of HAM and 24-bit frames
+// with 5 bits per channel, and median cut splits the box holding all of them
+// into as many boxes as the palette has room for. Each box becomes the
+// average of the colors in it.
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include "iff2gif.h"
+
+static const int HIST_BITS = 5;
+static const int HIST_SIDE = 1 << HIST_BITS;
+
+// Green matters most and red the least, as with the lossy LZW distance.
+static const int Weight[3] = { 2, 4, 3 };
+
+static inline int CellIndex(int r, int g, int b)
+{
+	return (r << (HIST_BITS * 2)) | (g << HIST_BITS) | b;
+}
+
+ColorHistogram::ColorHistogram()
+	: Cells(HIST_SIDE * HIST_SIDE * HIST_SIDE)
+{
+}
+
+void ColorHistogram::Clear()
+{
+	std::fill(Cells.begin(), Cells.end(), Cell());
+	Total = 0;
+}
+
+void ColorHistogram::Add(const ChunkyBitmap &rgb)
+{
+	assert(rgb.BytesPerPixel == 4);
+	const int shift = 8 - HIST_BITS;
+	for (int y = 0; y < rgb.Height; ++y)
+	{
+		const uint8_t *p = rgb.Pixels + y * rgb.Pitch;
+		for (int x = 0; x < rgb.Width; ++x, p += 4)
+		{
+			Cell &cell = Cells[CellIndex(p[0] >> shift, p[1] >> shift, p[2] >> shift)];
+			cell.Count++;
+			cell.Sum[0] += p[0];
+			cell.Sum[1] += p[1];
+			cell.Sum[2] += p[2];
+		}
+	}
+	Total += (uint64_t)rgb.Width * rgb.Height;
+}
+
+// A box of histogram cells, inclusive, shrunk to fit the cells in it that
+// are not empty.
+struct ColorHistogram::Box
+{
+	int Lo[3], Hi[3];
+	uint64_t Count;
+	double Spread;		// Weighted variance times Count; the biggest is split first
+};
+
+void ColorHistogram::Fit(Box &box) const
+{
+	int lo[3] = { HIST_SIDE, HIST_SIDE, HIST_SIDE }, hi[3] = { -1, -1, -1 };
+	double sum[3] = {}, sum2[3] = {};
+	uint64_t count = 0;
+	for (int r = box.Lo[0]; r <= box.Hi[0]; ++r)
+	{
+		for (int g = box.Lo[1]; g <= box.Hi[1]; ++g)
+		{
+			const Cell *cell = &Cells[CellIndex(r, g, box.Lo[2])];
+			for (int b = box.Lo[2]; b <= box.Hi[2]; ++b, ++cell)
+			{
+				if (cell->Count == 0)
+				{
+					continue;
+				}
+				int at[3] = { r, g, b };
+				for (int c = 0; c < 3; ++c)
+				{
+					lo[c] = std::min(lo[c], at[c]);
+					hi[c] = std::max(hi[c], at[c]);
+					sum[c] += (double)cell->Count * at[c];
+					sum2[c] += (double)cell->Count * at[c] * at[c];
+				}
+				count += cell->Count;
+			}
+		}
+	}
+	box.Count = count;
+	box.Spread = 0;
+	if (count == 0)
+	{
+		return;
+	}
+	for (int c = 0; c < 3; ++c)
+	{
+		box.Lo[c] = lo[c];
+		box.Hi[c] = hi[c];
+		box.Spread += Weight[c] * (sum2[c] - sum[c] * sum[c] / count);
+	}
+}
+
+// Splits box at the median of the channel it is most spread out along.
+// Returns false if it is only one cell.
+bool ColorHistogram::Split(Box &box, Box &other) const
+{
+	int best = -1;
+	double bestspread = -1;
+	uint64_t marginal[3][HIST_SIDE] = {};
+	for (int r = box.Lo[0]; r <= box.Hi[0]; ++r)
+	{
+		for (int g = box.Lo[1]; g <= box.Hi[1]; ++g)
+		{
+			const Cell *cell = &Cells[CellIndex(r, g, box.Lo[2])];
+			for (int b = box.Lo[2]; b <= box.Hi[2]; ++b, ++cell)
+			{
+				marginal[0][r] += cell->Count;
+				marginal[1][g] += cell->Count;
+				marginal[2][b] += cell->Count;
+			}
+		}
+	}
+	for (int c = 0; c < 3; ++c)
+	{
+		if (box.Lo[c] == box.Hi[c])
+		{
+			continue;
+		}
+		double sum = 0, sum2 = 0;
+		for (int i = box.Lo[c]; i <= box.Hi[c]; ++i)
+		{
+			sum += (double)marginal[c][i] * i;
+			sum2 += (double)marginal[c][i] * i * i;
+		}
+		double spread = Weight[c] * (sum2 - sum * sum / box.Count);
+		if (spread > bestspread)
+		{
+			best = c;
+			bestspread = spread;
+		}
+	}
+	if (best < 0)
+	{
+		return false;
+	}
+	// Both halves get at least one slice of the box.
+	uint64_t half = 0;
+	int cut = box.Lo[best];
+	while (cut < box.Hi[best] - 1 && half + marginal[best][cut] < box.Count / 2)
+	{
+		half += marginal[best][cut++];
+	}
+	other = box;
+	box.Hi[best] = cut;
+	other.Lo[best] = cut + 1;
+	Fit(box);
+	Fit(other);
+	return true;
+}
+
+std::vector<ColorRegister> ColorHistogram::MakePalette(int numcolors) const
+{
+	std::vector<Box> boxes(1);
+	for (int c = 0; c < 3; ++c)
+	{
+		boxes[0].Lo[c] = 0;
+		boxes[0].Hi[c] = HIST_SIDE - 1;
+	}
+	Fit(boxes[0]);
+	if (boxes[0].Count == 0)
+	{
+		return std::vector<ColorRegister>(1);
+	}
+	while ((int)boxes.size() < numcolors)
+	{
+		auto most = std::max_element(boxes.begin(), boxes.end(),
+			[](const Box &a, const Box &b) { return a.Spread < b.Spread; });
+		if (most->Spread <= 0)
+		{
+			break;		// Every box is a single color
+		}
+		Box other;
+		if (!Split(*most, other))
+		{
+			most->Spread = 0;
+			continue;
+		}
+		boxes.push_back(other);
+	}
+
+	std::vector<ColorRegister> pal;
+	for (const Box &box : boxes)
+	{
+		uint64_t sum[3] = {}, count = 0;
+		for (int r = box.Lo[0]; r <= box.Hi[0]; ++r)
+		{
+			for (int g = box.Lo[1]; g <= box.Hi[1]; ++g)
+			{
+				const Cell *cell = &Cells[CellIndex(r, g, box.Lo[2])];
+				for (int b = box.Lo[2]; b <= box.Hi[2]; ++b, ++cell)
+				{
+					sum[0] += cell->Sum[0];
+					sum[1] += cell->Sum[1];
+					sum[2] += cell->Sum[2];
+					count += cell->Count;
+				}
+			}
+		}
+		pal.emplace_back(uint8_t((sum[0] + count / 2) / count), uint8_t((sum[1] + count / 2) / count),
+			uint8_t((sum[2] + count / 2) / count));
+	}
+	return pal;
+}
+
+double ColorHistogram::Error(ColorLookup &lookup) const
+{
+	if (Total == 0)
+	{
+		return 0;
+	}
+	double error = 0;
+	for (const Cell &cell : Cells)
+	{
+		if (cell.Count == 0)
+		{
+			continue;
+		}
+		int rgb[3];
+		for (int c = 0; c < 3; ++c)
+		{
+			rgb[c] = int(cell.Sum[c] / cell.Count);
+		}
+		const ColorRegister &near = lookup.Palette[lookup.Nearest(rgb[0], rgb[1], rgb[2])];
+		int dr = rgb[0] - near.red, dg = rgb[1] - near.green, db = rgb[2] - near.blue;
+		error += (double)cell.Count * (Weight[0] * dr * dr + Weight[1] * dg * dg + Weight[2] * db * db);
+	}
+	return error / Total;
+}
@@ -0,0 +1,278 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <algorithm>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include "iff2gif.h"
+
+RawWriter::RawWriter(GIFSink &sink, tstring filename, const GIFOptions &options, Format format)
+	: Sink(sink), Filename(filename), OutFormat(format), Prep(options), ForcedFrameRate(options.ForcedRate > 0),
+	  Quiet(options.Quiet), Clips(options.Clips)
+{
+	if (options.ForcedRate > 0)
+	{
+		FrameRate = options.ForcedRate;
+	}
+	SortClips(Clips);
+	if (Clips.size() == 0)
+	{
+		Clips.push_back({ 1, UINT_MAX });
+	}
+}
+
+RawWriter::~RawWriter()
+{
+	Finish();
+}
+
+bool RawWriter::ParseFormat(const _TCHAR *name, Format &format)
+{
+	if (_tcscmp(name, _T("rgb")) == 0)
+	{
+		format = RGB24;
+	}
+	else if (_tcscmp(name, _T("rgba")) == 0)
+	{
+		format = RGBA;
+	}
+	else if (_tcscmp(name, _T("y4m")) == 0)
+	{
+		format = Y4M;
+	}
+	else
+	{
+		return false;
+	}
+	return true;
+}
+
+// Like GIFWriter, frames before the next clip aren't converted at all, except
+// for the first one, which decides the scale and crop.
+bool RawWriter::SkipFrame(const FrameInfo &info)
+{
+	if (FrameCount == 0 || (!Clips.empty() && FrameCount + 1 >= Clips[0].first))
+	{
+		return false;
+	}
+	if (info.Rate > 0 && !ForcedFrameRate)
+	{
+		FrameRate = info.Rate;
+	}
+	FrameCount++;
+	return true;
+}
+
+void RawWriter::AddFrame(PlanarBitmap *bitmap)
+{
+	if (Failed || SkipFrame(*bitmap))
+	{
+		return;
+	}
+	AddChunky(*bitmap, Prep.Convert(*bitmap));
+}
+
+void RawWriter::AddFrame(FrameInfo &info, ChunkyBitmap &&chunky)
+{
+	if (Failed || SkipFrame(info))
+	{
+		return;
+	}
+	AddChunky(info, Prep.Convert(info, std::move(chunky)));
+}
+
+void RawWriter::AddChunky(FrameInfo &info, ChunkyBitmap &&chunky)
+{
+	if (chunky.IsEmpty())
+	{
+		Failed = true;
+		return;
+	}
+	if (info.Rate > 0 && !ForcedFrameRate)
+	{
+		FrameRate = info.Rate;
+	}
+	FrameCount++;
+	if (Clips.empty())
+	{
+		return;
+	}
+	if (FrameCount >= Clips[0].first)
+	{
+		if (Width == 0)
+		{
+			Width = chunky.Width;
+			Height = chunky.Height;
+		}
+		else if (chunky.Width != Width || chunky.Height != Height)
+		{
+			_ftprintf(stderr, _T("Frame %u is not the same size as the first frame\n"), FrameCount);
+			Failed = true;
+			return;
+		}
+		// Just like a GIF, the time between this frame and the one before it
+		// belongs to the one before it. A delay of 0 means "as fast as
+		// possible", which is as short as a frame can be here.
+		if (!Queue.empty())
+		{
+			Queue.back().Repeat = std::clamp(info.Delay, 1, 0xFFFF);
+		}
+		FinalFramesToDrop = info.Interleave;
+		if (Queue.size() >= MAX_QUEUE_SIZE && !Shift())
+		{
+			return;
+		}
+		Queue.emplace_back();
+		Convert(info, chunky, Queue.back().Data);
+	}
+	if (FrameCount == Clips[0].second)
+	{
+		Clips.erase(begin(Clips));
+		// As with GIFWriter, the frames that repeat the start of the ANIM are
+		// only dropped when converting all the way to the end.
+		if (Clips.empty())
+		{
+			FinalFramesToDrop = 0;
+		}
+	}
+}
+
+// Converts a frame to RGBA (in that byte order) in dest.
+static void ToRGBA(const FrameInfo &info, const ChunkyBitmap &chunky, uint8_t *dest)
+{
+	if (chunky.BytesPerPixel != 1)
+	{
+		for (int y = 0; y < chunky.Height; ++y)
+		{
+			memcpy(dest, chunky.Pixels + y * chunky.Pitch, chunky.Width * 4);
+			dest += chunky.Width * 4;
+		}
+		return;
+	}
+	uint8_t pal[256][4] = {};
+	for (int i = 0; i < 256; ++i)
+	{
+		if ((size_t)i < info.Palette.size())
+		{
+			pal[i][0] = info.Palette[i].red;
+			pal[i][1] = info.Palette[i].green;
+			pal[i][2] = info.Palette[i].blue;
+		}
+		pal[i][3] = i == info.TransparentColor ? 0 : 0xFF;
+	}
+	for (int y = 0; y < chunky.Height; ++y)
+	{
+		const uint8_t *src = chunky.Pixels + y * chunky.Pitch;
+		for (int x = 0; x < chunky.Width; ++x, dest += 4)
+		{
+			memcpy(dest, pal[src[x]], 4);
+		}
+	}
+}
+
+void RawWriter::Convert(const FrameInfo &info, const ChunkyBitmap &chunky, std::vector<uint8_t> &out) const
+{
+	size_t pixels = (size_t)chunky.Width * chunky.Height;
+	if (OutFormat == RGBA)
+	{
+		out.resize(pixels * 4);
+		ToRGBA(info, chunky, out.data());
+		return;
+	}
+	std::vector<uint8_t> rgba(pixels * 4);
+	ToRGBA(info, chunky, rgba.data());
+	out.resize(pixels * 3);
+	const uint8_t *src = rgba.data();
+	if (OutFormat == RGB24)
+	{
+		for (size_t i = 0; i < pixels; ++i, src += 4)
+		{
+			memcpy(&out[i * 3], src, 3);
+		}
+	}
+	else
+	{
+		// Y4M is planar: All the Y values, then all the U, then all the V.
+		uint8_t *py = out.data(), *pu = py + pixels, *pv = pu + pixels;
+		for (size_t i = 0; i < pixels; ++i, src += 4)
+		{
+			int r = src[0], g = src[1], b = src[2];
+			py[i] = uint8_t(((66 * r + 129 * g + 25 * b + 128) >> 8) + 16);
+			pu[i] = uint8_t(((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128);
+			pv[i] = uint8_t(((112 * r - 94 * g - 18 * b + 128) >> 8) + 128);
+		}
+	}
+}
+
+// Write out the oldest frame as many times as it is displayed.
+bool RawWriter::Shift()
+{
+	if (Queue.empty())
+	{
+		return true;
+	}
+	if (!SinkOpen)
+	{
+		if (!Sink.Begin(Filename))
+		{
+			Failed = true;
+			Queue.clear();
+			return false;
+		}
+		SinkOpen = true;
+		if (OutFormat == Y4M)
+		{
+			char header[80];
+			int len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:1 Ip A1:1 C444\n",
+				Width, Height, FrameRate);
+			Failed = !Sink.Write(header, len);
+		}
+	}
+	const Pending &frame = Queue.front();
+	for (int i = 0; i < frame.Repeat && !Failed; ++i)
+	{
+		Failed = (OutFormat == Y4M && !Sink.Write("FRAME\n", 6)) ||
+			!Sink.Write(frame.Data.data(), frame.Data.size());
+		FramesWritten += !Failed;
+	}
+	Queue.pop_front();
+	if (Failed)
+	{
+		Queue.clear();
+	}
+	return !Failed;
+}
+
+bool RawWriter::Finish()
+{
+	if (!Finished)
+	{
+		Finished = true;
+		while (Queue.size() > FinalFramesToDrop && Shift())
+		{
+		}
+		Queue.clear();
+		if (SinkOpen)
+		{
+			SinkOpen = false;
+			Failed |= !Sink.End(!Failed);
+		}
+	}
+	return !Failed;
+}
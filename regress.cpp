@@ -0,0 +1,419 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Runs every file in a corpus through the whole LoadFile -> GIFWriter path
+// and records how fast it went and what it produced. The results can be
+// saved as a JSON baseline and compared against later builds, so that both
+// slowdowns and changes to the output get noticed.
+
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iff2gif.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "psapi.lib")
+#endif
+#else
+#include <sys/resource.h>
+#endif
+
+namespace fs = std::filesystem;
+
+struct FileResult
+{
+	std::string File;			// Relative to the corpus directory, with / separators
+	uint32_t Frames = 0;
+	uint64_t InputBytes = 0;
+	uint64_t OutputBytes = 0;
+	std::string Checksum;
+	double Seconds = 0;			// Best of all runs
+	uint64_t RSSGrowth = 0;		// How much converting this file raised the process's peak RSS
+
+	double FramesPerSec() const { return Seconds > 0 ? Frames / Seconds : 0; }
+	double InputMBPerSec() const { return Seconds > 0 ? InputBytes / Seconds / 1e6 : 0; }
+};
+
+static uint64_t PeakRSS()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc)))
+	{
+		return pmc.PeakWorkingSetSize;
+	}
+	return 0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) != 0)
+	{
+		return 0;
+	}
+#ifdef __APPLE__
+	return usage.ru_maxrss;			// Already in bytes
+#else
+	return usage.ru_maxrss * 1024ull;	// In kilobytes
+#endif
+#endif
+}
+
+// 64-bit FNV-1a, as a hex string.
+static std::string Checksum(const std::vector<uint8_t> &data)
+{
+	uint64_t hash = 0xcbf29ce484222325ull;
+	for (uint8_t byte : data)
+	{
+		hash = (hash ^ byte) * 0x100000001b3ull;
+	}
+	char hex[17];
+	snprintf(hex, sizeof(hex), "%016llx", (unsigned long long)hash);
+	return hex;
+}
+
+// Converts one file to a GIF in memory, returning the number of frames
+// written, or -1 if it couldn't be converted.
+static int Convert(const fs::path &input, std::vector<uint8_t> &gif, int diffusionmode)
+{
+	std::ifstream infile(input, std::ios_base::in | std::ios_base::binary);
+	if (!infile.is_open())
+	{
+		return -1;
+	}
+	std::basic_string<_TCHAR> inname = input.string<_TCHAR>();
+	GIFOptions options;
+	options.DiffusionMode = diffusionmode;
+	options.Quiet = true;
+	gif.clear();
+	MemorySink sink([&gif](std::vector<uint8_t> &&out)
+	{
+		gif = std::move(out);
+		return true;
+	});
+	GIFWriter writer(sink, inname, options);
+	bool loaded = LoadFile(&inname[0], infile, writer);
+	if (!writer.Finish() || !loaded || gif.empty())
+	{
+		return -1;
+	}
+	return (int)writer.GetFramesWritten();
+}
+
+static void WriteEscaped(FILE *file, const std::string &str)
+{
+	fputc('"', file);
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+			fputc('\\', file);
+		fputc(c, file);
+	}
+	fputc('"', file);
+}
+
+// Every file gets its own line, which ReadBaseline depends on.
+static bool WriteBaseline(const _TCHAR *filename, const std::vector<FileResult> &results, int runs, int diffusionmode)
+{
+	FILE *file = _tfopen(filename, _T("w"));
+	if (file == nullptr)
+	{
+		_ftprintf(stderr, _T("Could not open %s: %s\n"), filename, _tcserror(errno));
+		return false;
+	}
+	fprintf(file, "{\n\t\"runs\": %d,\n\t\"diffusion\": %d,\n\t\"peakrss\": %llu,\n\t\"files\": [\n",
+		runs, diffusionmode, (unsigned long long)PeakRSS());
+	for (size_t i = 0; i < results.size(); ++i)
+	{
+		const FileResult &r = results[i];
+		fprintf(file, "\t\t{ \"file\": ");
+		WriteEscaped(file, r.File);
+		fprintf(file, ", \"frames\": %u, \"inputbytes\": %llu, \"outputbytes\": %llu, \"checksum\": \"%s\", "
+			"\"seconds\": %.6f, \"framespersec\": %.2f, \"inputmbps\": %.3f, \"rssgrowth\": %llu }%s\n",
+			r.Frames, (unsigned long long)r.InputBytes, (unsigned long long)r.OutputBytes, r.Checksum.c_str(),
+			r.Seconds, r.FramesPerSec(), r.InputMBPerSec(), (unsigned long long)r.RSSGrowth,
+			i + 1 < results.size() ? "," : "");
+	}
+	fprintf(file, "\t]\n}\n");
+	return fclose(file) == 0;
+}
+
+// Finds "key": in line and returns a pointer to its value.
+static const char *FindKey(const std::string &line, const char *key)
+{
+	std::string pattern = std::string("\"") + key + "\": ";
+	size_t pos = line.find(pattern);
+	return pos == std::string::npos ? nullptr : line.c_str() + pos + pattern.size();
+}
+
+static std::string ReadString(const char *p)
+{
+	std::string str;
+	if (p == nullptr || *p++ != '"')
+		return str;
+	for (; *p != '\0' && *p != '"'; ++p)
+	{
+		if (*p == '\\' && p[1] != '\0')
+			++p;
+		str += *p;
+	}
+	return str;
+}
+
+// This only needs to read what WriteBaseline writes, so it is not a
+// general JSON parser.
+static bool ReadBaseline(const _TCHAR *filename, std::map<std::string, FileResult> &results, int &diffusionmode)
+{
+	std::ifstream file(filename);
+	if (!file.is_open())
+	{
+		_ftprintf(stderr, _T("Could not open %s: %s\n"), filename, _tcserror(errno));
+		return false;
+	}
+	std::string line;
+	while (std::getline(file, line))
+	{
+		const char *p;
+		if ((p = FindKey(line, "diffusion")) != nullptr && FindKey(line, "file") == nullptr)
+		{
+			diffusionmode = atoi(p);
+		}
+		if ((p = FindKey(line, "file")) == nullptr)
+		{
+			continue;
+		}
+		FileResult r;
+		r.File = ReadString(p);
+		if ((p = FindKey(line, "frames"))) r.Frames = (uint32_t)strtoul(p, nullptr, 10);
+		if ((p = FindKey(line, "inputbytes"))) r.InputBytes = strtoull(p, nullptr, 10);
+		if ((p = FindKey(line, "outputbytes"))) r.OutputBytes = strtoull(p, nullptr, 10);
+		if ((p = FindKey(line, "seconds"))) r.Seconds = strtod(p, nullptr);
+		if ((p = FindKey(line, "rssgrowth"))) r.RSSGrowth = strtoull(p, nullptr, 10);
+		r.Checksum = ReadString(FindKey(line, "checksum"));
+		results[r.File] = r;
+	}
+	return true;
+}
+
+// Returns the number of problems found. Files that could not be converted
+// are each a problem.
+static int Compare(const std::vector<FileResult> &results, const std::vector<std::string> &failed,
+	const std::map<std::string, FileResult> &baseline, double threshold)
+{
+	int problems = (int)failed.size();
+	double basesecs = 0, cursecs = 0;
+	uint64_t basebytes = 0, curbytes = 0;
+
+	for (const FileResult &cur : results)
+	{
+		auto it = baseline.find(cur.File);
+		if (it == baseline.end())
+		{
+			printf("%s: not in baseline\n", cur.File.c_str());
+			continue;
+		}
+		const FileResult &base = it->second;
+		if (cur.Frames != base.Frames || cur.OutputBytes != base.OutputBytes || cur.Checksum != base.Checksum)
+		{
+			printf("%s: OUTPUT CHANGED: %u frames, %llu bytes, %s (was %u frames, %llu bytes, %s)\n",
+				cur.File.c_str(), cur.Frames, (unsigned long long)cur.OutputBytes, cur.Checksum.c_str(),
+				base.Frames, (unsigned long long)base.OutputBytes, base.Checksum.c_str());
+			problems++;
+		}
+		double change = base.Seconds > 0 ? cur.Seconds / base.Seconds - 1 : 0;
+		if (change > threshold)
+		{
+			printf("%s: SLOWER by %.1f%% (%.6f s, was %.6f s)\n", cur.File.c_str(), change * 100, cur.Seconds, base.Seconds);
+			problems++;
+		}
+		basesecs += base.Seconds;
+		cursecs += cur.Seconds;
+		basebytes += base.InputBytes;
+		curbytes += cur.InputBytes;
+	}
+	for (const auto &base : baseline)
+	{
+		if (std::none_of(results.begin(), results.end(), [&](const FileResult &r) { return r.File == base.first; }) &&
+			std::find(failed.begin(), failed.end(), base.first) == failed.end())
+		{
+			printf("%s: missing from corpus\n", base.first.c_str());
+		}
+	}
+	// Small files are noisy, so the corpus as a whole gets checked too.
+	if (basesecs > 0 && cursecs > 0)
+	{
+		double change = cursecs / basesecs - 1;
+		printf("Total: %.3f MB/s, baseline %.3f MB/s (%+.1f%% time)\n",
+			curbytes / cursecs / 1e6, basebytes / basesecs / 1e6, change * 100);
+		if (change > threshold)
+		{
+			printf("Total: SLOWER by %.1f%%\n", change * 100);
+			problems++;
+		}
+	}
+	return problems;
+}
+
+static int usage(_TCHAR *progname)
+{
+	_ftprintf(stderr, _T(
+"Usage: %s [options] <corpus directory>\n"
+"  Converts every file in the corpus and reports the throughput, output size,\n"
+"  and output checksum of each.\n"
+"  Options:\n"
+"    -n <runs>        Convert each file this many times and keep the fastest.\n"
+"                     Default 3.\n"
+"    -w <baseline>    Write the results to a JSON baseline.\n"
+"    -c <baseline>    Compare the results against a JSON baseline. Exits with\n"
+"                     status 1 if anything is slower or produces different\n"
+"                     output. Files that can't be converted always do.\n"
+"    -t <percent>     How much slower counts as a regression. Default 10.\n"
+"    -d <mode>        Dithering mode to convert with. Default 1.\n"
+),
+		progname);
+	return 2;
+}
+
+int _tmain(int argc, _TCHAR *argv[])
+{
+	int runs = 3, diffusionmode = 1;
+	double threshold = 10;
+	_TCHAR *writename = nullptr, *comparename = nullptr;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "n:w:c:t:d:")) != -1)
+	{
+		switch (opt)
+		{
+		case 'n':
+			runs = std::max(1, _ttoi(optarg));
+			break;
+		case 'w':
+			writename = optarg;
+			break;
+		case 'c':
+			comparename = optarg;
+			break;
+		case 't':
+			threshold = _tcstod(optarg, nullptr);
+			break;
+		case 'd':
+			diffusionmode = _ttoi(optarg);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+	{
+		return usage(argv[0]);
+	}
+
+	std::map<std::string, FileResult> baseline;
+	if (comparename != nullptr)
+	{
+		int basediffusion = diffusionmode;
+		if (!ReadBaseline(comparename, baseline, basediffusion))
+		{
+			return 2;
+		}
+		if (basediffusion != diffusionmode)
+		{
+			_ftprintf(stderr, _T("Baseline used dithering mode %d, not %d\n"), basediffusion, diffusionmode);
+			return 2;
+		}
+	}
+
+	const fs::path corpus(argv[optind]);
+	std::vector<fs::path> inputs;
+	std::error_code ec;
+	for (fs::recursive_directory_iterator it(corpus, ec), end; !ec && it != end; it.increment(ec))
+	{
+		if (it->is_regular_file())
+		{
+			inputs.push_back(it->path());
+		}
+	}
+	if (ec)
+	{
+		fprintf(stderr, "Could not read corpus: %s\n", ec.message().c_str());
+		return 2;
+	}
+	std::sort(inputs.begin(), inputs.end());
+
+	std::vector<FileResult> results;
+	std::vector<std::string> failed;
+	std::vector<uint8_t> gif;
+	for (const fs::path &input : inputs)
+	{
+		FileResult r;
+		r.File = input.lexically_relative(corpus).generic_string();
+		r.InputBytes = fs::file_size(input, ec);
+		r.Seconds = 1e30;
+		// The peak can't be reset, so this only sees how far past every
+		// file before it this one went.
+		uint64_t peak = PeakRSS();
+		int frames = 0;
+		for (int run = 0; run < runs && frames >= 0; ++run)
+		{
+			auto start = std::chrono::steady_clock::now();
+			frames = Convert(input, gif, diffusionmode);
+			std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+			r.Seconds = std::min(r.Seconds, elapsed.count());
+		}
+		if (frames < 0)
+		{
+			fprintf(stderr, "Could not convert %s\n", r.File.c_str());
+			failed.push_back(r.File);
+			continue;
+		}
+		r.Frames = frames;
+		r.OutputBytes = gif.size();
+		r.Checksum = Checksum(gif);
+		r.RSSGrowth = PeakRSS() - peak;
+		results.push_back(r);
+	}
+
+	printf("%-32s %7s %12s %12s %10s %10s %10s\n", "file", "frames", "in bytes", "out bytes", "frames/s", "in MB/s", "+RSS MB");
+	for (const FileResult &r : results)
+	{
+		printf("%-32s %7u %12llu %12llu %10.1f %10.3f %10.1f\n", r.File.c_str(), r.Frames,
+			(unsigned long long)r.InputBytes, (unsigned long long)r.OutputBytes,
+			r.FramesPerSec(), r.InputMBPerSec(), r.RSSGrowth / 1048576.0);
+	}
+
+	if (writename != nullptr && !WriteBaseline(writename, results, runs, diffusionmode))
+	{
+		return 2;
+	}
+	if (comparename != nullptr)
+	{
+		int problems = Compare(results, failed, baseline, threshold / 100);
+		printf("%d problem%s found\n", problems, problems == 1 ? "" : "s");
+		return problems > 0 ? 1 : 0;
+	}
+	return failed.empty() ? 0 : 1;
+}
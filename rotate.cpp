@@ -27,10 +27,10 @@ typedef unsigned int bit32;
 
 #define table( name, n ) \
    static bit32 name[ 16 ] = { \
-      0x00000000<<n,0x00000001<<n,0x00000100<<n,0x00000101<<n, \
-      0x00010000<<n,0x00010001<<n,0x00010100<<n,0x00010101<<n, \
-      0x01000000<<n,0x01000001<<n,0x01000100<<n,0x01000101<<n, \
-      0x01010000<<n,0x01010001<<n,0x01010100<<n,0x01010101<<n };
+      0x00000000u<<n,0x00000001u<<n,0x00000100u<<n,0x00000101u<<n, \
+      0x00010000u<<n,0x00010001u<<n,0x00010100u<<n,0x00010101u<<n, \
+      0x01000000u<<n,0x01000001u<<n,0x01000100u<<n,0x01000101u<<n, \
+      0x01010000u<<n,0x01010001u<<n,0x01010100u<<n,0x01010101u<<n };
 
 table(ltab0, 0)
 table(ltab1, 1)
@@ -0,0 +1,503 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// A conversion server, for programs that convert many files and don't want
+// to start a new process for every one. The worker threads stay running
+// between requests. Requests come from a Unix domain socket or from stdin,
+// one per line:
+//
+//   <id> [options] <input> <output>
+//
+// id is any word. It starts the reply, so a client may have several requests
+// in flight at once; replies come in the order the conversions finish.
+// options are the same as the conversion options on the command line, and
+// are applied on top of the ones the server was started with. input is the
+// name of a file, or @<size> to send the file itself, in which case <size>
+// bytes of it follow the newline. output is the name of a file, or - to send
+// the GIF back. The reply is one line, either
+//
+//   <id> ok <frames>
+//   <id> ok <frames> <size>
+//   <id> error <message>
+//
+// frames is the number of frames in the GIF, or with -f, the number of GIFs.
+// If a deadline (-T) made the conversion give anything up, "degraded" and a
+// list like "retry,dither" are added to the end of an ok reply.
+// The second form is used when output is -, and <size> bytes of GIF follow
+// it. File names cannot contain whitespace. If the server was given a cache
+// directory, every request goes through it, except for those using -f.
+
+#include <stdio.h>
+#include <string.h>
+#include "iff2gif.h"
+
+#ifdef _WIN32
+
+int RunServer(const _TCHAR *socketpath, int threads, const GIFOptions &defaults, const _TCHAR *cachedir)
+{
+	_ftprintf(stderr, _T("Server mode is not supported on Windows\n"));
+	return 1;
+}
+
+#else
+
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <fstream>
+#include <mutex>
+#include <thread>
+
+static const size_t MAX_LINE = 64 * 1024;
+static const size_t MAX_INLINE = 256 * 1024 * 1024;
+
+static bool WriteAll(int fd, const void *data, size_t len)
+{
+	const char *p = (const char *)data;
+	while (len > 0)
+	{
+		ssize_t wrote = write(fd, p, len);
+		if (wrote < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return false;
+		}
+		p += wrote;
+		len -= wrote;
+	}
+	return true;
+}
+
+// One client. Its requests are read on one thread, but the replies are sent
+// by whichever worker ran each request, so sending is serialized.
+class Connection
+{
+public:
+	Connection(int in, int out) : In(in), Out(out) {}
+	~Connection()
+	{
+		if (In > STDERR_FILENO) close(In);
+		if (Out != In && Out > STDERR_FILENO) close(Out);
+	}
+
+	bool ReadLine(std::string &line);
+	bool ReadBytes(std::vector<uint8_t> &data, size_t len);
+	void Reply(const std::string &line, const std::vector<uint8_t> *data = nullptr);
+
+private:
+	bool Fill();
+
+	int In, Out;
+	std::vector<char> Buffer;
+	size_t Pos = 0;
+	std::mutex WriteLock;
+};
+
+// Reads more input, after discarding whatever has already been used.
+bool Connection::Fill()
+{
+	Buffer.erase(Buffer.begin(), Buffer.begin() + Pos);
+	Pos = 0;
+	size_t have = Buffer.size();
+	Buffer.resize(have + 65536);
+	ssize_t got;
+	do
+	{
+		got = read(In, &Buffer[have], Buffer.size() - have);
+	} while (got < 0 && errno == EINTR);
+	Buffer.resize(have + std::max<ssize_t>(got, 0));
+	return got > 0;
+}
+
+// Returns false at the end of input, or if the line is too long.
+bool Connection::ReadLine(std::string &line)
+{
+	for (;;)
+	{
+		auto start = Buffer.begin() + Pos;
+		auto nl = std::find(start, Buffer.end(), '\n');
+		if (nl != Buffer.end())
+		{
+			line.assign(start, nl);
+			Pos = nl - Buffer.begin() + 1;
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			return true;
+		}
+		if (Buffer.size() - Pos > MAX_LINE || !Fill())
+			return false;
+	}
+}
+
+bool Connection::ReadBytes(std::vector<uint8_t> &data, size_t len)
+{
+	size_t buffered = std::min(len, Buffer.size() - Pos);
+	data.assign(Buffer.begin() + Pos, Buffer.begin() + Pos + buffered);
+	Pos += buffered;
+	// Anything more is read directly, without passing through Buffer.
+	data.resize(len);
+	while (buffered < len)
+	{
+		ssize_t got = read(In, &data[buffered], len - buffered);
+		if (got < 0 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			return false;
+		buffered += got;
+	}
+	return true;
+}
+
+void Connection::Reply(const std::string &line, const std::vector<uint8_t> *data)
+{
+	std::lock_guard<std::mutex> lock(WriteLock);
+	// If the client went away, there's no one to tell about it.
+	if (WriteAll(Out, line.data(), line.size()) && WriteAll(Out, "\n", 1) && data != nullptr)
+	{
+		WriteAll(Out, data->data(), data->size());
+	}
+}
+
+struct Job
+{
+	std::shared_ptr<Connection> Conn;
+	std::string ID;
+	GIFOptions Options;
+	std::shared_ptr<const GIFCache> Cache;	// May be null
+	std::string Input;			// File name, empty if Data holds the file
+	std::string Output;			// File name, "-" to send the GIF back
+	size_t InlineSize = 0;
+	std::vector<uint8_t> Data;
+};
+
+// Parses everything but the id. Options are handled like getopt does,
+// including grouped flags and arguments attached to the option letter.
+static bool ParseRequest(const std::vector<std::string> &words, Job &job, std::string &error)
+{
+	size_t i = 1;
+	for (; i < words.size() && words[i].size() > 1 && words[i][0] == '-'; ++i)
+	{
+		if (words[i] == "--")
+		{
+			i++;
+			break;
+		}
+		for (size_t j = 1; j < words[i].size(); ++j)
+		{
+			int opt = words[i][j];
+			const char *spec = opt != ':' ? strchr(GIF_OPTIONS, opt) : nullptr;
+			if (spec == nullptr)
+			{
+				error = std::string("unknown option -") + char(opt);
+				return false;
+			}
+			const char *arg = nullptr;
+			if (spec[1] == ':')
+			{
+				if (j + 1 < words[i].size())
+					arg = words[i].c_str() + j + 1;
+				else if (i + 1 < words.size())
+					arg = words[++i].c_str();
+				else
+				{
+					error = std::string("option -") + char(opt) + " needs a value";
+					return false;
+				}
+			}
+			if (ParseGIFOption(opt, arg, job.Options) != 1)
+			{
+				error = std::string("bad value for -") + char(opt);
+				return false;
+			}
+			if (arg != nullptr)
+				break;
+		}
+	}
+	if (words.size() - i != 2)
+	{
+		error = "expected <id> [options] <input> <output>";
+		return false;
+	}
+	if (words[i][0] != '@')
+		job.Input = words[i];
+	job.Output = words[i + 1];
+	if (job.Options.Solo && job.Output == "-")
+	{
+		error = "-f needs an output file";
+		return false;
+	}
+	return true;
+}
+
+static bool OpenInput(Job &job, std::ifstream &file, std::string &error)
+{
+	file.open(job.Input, std::ios_base::in | std::ios_base::binary);
+	if (!file.is_open())
+	{
+		error = "could not open " + job.Input + ": " + strerror(errno);
+		return false;
+	}
+	return true;
+}
+
+static bool LoadInput(Job &job, GIFWriter &writer, std::string &error)
+{
+	if (job.Input.empty())
+	{
+		return LoadMemory(job.Data.data(), job.Data.size(), writer);
+	}
+	std::ifstream file;
+	return OpenInput(job, file, error) && LoadFile(&job.Input[0], file, writer);
+}
+
+// The cache needs all of the input in memory, and unpacked.
+static bool LoadCached(Job &job, std::vector<uint8_t> &gif, uint32_t &frames, std::string &error,
+	std::string &degraded)
+{
+	if (job.Input.empty())
+	{
+		if (!UnpackIfPowerPacked(job.Data))
+			return false;
+	}
+	else
+	{
+		std::ifstream file;
+		if (!OpenInput(job, file, error) || !ReadIFF(&job.Input[0], file, job.Data))
+			return false;
+	}
+	return job.Cache->Convert(job.Data.data(), job.Data.size(), job.Options,
+		job.Input.empty() ? _T("(memory)") : job.Input.c_str(), gif, frames, &degraded);
+}
+
+static void RunJob(Job &job)
+{
+	std::vector<uint8_t> gif;
+	std::string error, degraded;
+	uint32_t frames;
+	bool ok;
+
+	if (job.Cache != nullptr && !job.Options.Solo)
+	{
+		ok = LoadCached(job, gif, frames, error, degraded);
+		if (ok && job.Output != "-")
+		{
+			ok = WriteGIF(job.Output, gif);
+		}
+	}
+	else if (job.Output == "-")
+	{
+		MemorySink sink([&gif](std::vector<uint8_t> &&data)
+		{
+			gif = std::move(data);
+			return true;
+		});
+		GIFWriter writer(sink, _T("memory.gif"), job.Options);
+		ok = LoadInput(job, writer, error);
+		ok = writer.Finish() && ok && !gif.empty();
+		frames = writer.GetFramesWritten();
+		degraded = writer.DescribeDegraded();
+	}
+	else
+	{
+		FileSink sink;
+		GIFWriter writer(sink, job.Output, job.Options);
+		ok = LoadInput(job, writer, error);
+		ok = writer.Finish() && ok;
+		frames = writer.GetFramesWritten();
+		degraded = writer.DescribeDegraded();
+	}
+	if (!ok)
+	{
+		// Most problems are only described on stderr, so this can't
+		// always say what went wrong.
+		job.Conn->Reply(job.ID + " error " + (error.empty() ? "conversion failed" : error));
+	}
+	else
+	{
+		std::string reply = job.ID + " ok " + std::to_string(frames);
+		if (job.Output == "-")
+		{
+			reply += " " + std::to_string(gif.size());
+		}
+		if (!degraded.empty())
+		{
+			reply += " degraded " + degraded;
+		}
+		job.Conn->Reply(reply, job.Output == "-" ? &gif : nullptr);
+	}
+	// Don't hold onto the client or the input any longer than necessary.
+	job = Job();
+}
+
+// Reads requests from one client until it disconnects.
+static void ServeConnection(std::shared_ptr<Connection> conn, GIFOptions defaults, std::shared_ptr<const GIFCache> cache,
+	std::shared_ptr<WorkQueue<Job>> queue)
+{
+	std::string line;
+	while (conn->ReadLine(line))
+	{
+		std::vector<std::string> words;
+		for (size_t pos = line.find_first_not_of(" \t"); pos != std::string::npos; )
+		{
+			size_t end = line.find_first_of(" \t", pos);
+			words.push_back(line.substr(pos, end - pos));
+			pos = line.find_first_not_of(" \t", end);
+		}
+		if (words.empty())
+			continue;
+
+		Job job;
+		job.ID = words[0];
+		job.Options = defaults;
+		job.Cache = cache;
+		// Inline data must be read even if the rest of the request is bad,
+		// or the next request would be read from the middle of it.
+		if (words.size() >= 3 && words[words.size() - 2][0] == '@')
+		{
+			const char *size = words[words.size() - 2].c_str() + 1;
+			char *stop;
+			unsigned long long len = strtoull(size, &stop, 10);
+			if (*size < '0' || *size > '9' || *stop != 0 || len > MAX_INLINE)
+			{
+				conn->Reply(job.ID + " error bad input size");
+				return;
+			}
+			job.InlineSize = (size_t)len;
+			if (!conn->ReadBytes(job.Data, job.InlineSize))
+				return;
+		}
+		std::string error;
+		if (!ParseRequest(words, job, error))
+		{
+			conn->Reply(job.ID + " error " + error);
+			continue;
+		}
+		job.Conn = conn;
+		if (!queue->Push(std::move(job)))
+			return;
+	}
+}
+
+static int Listen(const char *socketpath, const GIFOptions &defaults, std::shared_ptr<const GIFCache> cache,
+	std::shared_ptr<WorkQueue<Job>> queue)
+{
+	sockaddr_un addr = {};
+	if (strlen(socketpath) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Socket name %s is too long\n", socketpath);
+		return 1;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, socketpath);
+
+	int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (listener < 0)
+	{
+		fprintf(stderr, "Could not create socket: %s\n", strerror(errno));
+		return 1;
+	}
+	// Remove a socket left behind by an earlier server, but nothing else.
+	struct stat st;
+	if (lstat(socketpath, &st) == 0 && S_ISSOCK(st.st_mode))
+	{
+		unlink(socketpath);
+	}
+	if (bind(listener, (sockaddr *)&addr, sizeof(addr)) != 0 || listen(listener, SOMAXCONN) != 0)
+	{
+		fprintf(stderr, "Could not listen on %s: %s\n", socketpath, strerror(errno));
+		close(listener);
+		return 1;
+	}
+	for (;;)
+	{
+		int client = accept(listener, nullptr, nullptr);
+		if (client >= 0)
+		{
+			std::thread(ServeConnection, std::make_shared<Connection>(client, client), defaults, cache, queue).detach();
+		}
+		else if (errno == EMFILE || errno == ENFILE || errno == ENOBUFS || errno == ENOMEM)
+		{ // Wait for some clients to finish.
+			std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		else if (errno != EINTR && errno != ECONNABORTED)
+		{
+			fprintf(stderr, "Could not accept connection: %s\n", strerror(errno));
+			close(listener);
+			return 1;
+		}
+	}
+}
+
+// With "-" for socketpath, serves requests from stdin until it ends, after
+// which it waits for every conversion to finish. Otherwise, it runs until
+// something goes wrong.
+int RunServer(const _TCHAR *socketpath, int threads, const GIFOptions &defaults, const _TCHAR *cachedir)
+{
+	std::shared_ptr<const GIFCache> cache;
+	if (cachedir != nullptr)
+	{
+		cache = std::make_shared<GIFCache>(cachedir);
+	}
+	GIFOptions options = defaults;
+	options.Quiet = true;	// stdout may be where the replies go
+	if (threads <= 0)
+	{
+		threads = std::max(1u, std::thread::hardware_concurrency());
+	}
+	// Writing to a client that disconnected should fail, not kill the server.
+	signal(SIGPIPE, SIG_IGN);
+
+	auto queue = std::make_shared<WorkQueue<Job>>(threads * 4);
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; ++i)
+	{
+		workers.emplace_back([queue]
+		{
+			Job job;
+			while (queue->Pop(job))
+			{
+				RunJob(job);
+			}
+		});
+	}
+
+	int status = 0;
+	if (strcmp(socketpath, "-") == 0)
+	{
+		ServeConnection(std::make_shared<Connection>(STDIN_FILENO, STDOUT_FILENO), options, cache, queue);
+	}
+	else
+	{
+		status = Listen(socketpath, options, cache, queue);
+	}
+	queue->Stop();
+	for (auto &worker : workers)
+	{
+		worker.join();
+	}
+	return status;
+}
+
+#endif
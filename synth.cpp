@@ -0,0 +1,464 @@
+/* This file is part of iff2gif.
+**
+** Copyright 2015-2019 - Marisa Heit
+**
+** iff2gif is free software : you can redistribute it and / or modify
+** it under the terms of the GNU General Public License as published by
+** the Free Software Foundation, either version 2 of the License, or
+** (at your option) any later version.
+**
+** iff2gif is distributed in the hope that it will be useful,
+** but WITHOUT ANY WARRANTY; without even the implied warranty of
+** MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.See the
+** GNU General Public License for more details.
+**
+** You should have received a copy of the GNU General Public License
+** along with iff2gif. If not, see <http://www.gnu.org/licenses/>.
+*/
+
+// Writes synthetic ILBMs and ANIMs of any size, depth, display mode, and
+// delta type, so the converter can be tested and timed on inputs that are
+// hard to find in the wild. The same seed always produces the same file.
+
+#include <algorithm>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "iff2gif.h"
+
+// A small deterministic PRNG (xorshift32), so files don't depend on the C library.
+class Random
+{
+public:
+	Random(uint32_t seed) : State(seed ? seed : 1) {}
+	uint32_t operator()() noexcept
+	{
+		State ^= State << 13;
+		State ^= State >> 17;
+		State ^= State << 5;
+		return State;
+	}
+	uint32_t operator()(uint32_t limit) noexcept { return (*this)() % limit; }
+
+private:
+	uint32_t State;
+};
+
+// A box that bounces around the screen. All positions are derived from the
+// frame number, so any frame can be drawn without drawing the ones before it.
+struct Sprite
+{
+	int X, Y, W, H, DX, DY;
+	uint8_t Color;
+	ColorRegister RGB;
+
+	static int Bounce(int pos, int range)
+	{
+		if (range <= 0)
+			return 0;
+		pos %= range * 2;
+		if (pos < 0)
+			pos += range * 2;
+		return pos < range ? pos : range * 2 - pos;
+	}
+	int Left(int frame, int width) const { return Bounce(X + DX * frame, width - W); }
+	int Top(int frame, int height) const { return Bounce(Y + DY * frame, height - H); }
+};
+
+struct Scene
+{
+	int Width, Height;
+	int NumColors;		// Colors available for drawing, not counting HAM
+	std::vector<Sprite> Sprites;
+
+	Scene(int width, int height, int numcolors, Random &rand)
+		: Width(width), Height(height), NumColors(numcolors)
+	{
+		for (int i = 0; i < 8; ++i)
+		{
+			Sprite s;
+			s.W = std::max(1, width / 10 + (int)rand(width / 10 + 1));
+			s.H = std::max(1, height / 10 + (int)rand(height / 10 + 1));
+			s.X = rand(width);
+			s.Y = rand(height);
+			s.DX = (int)rand(9) - 4;
+			s.DY = (int)rand(9) - 4;
+			s.Color = uint8_t(1 + rand(std::max(1, numcolors - 1)));
+			s.RGB = ColorRegister(rand(256), rand(256), rand(256));
+			Sprites.push_back(s);
+		}
+	}
+
+	// Horizontal bands for the background, with striped sprites on top.
+	void DrawIndexed(int frame, uint8_t *pixels) const
+	{
+		const int bands = std::min(NumColors - 1, 16);
+		for (int y = 0; y < Height; ++y)
+		{
+			memset(pixels + y * Width, bands > 0 ? 1 + y * bands / Height : 0, Width);
+		}
+		for (const Sprite &s : Sprites)
+		{
+			const int left = s.Left(frame, Width), top = s.Top(frame, Height);
+			for (int y = 0; y < s.H && top + y < Height; ++y)
+			{
+				uint8_t color = (y & 4) ? s.Color : uint8_t(s.Color ^ 1) % NumColors;
+				memset(pixels + (top + y) * Width + left, color, std::min(s.W, Width - left));
+			}
+		}
+	}
+
+	// A smooth gradient for the background, with solid sprites on top.
+	// Pixels are R, G, B, A.
+	void DrawRGB(int frame, uint8_t *pixels) const
+	{
+		for (int y = 0; y < Height; ++y)
+		{
+			for (int x = 0; x < Width; ++x)
+			{
+				uint8_t *p = pixels + (y * Width + x) * 4;
+				p[0] = uint8_t(x * 255 / std::max(1, Width - 1));
+				p[1] = uint8_t(y * 255 / std::max(1, Height - 1));
+				p[2] = 128;
+				p[3] = 0xFF;
+			}
+		}
+		for (const Sprite &s : Sprites)
+		{
+			const int left = s.Left(frame, Width), top = s.Top(frame, Height);
+			for (int y = top; y < top + s.H && y < Height; ++y)
+			{
+				for (int x = left; x < left + s.W && x < Width; ++x)
+				{
+					uint8_t *p = pixels + (y * Width + x) * 4;
+					p[0] = s.RGB.red;
+					p[1] = s.RGB.green;
+					p[2] = s.RGB.blue;
+				}
+			}
+		}
+	}
+};
+
+// Converts RGB pixels to HAM. At each pixel, this picks whichever of the
+// base palette or the three channel modifications comes closest. Like
+// HAM6toRGB and HAM8toRGB, the held color carries over from one row to the
+// next.
+static void EncodeHAM(const uint8_t *rgb, uint8_t *out, int count, const std::vector<ColorRegister> &pal, int depth)
+{
+	const int databits = depth - 2;
+	const int numbase = 1 << databits;
+	ColorRegister color = pal[0];
+	auto expand = [databits](int v) { return databits == 4 ? (v << 4) | v : (v << 2) | (v >> 4); };
+	auto dist = [](const ColorRegister &c, const uint8_t *p)
+	{
+		return (c.red - p[0]) * (c.red - p[0]) + (c.green - p[1]) * (c.green - p[1]) + (c.blue - p[2]) * (c.blue - p[2]);
+	};
+	for (int i = 0; i < count; ++i, rgb += 4)
+	{
+		int bestcode = 0, bestdist = INT_MAX;
+		ColorRegister bestcolor;
+		for (int j = 0; j < numbase; ++j)
+		{
+			int d = dist(pal[j], rgb);
+			if (d < bestdist)
+			{
+				bestdist = d, bestcode = j, bestcolor = pal[j];
+			}
+		}
+		// Modify blue, red, or green, in control code order.
+		static const int channels[3] = { 2, 0, 1 };
+		for (int k = 0; k < 3; ++k)
+		{
+			int v = rgb[channels[k]] >> (8 - databits);
+			ColorRegister c = color;
+			uint8_t *chan = channels[k] == 0 ? &c.red : channels[k] == 1 ? &c.green : &c.blue;
+			*chan = uint8_t(expand(v));
+			int d = dist(c, rgb);
+			if (d < bestdist)
+			{
+				bestdist = d, bestcode = ((k + 1) << databits) | v, bestcolor = c;
+			}
+		}
+		out[i] = uint8_t(bestcode);
+		color = bestcolor;
+	}
+}
+
+static int usage(_TCHAR *progname)
+{
+	_ftprintf(stderr, _T(
+"Usage: %s [options] <output.iff>\n"
+"  Options:\n"
+"    -w <width>       Width of the image. Default 320.\n"
+"    -h <height>      Height of the image. Default 200.\n"
+"    -d <depth>       Number of bitplanes, 1-8 or 24. Default 5.\n"
+"    -m <modes>       Comma-separated display modes: ham, ehb, hires, lace,\n"
+"                     superhires. ham and ehb imply the depth.\n"
+"    -n <frames>      Number of frames. More than one writes an ANIM. Default 1.\n"
+"    -o <op>          ANIM delta compression: 5, 7, or 8. Default 5.\n"
+"    -l               Use long data for ops 7 and 8.\n"
+"    -i <interleave>  Deltas modify the frame 1 or 2 back. Default 2.\n"
+"    -r <fps>         Frame rate for the DPAN chunk. Default 30.\n"
+"    -u               Don't compress the BODY.\n"
+"    -p               Crunch the file with PowerPacker.\n"
+"    -s <seed>        Seed for the contents. Default 1.\n"
+"    -f               Fade the palette in from black, with a CMAP in every\n"
+"                     frame of an ANIM.\n"
+),
+		progname);
+	return 1;
+}
+
+int _tmain(int argc, _TCHAR *argv[])
+{
+	int width = 320, height = 200, depth = 5;
+	int numframes = 1, op = 5, interleave = 2, rate = 30;
+	bool longdata = false, powerpack = false, fade = false;
+	Compression compression = cmpByteRun1;
+	uint32_t seed = 1, modeid = 0;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:h:d:m:n:o:li:r:ups:f")) != -1)
+	{
+		switch (opt)
+		{
+		case 'w':
+			width = _ttoi(optarg);
+			break;
+		case 'h':
+			height = _ttoi(optarg);
+			break;
+		case 'd':
+			depth = _ttoi(optarg);
+			break;
+		case 'm':
+			for (_TCHAR *mode = _tcstok(optarg, _T(",")); mode != nullptr; mode = _tcstok(nullptr, _T(",")))
+			{
+				if (_tcscmp(mode, _T("ham")) == 0) modeid |= HAM;
+				else if (_tcscmp(mode, _T("ehb")) == 0) modeid |= EXTRA_HALFBRITE;
+				else if (_tcscmp(mode, _T("hires")) == 0) modeid |= HIRES;
+				else if (_tcscmp(mode, _T("lace")) == 0) modeid |= LACE;
+				else if (_tcscmp(mode, _T("superhires")) == 0) modeid |= SUPERHIRES;
+				else
+				{
+					_ftprintf(stderr, _T("Unknown mode %s\n"), mode);
+					return 1;
+				}
+			}
+			break;
+		case 'n':
+			numframes = _ttoi(optarg);
+			break;
+		case 'o':
+			op = _ttoi(optarg);
+			break;
+		case 'l':
+			longdata = true;
+			break;
+		case 'i':
+			interleave = _ttoi(optarg);
+			break;
+		case 'r':
+			rate = _ttoi(optarg);
+			break;
+		case 'u':
+			compression = cmpNone;
+			break;
+		case 'p':
+			powerpack = true;
+			break;
+		case 's':
+			seed = (uint32_t)_tcstoul(optarg, nullptr, 0);
+			break;
+		case 'f':
+			fade = true;
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (optind != argc - 1)
+	{
+		return usage(argv[0]);
+	}
+	if (modeid & EXTRA_HALFBRITE)
+	{
+		depth = 6;
+	}
+	else if ((modeid & HAM) && depth != 8)
+	{
+		depth = 6;
+	}
+	if (width < 1 || height < 1 || width > 32767 || height > 32767)
+	{
+		_ftprintf(stderr, _T("Size must be between 1x1 and 32767x32767\n"));
+		return 1;
+	}
+	if ((depth < 1 || depth > 8) && depth != 24)
+	{
+		_ftprintf(stderr, _T("Depth must be 1-8 or 24\n"));
+		return 1;
+	}
+	if (numframes < 1)
+	{
+		_ftprintf(stderr, _T("Need at least one frame\n"));
+		return 1;
+	}
+	if (numframes > 1 && depth > 8)
+	{
+		_ftprintf(stderr, _T("Deltas only support up to 8 bitplanes\n"));
+		return 1;
+	}
+	if (op != 5 && op != 7 && op != 8)
+	{
+		_ftprintf(stderr, _T("Delta op must be 5, 7, or 8\n"));
+		return 1;
+	}
+	if (interleave != 1 && interleave != 2)
+	{
+		_ftprintf(stderr, _T("Interleave must be 1 or 2\n"));
+		return 1;
+	}
+
+	Random rand(seed);
+	const bool ham = (modeid & HAM) != 0;
+	const bool rgb = ham || depth > 8;
+	int numcolors = ham ? 1 << (depth - 2) : (modeid & EXTRA_HALFBRITE) ? 32 : depth > 8 ? 0 : 1 << depth;
+	std::vector<ColorRegister> palette(numcolors);
+	for (int i = 1; i < numcolors; ++i)
+	{
+		palette[i] = ColorRegister(rand(256), rand(256), rand(256));
+	}
+	if (ham)
+	{ // Make sure the base palette has some greys to start from.
+		for (int i = 0; i < numcolors; i += 4)
+		{
+			palette[i] = ColorRegister(i * 255 / numcolors, i * 255 / numcolors, i * 255 / numcolors);
+		}
+	}
+	// The palette a frame is shown with, which only changes if it fades in.
+	auto framepalette = [&](int frame)
+	{
+		std::vector<ColorRegister> faded = palette;
+		if (fade)
+		{
+			for (ColorRegister &color : faded)
+			{
+				color.red = uint8_t(color.red * (frame + 1) / numframes);
+				color.green = uint8_t(color.green * (frame + 1) / numframes);
+				color.blue = uint8_t(color.blue * (frame + 1) / numframes);
+			}
+		}
+		return faded;
+	};
+	Scene scene(width, height, (modeid & EXTRA_HALFBRITE) ? 64 : rgb ? 256 : numcolors, rand);
+
+	// Draws a frame of the scene in the planar format.
+	std::vector<uint8_t> chunky(width * height), rgbpixels(rgb ? width * height * 4 : 0);
+	auto draw = [&](int frame, PlanarBitmap &planar)
+	{
+		if (!rgb)
+		{
+			scene.DrawIndexed(frame, &chunky[0]);
+			planar.FromChunky(&chunky[0], 0);
+			return;
+		}
+		scene.DrawRGB(frame, &rgbpixels[0]);
+		if (ham)
+		{
+			EncodeHAM(&rgbpixels[0], &chunky[0], width * height, palette, depth);
+			planar.FromChunky(&chunky[0], 0);
+		}
+		else
+		{
+			planar.FromChunky(&rgbpixels[0], 0);
+		}
+	};
+
+	IFFWriter iff;
+	PlanarBitmap first(width, height, depth);
+	first.Palette = framepalette(0);
+	first.ModeID = modeid;
+	draw(0, first);
+	if (numframes > 1)
+	{
+		iff.PushForm(ID_ANIM);
+	}
+	iff.PushForm(ID_ILBM);
+	AddILBMHeader(iff, first, compression);
+	if (numframes > 1)
+	{
+		// ANIMs repeat the first frames at the end, so the player can loop
+		// back to the beginning with deltas.
+		const int total = numframes + interleave;
+		uint8_t dpan[8] = { 0, 4, uint8_t(total >> 8), uint8_t(total), uint8_t(rate), 0, 0, 0 };
+		iff.AddChunk(ID_DPAN, dpan, sizeof(dpan));
+	}
+	std::vector<uint8_t> chunk;
+	PackBody(first, compression, chunk);
+	iff.AddChunk(ID_BODY, chunk);
+	iff.PopForm();
+
+	if (numframes > 1)
+	{
+		// The last two frames, which are what the deltas are based on.
+		std::vector<std::unique_ptr<PlanarBitmap>> frames;
+		frames.emplace_back(new PlanarBitmap(first));
+		const int total = numframes + interleave;
+		const uint32_t reltime = std::max(1, 60 / std::max(rate, 1));
+		const uint32_t bits = longdata && op != 5 ? ANIM_LONG_DATA : 0;
+		for (int i = 1; i < total; ++i)
+		{
+			std::unique_ptr<PlanarBitmap> cur(new PlanarBitmap(first));
+			draw(i % numframes, *cur);
+			// The second frame is always based on the first.
+			const PlanarBitmap *base = frames[std::max(0, (int)frames.size() - interleave)].get();
+			if (!MakeDelta(*base, *cur, op, longdata, chunk))
+			{
+				_ftprintf(stderr, _T("Could not make delta for frame %d\n"), i);
+				return 1;
+			}
+			iff.PushForm(ID_ILBM);
+			iff.AddChunk(ID_ANHD, MakeANHD(uint8_t(op), bits, reltime, interleave == 2 ? 0 : 1));
+			if (fade && numcolors > 0)
+			{
+				std::vector<ColorRegister> faded = framepalette(i % numframes);
+				iff.AddChunk(ID_CMAP, &faded[0], uint32_t(faded.size() * 3));
+			}
+			iff.AddChunk(ID_DLTA, chunk);
+			iff.PopForm();
+			frames.push_back(std::move(cur));
+			if (frames.size() > 2)
+			{
+				frames.erase(frames.begin());
+			}
+		}
+		iff.PopForm();
+	}
+
+	std::vector<uint8_t> packed;
+	const std::vector<uint8_t> *out = &iff.GetData();
+	if (powerpack)
+	{
+		packed = PowerPack(out->data(), out->size());
+		out = &packed;
+	}
+	FILE *file = _tfopen(argv[optind], _T("wb"));
+	if (file == nullptr)
+	{
+		_ftprintf(stderr, _T("Could not open %s: %s\n"), argv[optind], _tcserror(errno));
+		return 1;
+	}
+	bool ok = fwrite(out->data(), 1, out->size(), file) == out->size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok)
+	{
+		_ftprintf(stderr, _T("Could not write %s\n"), argv[optind]);
+		return 1;
+	}
+	return 0;
+}
@@ -38,9 +38,13 @@ extern "C" {
 #endif
 
 #else
+#include <string.h>
+#include <unistd.h>
+
 // These macros are a pain in the butt to use, but they seemed like the least
 // amount of work to support Windows and other OSes with the same source.
 #define _TCHAR char
+#define _tmain main
 #define _T(x) x
 #define _ftprintf fprintf
 #define _tfopen fopen
@@ -51,8 +55,10 @@ extern "C" {
 #define _tcscmp strcmp
 #define _ttoi atoi
 #define _tcstok strtok
-#define _tcspbrk strbrk
+#define _tcspbrk strpbrk
 #define _tcstoul strtoul
+#define _tcstoull strtoull
+#define _tcstod strtod
 #define to_tstring std::to_string
 #endif
 